@@ -8,6 +8,7 @@
 #include <user/config.h>
 #include <user/paths.h>
 #include <user/registry.h>
+#include <utils/trace.h>
 
 static std::thread::id g_mainThreadId = std::this_thread::get_id();
 
@@ -20,6 +21,13 @@ void App::Restart(std::vector<std::string> restartArgs)
 void App::Exit()
 {
     Config::Save();
+    Video::SavePipelineCache();
+
+    if (Trace::s_isRecording)
+    {
+        Trace::StopRecording();
+        Trace::Export(Trace::GetExportPath(), true);
+    }
 
 #ifdef _WIN32
     timeEndPeriod(1);
@@ -12,6 +12,18 @@ void XAudioRegisterClient(PPCFunc* callback, uint32_t param);
 void XAudioSubmitFrame(void* samples);
 void XAudioConfigValueChangedCallback(class IConfigDef* configDef);
 
+struct XAudioStats
+{
+    uint32_t queuedFrames;
+    uint32_t targetFrames;
+    uint64_t underruns;
+    uint64_t overruns;
+    double averageSubmitTime;
+    double maxSubmitTime;
+};
+
+XAudioStats XAudioGetStats();
+
 uint32_t XAudioRegisterRenderDriverClient(be<uint32_t>* callback, be<uint32_t>* driver);
 uint32_t XAudioUnregisterRenderDriverClient(uint32_t driver);
 uint32_t XAudioSubmitRenderDriverFrame(uint32_t driver, void* samples);
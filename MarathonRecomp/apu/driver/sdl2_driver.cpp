@@ -1,19 +1,291 @@
 #include <apu/audio.h>
+#include <bit>
 #include <cpu/guest_thread.h>
 #include <kernel/heap.h>
 #include <os/logger.h>
 #include <user/config.h>
+#include <utils/trace.h>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define XAUDIO_SUBMIT_SSE
+#include <immintrin.h>
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define XAUDIO_SUBMIT_NEON
+#include <arm_neon.h>
+#endif
+
+// Single producer, single consumer queue of interleaved samples between the audio
+// thread and the SDL device callback. Positions only ever increase and get wrapped
+// with the mask on access, so a full ring can be told apart from an empty one.
+struct AudioRing
+{
+    static constexpr size_t MAX_FRAME_COUNT = 32;
+    static constexpr size_t CAPACITY = std::bit_ceil(MAX_FRAME_COUNT * XAUDIO_NUM_SAMPLES * XAUDIO_NUM_CHANNELS);
+
+    std::unique_ptr<float[]> samples = std::make_unique<float[]>(CAPACITY);
+    alignas(64) std::atomic<size_t> readPosition;
+    alignas(64) std::atomic<size_t> writePosition;
+
+    size_t GetQueuedCount() const
+    {
+        return writePosition.load(std::memory_order_acquire) - readPosition.load(std::memory_order_acquire);
+    }
+
+    bool Write(const float* data, size_t count)
+    {
+        size_t write = writePosition.load(std::memory_order_relaxed);
+        size_t read = readPosition.load(std::memory_order_acquire);
+
+        if (CAPACITY - (write - read) < count)
+            return false;
+
+        size_t offset = write & (CAPACITY - 1);
+        size_t firstCount = std::min(count, CAPACITY - offset);
+
+        memcpy(&samples[offset], data, firstCount * sizeof(float));
+        memcpy(&samples[0], data + firstCount, (count - firstCount) * sizeof(float));
+
+        writePosition.store(write + count, std::memory_order_release);
+        return true;
+    }
+
+    size_t Read(float* data, size_t count)
+    {
+        size_t read = readPosition.load(std::memory_order_relaxed);
+        size_t write = writePosition.load(std::memory_order_acquire);
+
+        count = std::min(count, write - read);
+
+        size_t offset = read & (CAPACITY - 1);
+        size_t firstCount = std::min(count, CAPACITY - offset);
+
+        memcpy(data, &samples[offset], firstCount * sizeof(float));
+        memcpy(data + firstCount, &samples[0], (count - firstCount) * sizeof(float));
+
+        readPosition.store(read + count, std::memory_order_release);
+        return count;
+    }
+
+    // Only safe while neither side is running.
+    void Reset()
+    {
+        readPosition.store(0);
+        writePosition.store(0);
+    }
+};
 
 static PPCFunc* g_clientCallback{};
 static uint32_t g_clientCallbackParam{}; // pointer in guest memory
 static SDL_AudioDeviceID g_audioDevice{};
 static bool g_downMixToStereo;
+static AudioRing g_audioRing;
+static SDL_sem* g_audioConsumedSemaphore;
+static std::atomic<uint64_t> g_audioUnderruns;
+static std::atomic<uint64_t> g_audioOverruns;
+static std::atomic<uint64_t> g_audioSubmitCount;
+static std::atomic<uint64_t> g_audioTotalSubmitTime;
+static std::atomic<uint64_t> g_audioMaxSubmitTime;
+
+// Levels of each guest channel in the left and right output channels, with
+// the master volume already applied. Guest channels are in the usual 5.1 order
+// of front left, front right, center, LFE, surround left and surround right.
+struct AudioDownmixMatrix
+{
+    float left[XAUDIO_NUM_CHANNELS];
+    float right[XAUDIO_NUM_CHANNELS];
+};
+
+static AudioDownmixMatrix GetDownmixMatrix()
+{
+    float volume = Config::MasterVolume;
+    float center = Config::DownmixCenterLevel * volume;
+    float lfe = Config::DownmixLFELevel * volume;
+    float surround = Config::DownmixSurroundLevel * volume;
+
+    return
+    {
+        { volume, 0.0f, center, lfe, surround, 0.0f },
+        { 0.0f, volume, center, lfe, 0.0f, surround }
+    };
+}
+
+// Frames from the guest are planar big endian floats, one plane of
+// XAUDIO_NUM_SAMPLES samples per channel. The device wants them interleaved
+// in native endianness, so both the downmix and the surround path swap,
+// scale and interleave in a single pass, four samples at a time.
+#if defined(XAUDIO_SUBMIT_SSE)
+
+static __m128 LoadSamples(const be<float>* in)
+{
+    const __m128i shuffle = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    return _mm_castsi128_ps(_mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in)), shuffle));
+}
+
+static void DownmixToStereo(float* out, const be<float>* in, const AudioDownmixMatrix& matrix)
+{
+    __m128 left[XAUDIO_NUM_CHANNELS];
+    __m128 right[XAUDIO_NUM_CHANNELS];
+
+    for (size_t i = 0; i < XAUDIO_NUM_CHANNELS; i++)
+    {
+        left[i] = _mm_set1_ps(matrix.left[i]);
+        right[i] = _mm_set1_ps(matrix.right[i]);
+    }
+
+    for (size_t i = 0; i < XAUDIO_NUM_SAMPLES; i += 4)
+    {
+        __m128 leftSum = _mm_setzero_ps();
+        __m128 rightSum = _mm_setzero_ps();
+
+        for (size_t j = 0; j < XAUDIO_NUM_CHANNELS; j++)
+        {
+            __m128 samples = LoadSamples(in + j * XAUDIO_NUM_SAMPLES + i);
+            leftSum = _mm_add_ps(leftSum, _mm_mul_ps(samples, left[j]));
+            rightSum = _mm_add_ps(rightSum, _mm_mul_ps(samples, right[j]));
+        }
+
+        _mm_storeu_ps(out + i * 2, _mm_unpacklo_ps(leftSum, rightSum));
+        _mm_storeu_ps(out + i * 2 + 4, _mm_unpackhi_ps(leftSum, rightSum));
+    }
+}
+
+static void InterleaveSurround(float* out, const be<float>* in, float volume)
+{
+    const __m128 scale = _mm_set1_ps(volume);
+
+    for (size_t i = 0; i < XAUDIO_NUM_SAMPLES; i += 4)
+    {
+        __m128 ch[XAUDIO_NUM_CHANNELS];
+
+        for (size_t j = 0; j < XAUDIO_NUM_CHANNELS; j++)
+            ch[j] = _mm_mul_ps(LoadSamples(in + j * XAUDIO_NUM_SAMPLES + i), scale);
+
+        // Pairs of channels for samples 0 and 1 in the low halves, 2 and 3 in the high halves.
+        __m128 lo01 = _mm_unpacklo_ps(ch[0], ch[1]);
+        __m128 lo23 = _mm_unpacklo_ps(ch[2], ch[3]);
+        __m128 lo45 = _mm_unpacklo_ps(ch[4], ch[5]);
+        __m128 hi01 = _mm_unpackhi_ps(ch[0], ch[1]);
+        __m128 hi23 = _mm_unpackhi_ps(ch[2], ch[3]);
+        __m128 hi45 = _mm_unpackhi_ps(ch[4], ch[5]);
+
+        float* dest = out + i * XAUDIO_NUM_CHANNELS;
+        _mm_storeu_ps(dest + 0, _mm_movelh_ps(lo01, lo23));
+        _mm_storeu_ps(dest + 4, _mm_shuffle_ps(lo45, lo01, _MM_SHUFFLE(3, 2, 1, 0)));
+        _mm_storeu_ps(dest + 8, _mm_movehl_ps(lo45, lo23));
+        _mm_storeu_ps(dest + 12, _mm_movelh_ps(hi01, hi23));
+        _mm_storeu_ps(dest + 16, _mm_shuffle_ps(hi45, hi01, _MM_SHUFFLE(3, 2, 1, 0)));
+        _mm_storeu_ps(dest + 20, _mm_movehl_ps(hi45, hi23));
+    }
+}
+
+#elif defined(XAUDIO_SUBMIT_NEON)
+
+static float32x4_t LoadSamples(const be<float>* in)
+{
+    return vreinterpretq_f32_u8(vrev32q_u8(vld1q_u8(reinterpret_cast<const uint8_t*>(in))));
+}
+
+static void DownmixToStereo(float* out, const be<float>* in, const AudioDownmixMatrix& matrix)
+{
+    for (size_t i = 0; i < XAUDIO_NUM_SAMPLES; i += 4)
+    {
+        float32x4_t leftSum = vdupq_n_f32(0.0f);
+        float32x4_t rightSum = vdupq_n_f32(0.0f);
+
+        for (size_t j = 0; j < XAUDIO_NUM_CHANNELS; j++)
+        {
+            float32x4_t samples = LoadSamples(in + j * XAUDIO_NUM_SAMPLES + i);
+            leftSum = vmlaq_n_f32(leftSum, samples, matrix.left[j]);
+            rightSum = vmlaq_n_f32(rightSum, samples, matrix.right[j]);
+        }
+
+        vst2q_f32(out + i * 2, float32x4x2_t{ { leftSum, rightSum } });
+    }
+}
+
+static void InterleaveSurround(float* out, const be<float>* in, float volume)
+{
+    for (size_t i = 0; i < XAUDIO_NUM_SAMPLES; i += 4)
+    {
+        float32x4_t ch[XAUDIO_NUM_CHANNELS];
+
+        for (size_t j = 0; j < XAUDIO_NUM_CHANNELS; j++)
+            ch[j] = vmulq_n_f32(LoadSamples(in + j * XAUDIO_NUM_SAMPLES + i), volume);
+
+        // Pairs of channels for samples 0 and 1 in val[0], 2 and 3 in val[1].
+        float32x4x2_t ch01 = vzipq_f32(ch[0], ch[1]);
+        float32x4x2_t ch23 = vzipq_f32(ch[2], ch[3]);
+        float32x4x2_t ch45 = vzipq_f32(ch[4], ch[5]);
+
+        float* dest = out + i * XAUDIO_NUM_CHANNELS;
+
+        for (size_t j = 0; j < 2; j++)
+        {
+            vst1q_f32(dest + j * 12 + 0, vcombine_f32(vget_low_f32(ch01.val[j]), vget_low_f32(ch23.val[j])));
+            vst1q_f32(dest + j * 12 + 4, vcombine_f32(vget_low_f32(ch45.val[j]), vget_high_f32(ch01.val[j])));
+            vst1q_f32(dest + j * 12 + 8, vcombine_f32(vget_high_f32(ch23.val[j]), vget_high_f32(ch45.val[j])));
+        }
+    }
+}
+
+#else
+
+static void DownmixToStereo(float* out, const be<float>* in, const AudioDownmixMatrix& matrix)
+{
+    for (size_t i = 0; i < XAUDIO_NUM_SAMPLES; i++)
+    {
+        float left = 0.0f;
+        float right = 0.0f;
+
+        for (size_t j = 0; j < XAUDIO_NUM_CHANNELS; j++)
+        {
+            float sample = in[j * XAUDIO_NUM_SAMPLES + i];
+            left += sample * matrix.left[j];
+            right += sample * matrix.right[j];
+        }
+
+        out[i * 2 + 0] = left;
+        out[i * 2 + 1] = right;
+    }
+}
+
+static void InterleaveSurround(float* out, const be<float>* in, float volume)
+{
+    for (size_t i = 0; i < XAUDIO_NUM_SAMPLES; i++)
+    {
+        for (size_t j = 0; j < XAUDIO_NUM_CHANNELS; j++)
+            out[i * XAUDIO_NUM_CHANNELS + j] = in[j * XAUDIO_NUM_SAMPLES + i] * volume;
+    }
+}
+
+#endif
+
+static void AudioCallback(void* userData, uint8_t* stream, int len)
+{
+    auto samples = reinterpret_cast<float*>(stream);
+    size_t count = size_t(len) / sizeof(float);
+    size_t readCount = g_audioRing.Read(samples, count);
+
+    if (readCount < count)
+    {
+        std::fill(samples + readCount, samples + count, 0.0f);
+
+        // Nothing being queued yet at startup is not a glitch.
+        if (g_audioRing.writePosition.load(std::memory_order_relaxed) != 0)
+            ++g_audioUnderruns;
+    }
+
+    SDL_SemPost(g_audioConsumedSemaphore);
+}
 
 static void CreateAudioDevice()
 {
     if (g_audioDevice != NULL)
         SDL_CloseAudioDevice(g_audioDevice);
 
+    // The device callback can't be running anymore at this point.
+    g_audioRing.Reset();
+
     bool surround = Config::ChannelConfiguration == EChannelConfiguration::Surround;
     int allowedChanges = surround ? SDL_AUDIO_ALLOW_CHANNELS_CHANGE : 0;
 
@@ -22,6 +294,7 @@ static void CreateAudioDevice()
     desired.format = AUDIO_F32SYS;
     desired.channels = surround ? XAUDIO_NUM_CHANNELS : 2;
     desired.samples = XAUDIO_NUM_SAMPLES;
+    desired.callback = AudioCallback;
     g_audioDevice = SDL_OpenAudioDevice(nullptr, 0, &desired, &obtained, allowedChanges);
 
     if (obtained.channels != 2 && obtained.channels != XAUDIO_NUM_CHANNELS) // This check may fail only when surround sound is enabled.
@@ -52,40 +325,52 @@ void XAudioInitializeSystem()
         return;
     }
 
+    g_audioConsumedSemaphore = SDL_CreateSemaphore(0);
+
     CreateAudioDevice();
 }
 
 static std::unique_ptr<std::thread> g_audioThread;
 static volatile bool g_audioThreadShouldExit;
 
-static void AudioThread()
+static size_t GetTargetLatencyFrames()
 {
-    using namespace std::chrono_literals;
+    size_t frameCount = (size_t(Config::AudioLatency) * XAUDIO_SAMPLES_HZ / 1000 + XAUDIO_NUM_SAMPLES - 1) / XAUDIO_NUM_SAMPLES;
+    return std::clamp<size_t>(frameCount, 1, AudioRing::MAX_FRAME_COUNT);
+}
 
+static void AudioThread()
+{
     GuestThreadContext ctx(0);
 
+    Trace::SetThreadName("Audio Thread");
+
     size_t channels = g_downMixToStereo ? 2 : XAUDIO_NUM_CHANNELS;
 
     while (!g_audioThreadShouldExit)
     {
-        uint32_t queuedAudioSize = SDL_GetQueuedAudioSize(g_audioDevice);
-        constexpr size_t MAX_LATENCY = 10;
-        const size_t callbackAudioSize = channels * XAUDIO_NUM_SAMPLES * sizeof(float);
+        size_t queuedFrames = g_audioRing.GetQueuedCount() / (channels * XAUDIO_NUM_SAMPLES);
 
-        if ((queuedAudioSize / callbackAudioSize) <= MAX_LATENCY)
+        Trace::AddCounter("Queued Audio Frames", int64_t(queuedFrames));
+
+        if (queuedFrames < GetTargetLatencyFrames())
         {
-            ctx.ppcContext.r3.u32 = g_clientCallbackParam;
-            g_clientCallback(ctx.ppcContext, g_memory.base);
-        }
+            size_t writePosition = g_audioRing.writePosition.load(std::memory_order_relaxed);
+            {
+                TraceScope traceScope("Audio Callback");
 
-        auto now = std::chrono::steady_clock::now();
-        constexpr auto INTERVAL = 1000000000ns * XAUDIO_NUM_SAMPLES / XAUDIO_SAMPLES_HZ;
-        auto next = now + (INTERVAL - now.time_since_epoch() % INTERVAL);
+                ctx.ppcContext.r3.u32 = g_clientCallbackParam;
+                g_clientCallback(ctx.ppcContext, g_memory.base);
+            }
 
-        std::this_thread::sleep_for(std::chrono::floor<std::chrono::milliseconds>(next - now));
+            // Keep topping up the ring as long as the client is producing frames.
+            if (g_audioRing.writePosition.load(std::memory_order_relaxed) != writePosition)
+                continue;
+        }
 
-        while (std::chrono::steady_clock::now() < next)
-            std::this_thread::yield();
+        // The device callback posts every time it consumes samples. The timeout keeps the client
+        // ticking at roughly the frame rate when there's no device to pull, and lets the thread exit.
+        SDL_SemWaitTimeout(g_audioConsumedSemaphore, 1000 * XAUDIO_NUM_SAMPLES / XAUDIO_SAMPLES_HZ);
     }
 }
 
@@ -109,46 +394,60 @@ void XAudioRegisterClient(PPCFunc* callback, uint32_t param)
 
 void XAudioSubmitFrame(void* samples)
 {
-    auto floatSamples = reinterpret_cast<be<float>*>(samples);
+    // Nothing would ever drain the ring.
+    if (!g_audioDevice)
+        return;
+
+    TraceScope traceScope("Audio Submit");
+
+    auto begin = std::chrono::steady_clock::now();
+    auto floatSamples = reinterpret_cast<const be<float>*>(samples);
+    bool isWritten;
 
     if (g_downMixToStereo)
     {
-        // 0: left 1.0f, right 0.0f
-        // 1: left 0.0f, right 1.0f
-        // 2: left 0.75f, right 0.75f
-        // 3: left 0.0f, right 0.0f
-        // 4: left 1.0f, right 0.0f
-        // 5: left 0.0f, right 1.0f
-
+        AudioDownmixMatrix matrix = GetDownmixMatrix();
         std::array<float, 2 * XAUDIO_NUM_SAMPLES> audioFrames;
 
-        for (size_t i = 0; i < XAUDIO_NUM_SAMPLES; i++)
-        {
-            float ch0 = floatSamples[0 * XAUDIO_NUM_SAMPLES + i];
-            float ch1 = floatSamples[1 * XAUDIO_NUM_SAMPLES + i];
-            float ch2 = floatSamples[2 * XAUDIO_NUM_SAMPLES + i];
-            float ch3 = floatSamples[3 * XAUDIO_NUM_SAMPLES + i];
-            float ch4 = floatSamples[4 * XAUDIO_NUM_SAMPLES + i];
-            float ch5 = floatSamples[5 * XAUDIO_NUM_SAMPLES + i];
-
-            audioFrames[i * 2 + 0] = (ch0 + ch2 * 0.75f + ch4) * Config::MasterVolume;
-            audioFrames[i * 2 + 1] = (ch1 + ch2 * 0.75f + ch5) * Config::MasterVolume;
-        }
+        DownmixToStereo(audioFrames.data(), floatSamples, matrix);
 
-        SDL_QueueAudio(g_audioDevice, &audioFrames, sizeof(audioFrames));
+        isWritten = g_audioRing.Write(audioFrames.data(), audioFrames.size());
     }
     else
     {
         std::array<float, XAUDIO_NUM_CHANNELS * XAUDIO_NUM_SAMPLES> audioFrames;
 
-        for (size_t i = 0; i < XAUDIO_NUM_SAMPLES; i++)
-        {
-            for (size_t j = 0; j < XAUDIO_NUM_CHANNELS; j++)
-                audioFrames[i * XAUDIO_NUM_CHANNELS + j] = floatSamples[j * XAUDIO_NUM_SAMPLES + i] * Config::MasterVolume;
-        }
+        InterleaveSurround(audioFrames.data(), floatSamples, Config::MasterVolume);
 
-        SDL_QueueAudio(g_audioDevice, &audioFrames, sizeof(audioFrames));
+        isWritten = g_audioRing.Write(audioFrames.data(), audioFrames.size());
     }
+
+    if (!isWritten)
+        ++g_audioOverruns;
+
+    uint64_t submitTime = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count();
+
+    ++g_audioSubmitCount;
+    g_audioTotalSubmitTime += submitTime;
+
+    if (submitTime > g_audioMaxSubmitTime.load(std::memory_order_relaxed))
+        g_audioMaxSubmitTime = submitTime;
+}
+
+XAudioStats XAudioGetStats()
+{
+    size_t channels = g_downMixToStereo ? 2 : XAUDIO_NUM_CHANNELS;
+
+    XAudioStats stats;
+    stats.queuedFrames = uint32_t(g_audioRing.GetQueuedCount() / (channels * XAUDIO_NUM_SAMPLES));
+    stats.targetFrames = uint32_t(GetTargetLatencyFrames());
+    stats.underruns = g_audioUnderruns.load();
+    stats.overruns = g_audioOverruns.load();
+
+    uint64_t submitCount = g_audioSubmitCount.load();
+    stats.averageSubmitTime = submitCount != 0 ? double(g_audioTotalSubmitTime.load()) / submitCount / 1000000.0 : 0.0;
+    stats.maxSubmitTime = double(g_audioMaxSubmitTime.load()) / 1000000.0;
+    return stats;
 }
 
 void XAudioConfigValueChangedCallback(IConfigDef* configDef)
@@ -0,0 +1,320 @@
+#include "xma_cache.h"
+#include <os/logger.h>
+#include <user/config.h>
+#include <user/paths.h>
+#include <condition_variable>
+
+extern "C"
+{
+    #include <libavcodec/version.h>
+}
+
+namespace XmaCache
+{
+    static constexpr uint32_t DISK_CACHE_SIGNATURE = 0x4D435058; // XPCM
+    static constexpr uint32_t DISK_CACHE_VERSION = 1;
+    static constexpr size_t MAX_DISK_USAGE = 256 * 1024 * 1024;
+
+    struct DiskCacheHeader
+    {
+        uint32_t signature;
+        uint32_t version;
+        // Decoder output is only reproducible with the same FFmpeg version.
+        uint32_t codecVersion;
+        uint32_t reserved;
+    };
+
+    struct DiskCacheRecord
+    {
+        uint64_t key;
+        uint32_t sampleCount;
+        uint32_t channelCount;
+    };
+
+    struct Entry
+    {
+        uint64_t key;
+        std::shared_ptr<const XmaPcmFrame> frame;
+    };
+
+    static Mutex g_mutex;
+    static std::list<Entry> g_entries; // Most recently used first.
+    static ankerl::unordered_dense::map<uint64_t, std::list<Entry>::iterator> g_entryMap;
+    static size_t g_memoryUsage;
+
+    // The disk cache is only touched by its own thread, so the decoders never wait on file I/O.
+    // It loads the frames from the previous runs into memory first, then appends new frames in batches.
+    static std::mutex g_diskMutex;
+    static std::condition_variable g_diskCondition;
+    static std::vector<Entry> g_pendingDiskWrites;
+    static bool g_isDiskCacheFailed;
+
+    static std::fstream g_diskStream;
+    static ankerl::unordered_dense::set<uint64_t> g_diskKeys;
+    static std::atomic<size_t> g_diskUsage;
+
+    static std::atomic<uint64_t> g_hits;
+    static std::atomic<uint64_t> g_diskLoads;
+    static std::atomic<uint64_t> g_misses;
+    static std::atomic<uint64_t> g_evictions;
+
+    static std::filesystem::path GetDiskCachePath()
+    {
+        return GetUserPath() / "xma_cache.bin";
+    }
+
+    // Called with the mutex held.
+    static void InsertToMemory(uint64_t key, std::shared_ptr<const XmaPcmFrame> frame)
+    {
+        if (g_entryMap.contains(key))
+            return;
+
+        const size_t budget = size_t(Config::XmaCacheSize) * 1024 * 1024;
+
+        g_memoryUsage += frame->GetSize();
+        g_entries.push_front({ key, std::move(frame) });
+        g_entryMap.emplace(key, g_entries.begin());
+
+        while (g_memoryUsage > budget && !g_entries.empty())
+        {
+            auto& entry = g_entries.back();
+            g_memoryUsage -= entry.frame->GetSize();
+            g_entryMap.erase(entry.key);
+            g_entries.pop_back();
+
+            ++g_evictions;
+        }
+    }
+
+    static bool LoadDiskCache()
+    {
+        std::filesystem::path path = GetDiskCachePath();
+
+        g_diskStream.open(path, std::ios::in | std::ios::out | std::ios::binary);
+
+        if (g_diskStream.is_open())
+        {
+            DiskCacheHeader header{};
+            g_diskStream.read(reinterpret_cast<char*>(&header), sizeof(header));
+
+            bool isHeaderValid = !g_diskStream.fail() && header.signature == DISK_CACHE_SIGNATURE &&
+                header.version == DISK_CACHE_VERSION && header.codecVersion == LIBAVCODEC_VERSION_INT;
+
+            if (isHeaderValid)
+            {
+                std::error_code ec;
+                uint64_t fileSize = std::filesystem::file_size(path, ec);
+                uint64_t offset = sizeof(header);
+
+                const size_t budget = size_t(Config::XmaCacheSize) * 1024 * 1024;
+                size_t loadedSize = 0;
+
+                // Records past the memory budget only get indexed, so they aren't written again.
+                // A record that was only partially written gets overwritten by the next one.
+                while (!ec && offset + sizeof(DiskCacheRecord) <= fileSize)
+                {
+                    DiskCacheRecord record;
+                    g_diskStream.read(reinterpret_cast<char*>(&record), sizeof(record));
+
+                    uint64_t size = uint64_t(record.sampleCount) * record.channelCount * sizeof(int16_t);
+                    if (g_diskStream.fail() || offset + sizeof(record) + size > fileSize)
+                        break;
+
+                    if (loadedSize + size <= budget)
+                    {
+                        auto frame = std::make_shared<XmaPcmFrame>();
+                        frame->sampleCount = record.sampleCount;
+                        frame->channelCount = record.channelCount;
+                        frame->samples = std::make_unique<int16_t[]>(size_t(record.sampleCount) * record.channelCount);
+
+                        g_diskStream.read(reinterpret_cast<char*>(frame->samples.get()), size);
+                        if (g_diskStream.fail())
+                            break;
+
+                        loadedSize += size;
+
+                        std::lock_guard lock(g_mutex);
+                        InsertToMemory(record.key, std::move(frame));
+                        ++g_diskLoads;
+                    }
+                    else
+                    {
+                        g_diskStream.seekg(offset + sizeof(record) + size);
+                    }
+
+                    g_diskKeys.emplace(record.key);
+                    offset += sizeof(record) + size;
+                }
+
+                g_diskStream.clear();
+
+                if (!ec)
+                {
+                    g_diskUsage = offset;
+                    g_diskStream.seekp(offset);
+
+                    LOGFN("Loaded XMA cache with {} frames.", g_diskKeys.size());
+
+                    return true;
+                }
+            }
+
+            g_diskStream.close();
+            g_diskKeys.clear();
+        }
+
+        std::error_code ec;
+        std::filesystem::create_directories(path.parent_path(), ec);
+
+        g_diskStream.open(path, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+
+        if (!g_diskStream.is_open())
+        {
+            LOGFN_ERROR("Failed to create XMA cache at \"{}\".", path.string());
+            return false;
+        }
+
+        DiskCacheHeader header{ DISK_CACHE_SIGNATURE, DISK_CACHE_VERSION, LIBAVCODEC_VERSION_INT };
+        g_diskStream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        g_diskUsage = sizeof(header);
+
+        return !g_diskStream.fail();
+    }
+
+    static void WriteToDisk(const std::vector<Entry>& entries)
+    {
+        bool hasWritten = false;
+
+        for (auto& entry : entries)
+        {
+            size_t size = sizeof(DiskCacheRecord) + entry.frame->GetSize();
+            if (g_diskKeys.contains(entry.key) || g_diskUsage + size > MAX_DISK_USAGE)
+                continue;
+
+            DiskCacheRecord record{ entry.key, entry.frame->sampleCount, entry.frame->channelCount };
+            g_diskStream.write(reinterpret_cast<const char*>(&record), sizeof(record));
+            g_diskStream.write(reinterpret_cast<const char*>(entry.frame->samples.get()), entry.frame->GetSize());
+
+            if (g_diskStream.fail())
+                break;
+
+            g_diskKeys.emplace(entry.key);
+            g_diskUsage += size;
+            hasWritten = true;
+        }
+
+        if (hasWritten)
+            g_diskStream.flush();
+    }
+
+    static void DiskCacheThread()
+    {
+        if (LoadDiskCache())
+        {
+            std::vector<Entry> entries;
+
+            while (true)
+            {
+                {
+                    std::unique_lock lock(g_diskMutex);
+                    g_diskCondition.wait(lock, []() { return !g_pendingDiskWrites.empty(); });
+
+                    std::swap(entries, g_pendingDiskWrites);
+                }
+
+                WriteToDisk(entries);
+
+                // A failed write leaves the file in an unknown state.
+                if (g_diskStream.fail())
+                {
+                    LOGN_ERROR("Failed to write to XMA cache.");
+                    break;
+                }
+
+                entries.clear();
+
+                // Gives a burst of newly decoded frames the chance to pile up, so they get flushed together.
+                std::this_thread::sleep_for(std::chrono::seconds(1));
+            }
+        }
+
+        // Nothing is going to pick up the frames anymore.
+        std::lock_guard lock(g_diskMutex);
+        g_isDiskCacheFailed = true;
+        g_pendingDiskWrites.clear();
+        g_pendingDiskWrites.shrink_to_fit();
+    }
+
+    static void StartDiskCacheThread()
+    {
+        static std::once_flag s_startThread;
+        std::call_once(s_startThread, []() { std::thread(DiskCacheThread).detach(); });
+    }
+
+    bool IsEnabled()
+    {
+        return Config::XmaCacheSize != 0;
+    }
+
+    uint64_t GetKey(uint64_t frameHash, uint64_t previousFrameHash, uint32_t sampleRate, uint32_t channelCount)
+    {
+        uint64_t values[] = { frameHash, previousFrameHash, sampleRate, channelCount };
+        return XXH3_64bits(values, sizeof(values));
+    }
+
+    std::shared_ptr<const XmaPcmFrame> Find(uint64_t key)
+    {
+        if (Config::PersistentXmaCache)
+            StartDiskCacheThread();
+
+        std::lock_guard lock(g_mutex);
+
+        auto findResult = g_entryMap.find(key);
+        if (findResult != g_entryMap.end())
+        {
+            g_entries.splice(g_entries.begin(), g_entries, findResult->second);
+            ++g_hits;
+
+            return findResult->second->frame;
+        }
+
+        ++g_misses;
+
+        return nullptr;
+    }
+
+    void Insert(uint64_t key, std::shared_ptr<const XmaPcmFrame> frame)
+    {
+        if (Config::PersistentXmaCache)
+        {
+            StartDiskCacheThread();
+
+            {
+                std::lock_guard lock(g_diskMutex);
+                if (!g_isDiskCacheFailed)
+                    g_pendingDiskWrites.push_back({ key, frame });
+            }
+
+            g_diskCondition.notify_one();
+        }
+
+        std::lock_guard lock(g_mutex);
+        InsertToMemory(key, std::move(frame));
+    }
+
+    Stats GetStats()
+    {
+        Stats stats;
+        stats.hits = g_hits.load();
+        stats.diskLoads = g_diskLoads.load();
+        stats.misses = g_misses.load();
+        stats.evictions = g_evictions.load();
+        {
+            std::lock_guard lock(g_mutex);
+            stats.memoryUsage = g_memoryUsage;
+        }
+        stats.diskUsage = g_diskUsage.load();
+
+        return stats;
+    }
+}
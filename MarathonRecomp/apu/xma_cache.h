@@ -0,0 +1,43 @@
+#pragma once
+
+// Decoded XMA frames as interleaved big endian PCM, ready to be copied into
+// the output buffer of a playback.
+struct XmaPcmFrame
+{
+    uint32_t sampleCount;
+    uint32_t channelCount;
+    std::unique_ptr<int16_t[]> samples;
+
+    size_t GetSize() const
+    {
+        return size_t(sampleCount) * channelCount * sizeof(int16_t);
+    }
+};
+
+// Content addressed cache of decoded frames, so sounds that play over and over
+// only go through the decoder once. Frames are kept in memory up to a budget and
+// evicted in least recently used order. They can also be persisted to disk
+// for the next time the game is launched, getting loaded back in on a background thread.
+namespace XmaCache
+{
+    struct Stats
+    {
+        uint64_t hits;
+        uint64_t diskLoads;
+        uint64_t misses;
+        uint64_t evictions;
+        size_t memoryUsage;
+        size_t diskUsage;
+    };
+
+    bool IsEnabled();
+
+    // The decoder carries state from the previous frame over into the next, so the
+    // hash of the previous frame is part of the key along with the stream format.
+    uint64_t GetKey(uint64_t frameHash, uint64_t previousFrameHash, uint32_t sampleRate, uint32_t channelCount);
+
+    std::shared_ptr<const XmaPcmFrame> Find(uint64_t key);
+    void Insert(uint64_t key, std::shared_ptr<const XmaPcmFrame> frame);
+
+    Stats GetStats();
+}
@@ -0,0 +1,115 @@
+/**
+******************************************************************************
+* Xenia : Xbox 360 Emulator Research Project                                 *
+******************************************************************************
+* Copyright 2024 Xenia Canary. All rights reserved.                          *
+* Released under the BSD license - see LICENSE in the root for more details. *
+******************************************************************************
+*/
+
+// The sample conversion is from Xenia Canary, so leave the copyright here
+
+#include "xma_convert.h"
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define XMA_CONVERT_SSE2
+#include <immintrin.h>
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define XMA_CONVERT_NEON
+#include <arm_neon.h>
+#endif
+
+constexpr float kSampleScale = (1 << 15) - 1;
+
+static int16_t ConvertSample(float sample) {
+    // Raw samples sometimes aren't within [-1, 1]
+    float scaledSample = std::clamp(sample, -1.0f, 1.0f) * kSampleScale;
+
+    // Convert the sample and output it in big endian.
+    return ByteSwap(static_cast<int16_t>(scaledSample));
+}
+
+// Vectorized part of ConvertSamples for mono and stereo streams. Returns
+// the amount of samples per channel that were processed.
+#if defined(XMA_CONVERT_SSE2)
+
+static __m128i ConvertSamplesSSE2(const float *in) {
+    const __m128 min = _mm_set1_ps(-1.0f);
+    const __m128 max = _mm_set1_ps(1.0f);
+    const __m128 scale = _mm_set1_ps(kSampleScale);
+
+    __m128 first = _mm_mul_ps(_mm_max_ps(_mm_min_ps(_mm_loadu_ps(in), max), min), scale);
+    __m128 second = _mm_mul_ps(_mm_max_ps(_mm_min_ps(_mm_loadu_ps(in + 4), max), min), scale);
+
+    return _mm_packs_epi32(_mm_cvttps_epi32(first), _mm_cvttps_epi32(second));
+}
+
+static __m128i ByteSwapSSE2(__m128i value) {
+    return _mm_or_si128(_mm_slli_epi16(value, 8), _mm_srli_epi16(value, 8));
+}
+
+static uint32_t ConvertSamplesVector(int16_t *out, const float *const *planes, uint32_t channelCount, uint32_t first, uint32_t count) {
+    uint32_t i = 0;
+
+    if (channelCount == 1) {
+        for (; i + 8 <= count; i += 8) {
+            __m128i samples = ByteSwapSSE2(ConvertSamplesSSE2(planes[0] + first + i));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), samples);
+        }
+    } else if (channelCount == 2) {
+        for (; i + 8 <= count; i += 8) {
+            __m128i left = ConvertSamplesSSE2(planes[0] + first + i);
+            __m128i right = ConvertSamplesSSE2(planes[1] + first + i);
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i * 2), ByteSwapSSE2(_mm_unpacklo_epi16(left, right)));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i * 2 + 8), ByteSwapSSE2(_mm_unpackhi_epi16(left, right)));
+        }
+    }
+
+    return i;
+}
+
+#elif defined(XMA_CONVERT_NEON)
+
+static int16x8_t ConvertSamplesNEON(const float *in) {
+    const float32x4_t min = vdupq_n_f32(-1.0f);
+    const float32x4_t max = vdupq_n_f32(1.0f);
+
+    float32x4_t first = vmulq_n_f32(vmaxq_f32(vminq_f32(vld1q_f32(in), max), min), kSampleScale);
+    float32x4_t second = vmulq_n_f32(vmaxq_f32(vminq_f32(vld1q_f32(in + 4), max), min), kSampleScale);
+    int16x8_t samples = vcombine_s16(vqmovn_s32(vcvtq_s32_f32(first)), vqmovn_s32(vcvtq_s32_f32(second)));
+
+    return vreinterpretq_s16_u8(vrev16q_u8(vreinterpretq_u8_s16(samples)));
+}
+
+static uint32_t ConvertSamplesVector(int16_t *out, const float *const *planes, uint32_t channelCount, uint32_t first, uint32_t count) {
+    uint32_t i = 0;
+
+    if (channelCount == 1) {
+        for (; i + 8 <= count; i += 8)
+            vst1q_s16(out + i, ConvertSamplesNEON(planes[0] + first + i));
+    } else if (channelCount == 2) {
+        for (; i + 8 <= count; i += 8)
+            vst2q_s16(out + i * 2, int16x8x2_t{ { ConvertSamplesNEON(planes[0] + first + i), ConvertSamplesNEON(planes[1] + first + i) } });
+    }
+
+    return i;
+}
+
+#else
+
+static uint32_t ConvertSamplesVector(int16_t *out, const float *const *planes, uint32_t channelCount, uint32_t first, uint32_t count) {
+    return 0;
+}
+
+#endif
+
+void XMAConvertSamples(int16_t *out, const float *const *planes, uint32_t channelCount, uint32_t first, uint32_t count) {
+    uint32_t i = ConvertSamplesVector(out, planes, channelCount, first, count);
+
+    for (; i < count; i++) {
+        for (uint32_t j = 0; j < channelCount; j++) {
+            out[i * channelCount + j] = ConvertSample(planes[j][first + i]);
+        }
+    }
+}
@@ -0,0 +1,4 @@
+#pragma once
+
+// Converts planar float samples from FFmpeg to interleaved big endian PCM.
+void XMAConvertSamples(int16_t *out, const float *const *planes, uint32_t channelCount, uint32_t first, uint32_t count);
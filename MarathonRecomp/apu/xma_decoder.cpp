@@ -10,6 +10,9 @@
 // Almost all decoding code is from Xenia Canary, so leave the copyright here
 
 #include "xma_decoder.h"
+#include "xma_convert.h"
+#include <utils/trace.h>
+#include <map>
 
 // #define ENABLE_DEBUG_XMA_DECODER
 
@@ -272,44 +275,73 @@ void Decode(XmaPlayback *playback) {
     const uint32_t paddingStart = static_cast<uint8_t>(stream.Copy(playback->xmaFrame.data() + 1,
                                                                    packetInfo.currentFrameSize));
 
-    playback->rawFrame.fill(0);
     playback->av_packet_->data = playback->xmaFrame.data();
     playback->av_packet_->size = static_cast<int>(1 + ((paddingStart + packetInfo.currentFrameSize) / 8) +
                                                   (((paddingStart + packetInfo.currentFrameSize) % 8) ? 1 : 0));
 
     auto paddingEnd = playback->av_packet_->size * 8 - (8 + paddingStart + packetInfo.currentFrameSize);
     playback->xmaFrame[0] = ((paddingStart & 7) << 5) | ((paddingEnd & 7) << 2);
+    playback->xmaFrameSize = playback->av_packet_->size;
 
-    auto ret = avcodec_send_packet(playback->codec_ctx, playback->av_packet_);
-    if (ret < 0) {
-        debug_printf("Error sending packet for decoding: %s\n", av_err2str(ret));
-    }
+    const uint64_t frameHash = XXH3_64bits(playback->xmaFrame.data(), playback->av_packet_->size);
+    const uint64_t cacheKey = XmaCache::GetKey(frameHash, playback->previousFrameHash, playback->sampleRate, playback->channelCount);
 
-    ret = avcodec_receive_frame(playback->codec_ctx, playback->av_frame_);
-    if (ret < 0) {
-        debug_printf("Error receiving frame from decoder: %s\n", av_err2str(ret));
-    }
+    playback->decodedFrame = XmaCache::IsEnabled() ? XmaCache::Find(cacheKey) : nullptr;
 
-    constexpr float scale = (1 << 15) - 1;
-    auto out = reinterpret_cast<int16_t *>(playback->rawFrame.data());
-    auto samples = reinterpret_cast<const uint8_t **>(&playback->av_frame_->data);
+    if (playback->decodedFrame) {
+        // The decoder never saw this frame, so it has to catch up before decoding the next one.
+        playback->isDecoderBehind = true;
+    } else {
+        if (playback->isDecoderBehind) {
+            playback->av_packet_->data = playback->previousXmaFrame.data();
+            playback->av_packet_->size = playback->previousXmaFrameSize;
 
-    uint32_t o = 0;
-    if (playback->av_frame_->nb_samples != 0) {
-        for (uint32_t i = 0; i < kSamplesPerFrame; i++) {
-            for (uint32_t j = 0; j < playback->av_frame_->ch_layout.nb_channels; j++) {
-                // Select the appropriate array based on the current channel.
-                auto in = reinterpret_cast<const float *>(samples[j]);
+            if (avcodec_send_packet(playback->codec_ctx, playback->av_packet_) >= 0) {
+                avcodec_receive_frame(playback->codec_ctx, playback->av_frame_);
+            }
 
-                // Raw samples sometimes aren't within [-1, 1]
-                float scaledSample = clamp_float(in[i], -1.0f, 1.0f) * scale;
+            playback->av_packet_->data = playback->xmaFrame.data();
+            playback->av_packet_->size = playback->xmaFrameSize;
+            playback->isDecoderBehind = false;
+        }
 
-                // Convert the sample and output it in big endian.
-                auto sample = static_cast<int16_t>(scaledSample);
-                out[o++] = ByteSwap(sample);
-            }
+        auto ret = avcodec_send_packet(playback->codec_ctx, playback->av_packet_);
+        if (ret < 0) {
+            debug_printf("Error sending packet for decoding: %s\n", av_err2str(ret));
+        }
+
+        ret = avcodec_receive_frame(playback->codec_ctx, playback->av_frame_);
+        if (ret < 0) {
+            debug_printf("Error receiving frame from decoder: %s\n", av_err2str(ret));
+        }
+
+        // The frame stays untouched until the next decode, so it gets converted
+        // straight into the output buffer as its subframes are consumed.
+        if (ret < 0 || playback->av_frame_->ch_layout.nb_channels != (int)playback->channelCount) {
+            playback->decodedSampleCount = 0;
+        } else {
+            playback->decodedSampleCount = std::min((uint32_t)playback->av_frame_->nb_samples, kSamplesPerFrame);
+        }
+
+        // Only frames that decoded successfully are worth keeping around.
+        if (ret >= 0 && XmaCache::IsEnabled()) {
+            auto frame = std::make_shared<XmaPcmFrame>();
+            frame->sampleCount = playback->decodedSampleCount;
+            frame->channelCount = playback->channelCount;
+            frame->samples = std::make_unique<int16_t[]>(size_t(frame->sampleCount) * frame->channelCount);
+
+            XMAConvertSamples(frame->samples.get(), reinterpret_cast<const float *const *>(playback->av_frame_->data),
+                           frame->channelCount, 0, frame->sampleCount);
+
+            XmaCache::Insert(cacheKey, frame);
+            playback->decodedFrame = std::move(frame);
         }
     }
+
+    std::memcpy(playback->previousXmaFrame.data(), playback->xmaFrame.data(), playback->xmaFrameSize);
+    playback->previousXmaFrameSize = playback->xmaFrameSize;
+    playback->previousFrameHash = frameHash;
+
     playback->currentFrameRemainingSubframes = 4 * playback->channelCount;
 
     if (!packetInfo.IsLastFrameInPacket()) {
@@ -345,6 +377,36 @@ void Decode(XmaPlayback *playback) {
     playback->inputBufferReadOffset = nextInputOffset;
 }
 
+// Offset and count are in interleaved samples of the decoded frame. Anything past
+// the end of what the decoder returned is written out as silence. Frames that went
+// through the PCM cache are already converted and only need to be copied.
+static void WriteDecodedSamples(XmaPlayback *playback, int16_t *out, uint32_t offset, uint32_t count) {
+    const uint32_t channelCount = playback->channelCount;
+    const uint32_t firstSample = offset / channelCount;
+    const uint32_t sampleCount = count / channelCount;
+
+    if (playback->decodedFrame) {
+        const XmaPcmFrame &frame = *playback->decodedFrame;
+
+        uint32_t copyCount = 0;
+        if (firstSample < frame.sampleCount) {
+            copyCount = std::min(sampleCount, frame.sampleCount - firstSample);
+            std::memcpy(out, frame.samples.get() + firstSample * channelCount, copyCount * channelCount * kBytesPerSample);
+        }
+
+        std::memset(out + copyCount * channelCount, 0, (sampleCount - copyCount) * channelCount * kBytesPerSample);
+        return;
+    }
+
+    uint32_t convertCount = 0;
+    if (firstSample < playback->decodedSampleCount) {
+        convertCount = std::min(sampleCount, playback->decodedSampleCount - firstSample);
+        XMAConvertSamples(out, reinterpret_cast<const float *const *>(playback->av_frame_->data), channelCount, firstSample, convertCount);
+    }
+
+    std::memset(out + convertCount * channelCount, 0, (sampleCount - convertCount) * channelCount * kBytesPerSample);
+}
+
 void Consume(XmaPlayback *playback) {
     if (!playback->currentFrameRemainingSubframes) {
         return;
@@ -356,76 +418,217 @@ void Consume(XmaPlayback *playback) {
     const int8_t rawFrameReadOffset = ((kBytesPerFrameChannel / kOutputBytesPerBlock) * playback->channelCount)
                                       - playback->currentFrameRemainingSubframes;
 
-    playback->outputRb.Write(playback->rawFrame.data() +
-                             (kOutputBytesPerBlock * rawFrameReadOffset),
-                             subframesToWrite * kOutputBytesPerBlock);
+    const uint32_t offset = (kOutputBytesPerBlock * rawFrameReadOffset) / kBytesPerSample;
+    const uint32_t size = subframesToWrite * kOutputBytesPerBlock;
+
+    // Split in two if the write wraps around the end of the output buffer.
+    RingBuffer &outputRb = playback->outputRb;
+    const uint32_t firstSize = std::min(size, outputRb.capacity() - outputRb.write_offset());
+
+    WriteDecodedSamples(playback, reinterpret_cast<int16_t *>(outputRb.write_ptr()), offset, firstSize / kBytesPerSample);
+    WriteDecodedSamples(playback, reinterpret_cast<int16_t *>(outputRb.buffer()), offset + firstSize / kBytesPerSample,
+                        (size - firstSize) / kBytesPerSample);
+
+    outputRb.AdvanceWrite(size);
     playback->remainingSubframeBlocksInOutputBuffer -= subframesToWrite;
     playback->currentFrameRemainingSubframes -= subframesToWrite;
 }
 
-void DecoderThreadFunc(XmaPlayback *playback) {
-    while (playback->isRunning) {
-        std::unique_lock<std::mutex> lock(playback->mutex);
+static void DecodePlayback(XmaPlayback *playback) {
+    {
+        std::lock_guard<std::mutex> lock(playback->mutex);
+
+        if (!playback->isRunning || playback->outputBufferValid != 1 ||
+            !playback->IsAnyInputBufferValid() || playback->isLocked.load()) {
+            return;
+        }
+    }
+
+    TraceScope traceScope("XMA Decode");
+
+    const int32_t minimumSubframeDecodeCount = (playback->subframes * playback->channelCount) - 1;
 
-        playback->cv.wait(lock, [&] {
-            return (!playback->isRunning || (playback->outputBufferValid == 1 &&
-                                             playback->IsAnyInputBufferValid())) &&
-                   !playback->isLocked.load();
-        });
+    size_t outputCapacity = playback->outputBufferBlockCount * kOutputBytesPerBlock;
 
-        if (!playback->outputBufferValid)
-            continue;
+    const uint32_t outputReadOffset = playback->outputBufferReadOffset * kOutputBytesPerBlock;
+    const uint32_t outputWriteOffset = playback->outputBufferWriteOffset * kOutputBytesPerBlock;
 
-        if (!playback->isRunning)
+    playback->outputRb = RingBuffer((uint8_t *)g_memory.Translate(playback->outputBuffer),
+                                    outputCapacity);
+    playback->outputRb.set_read_offset(outputReadOffset);
+    playback->outputRb.set_write_offset(outputWriteOffset);
+    playback->remainingSubframeBlocksInOutputBuffer = (int32_t)playback->outputRb.write_count()
+                                                      / kOutputBytesPerBlock;
+
+    if (minimumSubframeDecodeCount > playback->remainingSubframeBlocksInOutputBuffer) {
+        playback->bAllowedToDecode = false;
+        return;
+    }
+
+    while (playback->remainingSubframeBlocksInOutputBuffer >= minimumSubframeDecodeCount) {
+        Decode(playback);
+        Consume(playback);
+
+        if (!playback->IsAnyInputBufferValid()) {
             break;
+        }
+    }
+
+    playback->outputBufferWriteOffset = playback->outputRb.write_offset() / kOutputBytesPerBlock;
+    playback->bAllowedToDecode = false;
+
+    if (playback->outputRb.empty()) {
+        playback->outputBufferValid = 0;
+    }
+}
+
+static std::mutex g_decoderMutex;
+static std::condition_variable g_decoderCondition;
+static std::condition_variable g_decoderIdleCondition;
+static std::multimap<std::chrono::steady_clock::time_point, XmaPlayback *> g_decoderQueue;
+static std::vector<XmaPlayback *> g_playbacks;
+
+// Estimates when the decoded samples still waiting in the output buffer are going to run out.
+static std::chrono::steady_clock::time_point GetDecodeDeadline(XmaPlayback *playback, std::chrono::steady_clock::time_point now) {
+    const uint32_t blockCount = playback->outputBufferBlockCount & 0x1F;
+    const uint32_t readOffset = playback->outputBufferReadOffset & 0x1F;
+    const uint32_t writeOffset = playback->outputBufferWriteOffset & 0x1F;
+
+    uint32_t queuedBlocks;
+    if (!playback->outputBufferValid) {
+        queuedBlocks = blockCount;
+    } else if (writeOffset >= readOffset) {
+        queuedBlocks = writeOffset - readOffset;
+    } else {
+        queuedBlocks = blockCount - readOffset + writeOffset;
+    }
+
+    const uint64_t queuedSamples = (uint64_t(queuedBlocks) * kOutputBytesPerBlock) / (kBytesPerSample * std::max(playback->channelCount, 1u));
+    return now + std::chrono::nanoseconds(queuedSamples * 1000000000ull / std::max(playback->sampleRate, 1u));
+}
+
+static void DecoderThreadFunc() {
+    Trace::SetThreadName("XMA Decoder Thread");
+
+    std::unique_lock<std::mutex> lock(g_decoderMutex);
+
+    while (true) {
+        g_decoderCondition.wait(lock, [] { return !g_decoderQueue.empty(); });
+
+        auto playback = g_decoderQueue.begin()->second;
+        g_decoderQueue.erase(g_decoderQueue.begin());
+        playback->decodeState = XmaDecodeState::Decoding;
+
+        auto begin = std::chrono::steady_clock::now();
+        uint64_t queueLatency = std::chrono::duration_cast<std::chrono::nanoseconds>(begin - playback->queuedTime).count();
 
         lock.unlock();
 
-        const int32_t minimumSubframeDecodeCount = (playback->subframes * playback->channelCount) - 1;
+        DecodePlayback(playback);
+
+        auto end = std::chrono::steady_clock::now();
 
-        size_t outputCapacity = playback->outputBufferBlockCount * kOutputBytesPerBlock;
+        ++playback->decodePassCount;
+        playback->totalQueueLatency += queueLatency;
+        playback->totalDecodeTime += std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count();
 
-        const uint32_t outputReadOffset = playback->outputBufferReadOffset * kOutputBytesPerBlock;
-        const uint32_t outputWriteOffset = playback->outputBufferWriteOffset * kOutputBytesPerBlock;
+        if (queueLatency > playback->maxQueueLatency.load(std::memory_order_relaxed))
+            playback->maxQueueLatency = queueLatency;
 
-        playback->outputRb = RingBuffer((uint8_t *)g_memory.Translate(playback->outputBuffer),
-                                        outputCapacity);
-        playback->outputRb.set_read_offset(outputReadOffset);
-        playback->outputRb.set_write_offset(outputWriteOffset);
-        playback->remainingSubframeBlocksInOutputBuffer = (int32_t)playback->outputRb.write_count()
-                                                          / kOutputBytesPerBlock;
+        lock.lock();
 
-        if (minimumSubframeDecodeCount > playback->remainingSubframeBlocksInOutputBuffer) {
-            playback->bAllowedToDecode = false;
-            lock.lock();
-            continue;
+        // More work came in while decoding, so it goes straight back into the queue.
+        if (playback->decodeState == XmaDecodeState::DecodingRequeued) {
+            playback->decodeState = XmaDecodeState::Queued;
+            playback->queuedTime = end;
+            g_decoderQueue.emplace(GetDecodeDeadline(playback, end), playback);
+        } else {
+            playback->decodeState = XmaDecodeState::Idle;
         }
 
-        while (playback->remainingSubframeBlocksInOutputBuffer >= minimumSubframeDecodeCount) {
-            Decode(playback);
-            Consume(playback);
+        g_decoderIdleCondition.notify_all();
+    }
+}
+
+void XmaRegisterPlayback(XmaPlayback *playback) {
+    static std::once_flag s_startThreads;
 
-            if (!playback->IsAnyInputBufferValid()) {
-                break;
-            }
-        }
+    // A handful of workers is plenty, any single stream only needs a fraction of a core.
+    std::call_once(s_startThreads, []() {
+        uint32_t threadCount = std::clamp(std::thread::hardware_concurrency() / 4, 1u, 4u);
 
-        playback->outputBufferWriteOffset = playback->outputRb.write_offset() / kOutputBytesPerBlock;
-        playback->bAllowedToDecode = false;
+        for (uint32_t i = 0; i < threadCount; i++)
+            std::thread(DecoderThreadFunc).detach();
+    });
 
-        if (playback->outputRb.empty()) {
-            playback->outputBufferValid = 0;
+    std::lock_guard<std::mutex> lock(g_decoderMutex);
+    g_playbacks.push_back(playback);
+}
+
+void XmaUnregisterPlayback(XmaPlayback *playback) {
+    std::unique_lock<std::mutex> lock(g_decoderMutex);
+
+    g_decoderIdleCondition.wait(lock, [playback] {
+        return playback->decodeState != XmaDecodeState::Decoding &&
+               playback->decodeState != XmaDecodeState::DecodingRequeued;
+    });
+
+    std::erase_if(g_decoderQueue, [playback](auto &entry) { return entry.second == playback; });
+    std::erase(g_playbacks, playback);
+}
+
+void XmaScheduleDecode(XmaPlayback *playback) {
+    std::lock_guard<std::mutex> lock(g_decoderMutex);
+
+    switch (playback->decodeState) {
+    case XmaDecodeState::Idle: {
+        auto now = std::chrono::steady_clock::now();
+        playback->decodeState = XmaDecodeState::Queued;
+        playback->queuedTime = now;
+        g_decoderQueue.emplace(GetDecodeDeadline(playback, now), playback);
+        g_decoderCondition.notify_one();
+        break;
+    }
+
+    case XmaDecodeState::Decoding:
+        playback->decodeState = XmaDecodeState::DecodingRequeued;
+        break;
+
+    default:
+        break;
+    }
+}
+
+std::vector<XmaStreamStats> XmaGetStreamStats() {
+    std::lock_guard<std::mutex> lock(g_decoderMutex);
+
+    std::vector<XmaStreamStats> streamStats;
+
+    for (auto playback : g_playbacks) {
+        auto &stats = streamStats.emplace_back();
+        stats.address = g_memory.MapVirtual(playback);
+        stats.sampleRate = playback->sampleRate;
+        stats.channelCount = playback->channelCount;
+        stats.decodePassCount = playback->decodePassCount.load();
+
+        if (stats.decodePassCount != 0) {
+            stats.averageQueueLatency = double(playback->totalQueueLatency.load()) / stats.decodePassCount / 1000000.0;
+            stats.averageDecodeTime = double(playback->totalDecodeTime.load()) / stats.decodePassCount / 1000000.0;
+        } else {
+            stats.averageQueueLatency = 0.0;
+            stats.averageDecodeTime = 0.0;
         }
 
-        lock.lock();
+        stats.maxQueueLatency = double(playback->maxQueueLatency.load()) / 1000000.0;
     }
+
+    return streamStats;
 }
 
 uint32_t XMAPlaybackCreate(uint32_t streams, XMAPLAYBACKINIT *init, uint32_t flags, be<uint32_t> *outPlayback) {
     const auto xmaPlayback = g_userHeap.AllocPhysical<XmaPlayback>(
             init->sampleRate.get(), init->outputBufferSize.get(), init->channelCount,
             init->subframes);
-    xmaPlayback->decoderThread = std::thread(DecoderThreadFunc, xmaPlayback);
     *outPlayback = g_memory.MapVirtual(xmaPlayback);
 
     return 0;
@@ -462,10 +665,13 @@ uint32_t XMAPlaybackQueryContextsAllocated(XmaPlayback *playback) {
 }
 
 uint32_t XMAPlaybackResumePlayback(XmaPlayback *playback) {
-    std::lock_guard<std::mutex> lock(playback->mutex);
-    playback->isLocked = false;
-    playback->cv.notify_one();
+    {
+        std::lock_guard<std::mutex> lock(playback->mutex);
+        playback->isLocked = false;
+        playback->cv.notify_one();
+    }
 
+    XmaScheduleDecode(playback);
     return 0;
 }
 
@@ -520,7 +726,7 @@ uint32_t XMAPlaybackSubmitData(XmaPlayback *playback, uint32_t stream, uint32_t
     }
 
     playback->bAllowedToDecode = true;
-    playback->cv.notify_one();
+    XmaScheduleDecode(playback);
     return 0;
 }
 
@@ -606,6 +812,7 @@ uint32_t XMAPlaybackConsumeDecodedData(XmaPlayback *playback, uint32_t stream, u
 
     uint32_t totalBytes = 0;
     uint32_t partialBytesRead = playback->partialBytesRead;
+    uint32_t wasOutputBufferValid = playback->outputBufferValid;
     uint32_t addr = reinterpret_cast<uint32_t>(
             playback->outputBuffer +
             ((playback->outputBufferReadOffset << 8) & 0x1F00) +
@@ -671,8 +878,10 @@ uint32_t XMAPlaybackConsumeDecodedData(XmaPlayback *playback, uint32_t stream, u
         playback->partialBytesRead = remainingBytes;
     }
 
-    // playback->bAllowedToDecode = true;
-    // playback->cv.notify_one();
+    // Freed up space in the output buffer for the decoder, or marked it as valid again without consuming anything.
+    if (totalBytes != 0 || playback->outputBufferValid != wasOutputBufferValid) {
+        XmaScheduleDecode(playback);
+    }
 
     uint32_t samplesConsumed = totalBytes >> bytesPerSample;
     playback->streamPosition += samplesConsumed;
@@ -729,6 +938,9 @@ uint32_t XMAPlaybackSetDecodePosition(XmaPlayback *playback, uint32_t streamInde
                                       uint32_t subframe) {
     playback->inputBufferReadOffset = bitOffset & 0x3FFFFFF;
     playback->numSubframesToSkip = subframe & 0x7;
+
+    // The decoder only runs when asked to, so it has to pick up the new position here.
+    XmaScheduleDecode(playback);
     return 0;
 }
 
@@ -742,6 +954,8 @@ uint32_t XMAPlaybackRewindDecodePosition(XmaPlayback *playback, uint32_t streamI
         newOffset = playback->inputBufferReadOffset & 0x3FFFFFF;
         playback->outputBufferValid = 1;
         playback->outputBufferWriteOffset = newOffset >> 27;
+
+        XmaScheduleDecode(playback);
         return 0;
     }
 
@@ -754,6 +968,7 @@ uint32_t XMAPlaybackRewindDecodePosition(XmaPlayback *playback, uint32_t streamI
     playback->outputBufferValid = 1;
     playback->outputBufferWriteOffset = newOffset;
 
+    XmaScheduleDecode(playback);
     return 1;
 }
 
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <apu/xma_cache.h>
 #include <utils/bit_stream.h>
 #include <utils/ring_buffer.h>
 #include <kernel/function.h>
@@ -24,6 +25,35 @@ constexpr uint32_t kBytesPerSample = 2;
 constexpr uint32_t kSamplesPerFrame = 512;
 constexpr uint32_t kBytesPerFrameChannel = kSamplesPerFrame * kBytesPerSample;
 
+// Playbacks get decoded by a shared pool of worker threads. Whenever a playback
+// may have work, it's queued with a deadline of when its decoded output would run
+// out, and the workers always pick the playback with the earliest deadline.
+enum class XmaDecodeState {
+    Idle,
+    Queued,
+    Decoding,
+    DecodingRequeued
+};
+
+struct XmaPlayback;
+
+void XmaRegisterPlayback(XmaPlayback *playback);
+void XmaUnregisterPlayback(XmaPlayback *playback);
+void XmaScheduleDecode(XmaPlayback *playback);
+
+struct XmaStreamStats {
+    uint32_t address;
+    uint32_t sampleRate;
+    uint32_t channelCount;
+    uint64_t decodePassCount;
+    double averageQueueLatency;
+    double maxQueueLatency;
+    double averageDecodeTime;
+};
+
+// Latencies are in milliseconds.
+std::vector<XmaStreamStats> XmaGetStreamStats();
+
 struct XmaPlayback {
     uint32_t sampleRate;
     uint32_t outputBufferSize;
@@ -46,7 +76,15 @@ struct XmaPlayback {
     // xenia
     std::array<uint8_t, kBytesPerPacketData * 2> inputBuffer;
     std::array<uint8_t, 1 + 4096> xmaFrame;
-    std::array<uint8_t, kBytesPerFrameChannel * 2> rawFrame;
+    int xmaFrameSize = 0;
+    uint32_t decodedSampleCount = 0;
+
+    // Set when the last frame came from or went into the PCM cache.
+    std::shared_ptr<const XmaPcmFrame> decodedFrame;
+    std::array<uint8_t, 1 + 4096> previousXmaFrame;
+    int previousXmaFrameSize = 0;
+    uint64_t previousFrameHash = 0;
+    bool isDecoderBehind = false;
     uint32_t outputBufferBlockCount = 0;
     uint32_t outputBufferReadOffset = 0;
     uint32_t outputBufferWriteOffset = 0;
@@ -74,12 +112,20 @@ struct XmaPlayback {
     uint32_t loopStartOffset = 0;
     uint32_t loopEndOffset = 0;
 
-    std::thread decoderThread;
     std::mutex mutex;
     std::condition_variable cv;
     std::atomic<bool> isLocked { false };
     std::atomic<bool> isRunning { true };
 
+    // Guarded by the decoder pool.
+    XmaDecodeState decodeState = XmaDecodeState::Idle;
+    std::chrono::steady_clock::time_point queuedTime;
+
+    std::atomic<uint64_t> decodePassCount { 0 };
+    std::atomic<uint64_t> totalQueueLatency { 0 };
+    std::atomic<uint64_t> maxQueueLatency { 0 };
+    std::atomic<uint64_t> totalDecodeTime { 0 };
+
     XmaPlayback(uint32_t sampleRate, uint32_t outputBufferSize,
                 uint32_t channelCount, uint32_t subframes)
                 : sampleRate(sampleRate), outputBufferSize(outputBufferSize),
@@ -112,6 +158,8 @@ struct XmaPlayback {
             throw std::runtime_error("Failed to open codec");
         }
         av_packet_ = av_packet_alloc();
+
+        XmaRegisterPlayback(this);
     }
 
     const uint32_t GetInputBufferAddress(uint8_t bufferIndex) const {
@@ -152,8 +200,6 @@ struct XmaPlayback {
             cv.notify_one();
         }
 
-        if (decoderThread.joinable()) {
-            decoderThread.join();
-        }
+        XmaUnregisterPlayback(this);
     }
 };
@@ -5,6 +5,8 @@
 #include "imgui/imgui_font_builder.h"
 
 #include <app.h>
+#include <apu/audio.h>
+#include <apu/xma_decoder.h>
 #include <bc_diff.h>
 #include <cpu/guest_thread.h>
 #include <cstdint>
@@ -14,6 +16,7 @@
 #include <kernel/heap.h>
 #include <hid/hid.h>
 #include <kernel/memory.h>
+#include <kernel/xdm.h>
 #include <kernel/xdbf.h>
 #include <plume_render_interface.h>
 #include <res/bc_diff/button_bc_diff.bin.h>
@@ -32,13 +35,14 @@
 #include <ui/black_bar.h>
 #include <patches/aspect_ratio_patches.h>
 #include <user/config.h>
+#include <user/paths.h>
+#include <utils/byte_swap.h>
+#include <utils/trace.h>
 #include <sdl_listener.h>
 #include <xxHashMap.h>
 #include <os/process.h>
 
-#if defined(ASYNC_PSO_DEBUG) || defined(PSO_CACHING)
 #include <magic_enum/magic_enum.hpp>
-#endif
 
 #include "../../tools/XenosRecomp/XenosRecomp/shader_common.h"
 
@@ -231,8 +235,52 @@ static RenderViewport g_viewport(0.0f, 0.0f, 1280.0f, 720.0f);
 static PipelineState g_pipelineState;
 static int32_t g_depthBias;
 static float g_slopeScaledDepthBias;
-static uint32_t g_vertexShaderConstants[0x400];
-static uint32_t g_pixelShaderConstants[0x380];
+
+// Constants are stored byte swapped. Only the float4 registers that actually
+// change get written, and an unchanged block keeps its previous upload.
+template<size_t TRegisterCount>
+struct ShaderConstants
+{
+    uint32_t values[TRegisterCount * 4];
+    uint32_t dirtyFirst = UINT32_MAX;
+    uint32_t dirtyLast = 0;
+    UploadAllocation allocation{};
+    bool hasAllocation = false;
+
+    // The index is in floats and the size in bytes, both aligned to float4 registers by the guest.
+    void set(uint32_t index, const uint32_t* memory, uint32_t size)
+    {
+        assert((index % 4) == 0 && (size % 16) == 0);
+        assert((index * sizeof(uint32_t) + size) <= sizeof(values));
+
+        uint32_t firstRegister = index / 4;
+        uint32_t registerCount = size / 16;
+
+        uint32_t swapped[TRegisterCount * 4];
+        ByteSwapCopy(swapped, memory, size / sizeof(uint32_t));
+
+        for (uint32_t i = 0; i < registerCount; i++)
+        {
+            const uint32_t* value = &swapped[i * 4];
+            uint32_t* dest = &values[(firstRegister + i) * 4];
+
+            if (memcmp(dest, value, 16) != 0)
+            {
+                memcpy(dest, value, 16);
+                dirtyFirst = std::min(dirtyFirst, firstRegister + i);
+                dirtyLast = std::max(dirtyLast, firstRegister + i);
+            }
+        }
+    }
+
+    bool isDirty() const
+    {
+        return dirtyFirst <= dirtyLast;
+    }
+};
+
+static ShaderConstants<0x100> g_vertexShaderConstants;
+static ShaderConstants<0xE0> g_pixelShaderConstants;
 static SharedConstants g_sharedConstants;
 static GuestTexture* g_textures[16];
 static RenderSamplerDesc g_samplerDescs[16];
@@ -332,6 +380,25 @@ static Profiler g_swapChainAcquireProfiler;
 
 static bool g_profilerVisible;
 static bool g_profilerWasToggled;
+static bool g_traceWasToggled;
+
+static double g_heapStatsElapsedTime;
+static uint64_t g_heapStatsAllocations;
+static uint64_t g_heapStatsContentions;
+static double g_heapAllocationRate;
+static double g_heapContentionRate;
+
+static constexpr size_t HEAP_HISTORY_COUNT = 120;
+
+static bool g_heapDiagnosticsVisible;
+static bool g_heapDiagnosticsWasToggled;
+static double g_heapDiagnosticsElapsedTime = 1.0;
+static HeapDiagnostics g_heapDiagnostics;
+static HeapDiagnostics g_physicalHeapDiagnostics;
+static std::vector<HeapCallSite> g_heapCallSites;
+static double g_heapLiveHistory[HEAP_HISTORY_COUNT];
+static double g_heapLargestFreeHistory[HEAP_HISTORY_COUNT];
+static size_t g_heapHistoryIndex;
 
 #if !defined(MARATHON_RECOMP_D3D12) && !defined(MARATHON_RECOMP_METAL)
 static constexpr Backend g_backend = Backend::VULKAN;
@@ -357,11 +424,9 @@ static std::unique_ptr<RenderCommandList> g_commandLists[NUM_FRAMES];
 static std::unique_ptr<RenderCommandFence> g_commandFences[NUM_FRAMES];
 static std::unique_ptr<RenderQueryPool> g_queryPools[NUM_FRAMES];
 static bool g_commandListStates[NUM_FRAMES];
-
-static Mutex g_copyMutex;
-static std::unique_ptr<RenderCommandQueue> g_copyQueue;
-static std::unique_ptr<RenderCommandList> g_copyCommandList;
-static std::unique_ptr<RenderCommandFence> g_copyCommandFence;
+static uint64_t g_commandListFrames[NUM_FRAMES];
+static uint64_t g_submittedFrames;
+static std::atomic<uint64_t> g_completedFrames;
 
 static std::unique_ptr<RenderSwapChain> g_swapChain;
 static bool g_swapChainValid;
@@ -384,6 +449,9 @@ static std::unique_ptr<RenderPipeline> g_gammaCorrectionPipeline;
 struct std::unique_ptr<RenderDescriptorSet> g_textureDescriptorSet;
 struct std::unique_ptr<RenderDescriptorSet> g_samplerDescriptorSet;
 
+static constexpr size_t TEXTURE_DESCRIPTOR_SIZE = 65536;
+static constexpr size_t SAMPLER_DESCRIPTOR_SIZE = 1024;
+
 enum
 {
     TEXTURE_DESCRIPTOR_NULL_TEXTURE_2D,
@@ -392,60 +460,174 @@ enum
     TEXTURE_DESCRIPTOR_NULL_COUNT
 };
 
-struct TextureDescriptorAllocator
+// Texture descriptors get allocated from any thread. Every thread takes free indices from the shared
+// list in batches, and indices freed by the render thread only become available again once the GPU
+// has finished the frames that could still reference them. The generation of a slot changes on every
+// allocation and free, which allows stale indices to be caught.
+struct TextureDescriptorSlab
 {
+    static constexpr size_t BATCH_SIZE = 32;
+
+    struct ThreadCache
+    {
+        std::vector<uint32_t> indices;
+
+        ~ThreadCache();
+    };
+
+    struct RetiredBatch
+    {
+        uint64_t frame = 0;
+        std::vector<uint32_t> indices;
+    };
+
     Mutex mutex;
-    uint32_t capacity = TEXTURE_DESCRIPTOR_NULL_COUNT;
     std::vector<uint32_t> freed;
+    uint32_t capacity = TEXTURE_DESCRIPTOR_NULL_COUNT;
+    std::unique_ptr<std::atomic<uint32_t>[]> generations = std::make_unique<std::atomic<uint32_t>[]>(TEXTURE_DESCRIPTOR_SIZE);
+    static inline thread_local ThreadCache s_threadCache;
+
+    // Only accessed by the render thread.
+    std::vector<RetiredBatch> retired;
+
+    std::atomic<uint32_t> liveCount;
+    std::atomic<uint32_t> peakLiveCount;
+    std::atomic<uint32_t> highWaterMark = TEXTURE_DESCRIPTOR_NULL_COUNT;
+    std::atomic<uint32_t> retiredCount;
 
     uint32_t allocate()
     {
-        std::lock_guard lock(mutex);
+        auto& cache = s_threadCache.indices;
 
-        uint32_t value;
-        if (!freed.empty())
+        if (cache.empty())
         {
-            value = freed.back();
-            freed.pop_back();
+            std::lock_guard lock(mutex);
+
+            size_t count = std::min(freed.size(), BATCH_SIZE);
+            cache.insert(cache.end(), freed.end() - count, freed.end());
+            freed.resize(freed.size() - count);
+
+            for (; count < BATCH_SIZE && capacity < TEXTURE_DESCRIPTOR_SIZE; count++)
+                cache.push_back(capacity++);
+
+            highWaterMark = capacity;
         }
-        else
+
+        assert(!cache.empty() && "Ran out of texture descriptors.");
+
+        uint32_t index = cache.back();
+        cache.pop_back();
+
+        ++generations[index];
+
+        uint32_t count = ++liveCount;
+        uint32_t peak = peakLiveCount;
+        while (count > peak && !peakLiveCount.compare_exchange_weak(peak, count))
+            ;
+
+        return index;
+    }
+
+    void allocate(GuestBaseTexture* texture)
+    {
+        texture->descriptorIndex = allocate();
+        texture->descriptorGeneration = generations[texture->descriptorIndex];
+    }
+
+    bool isValid(const GuestBaseTexture* texture) const
+    {
+        return texture->descriptorIndex < TEXTURE_DESCRIPTOR_NULL_COUNT ||
+            generations[texture->descriptorIndex] == texture->descriptorGeneration;
+    }
+
+    // Must be called from the render thread, the index gets reused
+    // after the frame currently being recorded finishes on the GPU.
+    void free(GuestBaseTexture* texture, uint64_t frame)
+    {
+        uint32_t index = texture->descriptorIndex;
+        assert(index >= TEXTURE_DESCRIPTOR_NULL_COUNT);
+        assert(isValid(texture) && "Texture descriptor was freed twice.");
+
+        ++generations[index];
+        --liveCount;
+        ++retiredCount;
+
+        if (retired.empty() || retired.back().frame != frame)
+            retired.emplace_back().frame = frame;
+
+        retired.back().indices.push_back(index);
+    }
+
+    void reclaim(uint64_t completedFrame)
+    {
+        size_t count = 0;
+        while (count < retired.size() && retired[count].frame <= completedFrame)
+            ++count;
+
+        if (count == 0)
+            return;
+
         {
-            value = capacity;
-            ++capacity;
+            std::lock_guard lock(mutex);
+
+            for (size_t i = 0; i < count; i++)
+            {
+                freed.insert(freed.end(), retired[i].indices.begin(), retired[i].indices.end());
+                retiredCount -= uint32_t(retired[i].indices.size());
+            }
         }
 
-        return value;
+        retired.erase(retired.begin(), retired.begin() + count);
     }
 
-    void free(uint32_t value)
+    void release(std::vector<uint32_t>& indices)
     {
-        assert(value != NULL);
         std::lock_guard lock(mutex);
-        freed.push_back(value);
+        freed.insert(freed.end(), indices.begin(), indices.end());
+        indices.clear();
     }
 };
 
 static std::unique_ptr<RenderTexture> g_blankTextures[TEXTURE_DESCRIPTOR_NULL_COUNT];
 static std::unique_ptr<RenderTextureView> g_blankTextureViews[TEXTURE_DESCRIPTOR_NULL_COUNT];
 
-static TextureDescriptorAllocator g_textureDescriptorAllocator;
+static TextureDescriptorSlab g_textureDescriptorSlab;
+
+TextureDescriptorSlab::ThreadCache::~ThreadCache()
+{
+    // Give the cached indices back for other threads to use.
+    if (!indices.empty())
+        g_textureDescriptorSlab.release(indices);
+}
 
 static std::unique_ptr<RenderPipelineLayout> g_pipelineLayout;
 static xxHashMap<std::unique_ptr<RenderPipeline>> g_pipelines;
 
-#ifdef ASYNC_PSO_DEBUG
 static std::atomic<uint32_t> g_pipelinesCreatedInRenderThread;
 static std::atomic<uint32_t> g_pipelinesCreatedAsynchronously;
 static std::atomic<uint32_t> g_pipelinesDropped;
 static std::atomic<uint32_t> g_pipelinesCurrentlyCompiling;
+
+#ifdef ASYNC_PSO_DEBUG
 static std::string g_pipelineDebugText;
 static Mutex g_debugMutex;
 #endif
 
-#ifdef PSO_CACHING
+#define PIPELINE_CACHE_FILENAME  "pipeline_cache.bin"
+#define PIPELINE_CACHE_SIGNATURE { 'P', 'S', 'O', 'C' }
+#define PIPELINE_CACHE_VERSION   2
+
+// Pipeline states created at runtime get persisted to the user directory, so they
+// can be compiled ahead of time on the next launch. Like the embedded cache, the
+// shader and vertex declaration pointers are replaced with their hashes.
 static xxHashMap<PipelineState> g_pipelineStatesToCache;
+static xxHashMap<std::vector<GuestVertexElement>> g_vertexElementsToCache;
 static Mutex g_pipelineCacheMutex;
-#endif
+static bool g_pipelineCacheDirty;
+
+// Cached pipeline states waiting on a guest shader that hasn't been created yet, keyed by the hash of that shader.
+static xxHashMap<std::vector<PipelineState>> g_pendingCachedPipelineStates;
+static Mutex g_pendingCachedPipelineMutex;
 
 static std::atomic<uint32_t> g_compilingPipelineTaskCount;
 static std::atomic<uint32_t> g_pendingPipelineTaskCount;
@@ -551,14 +733,7 @@ struct UploadAllocator
 
         if constexpr (TByteSwap)
         {
-            auto destination = reinterpret_cast<T*>(result.memory);
-
-            for (size_t i = 0; i < size; i += sizeof(T))
-            {
-                *destination = ByteSwap(*memory);
-                ++destination;
-                ++memory;
-            }
+            ByteSwapCopy(reinterpret_cast<T*>(result.memory), memory, (size + sizeof(T) - 1) / sizeof(T));
         }
         else
         {
@@ -577,6 +752,287 @@ struct UploadAllocator
 
 static UploadAllocator g_uploadAllocators[NUM_FRAMES];
 
+// Persistently mapped staging memory for buffer and texture uploads that can come from any thread.
+// Copies get recorded into the frame's command list by the render thread, and the memory is only
+// handed out again after the GPU has finished the frame that consumed it.
+struct StagingBuffer
+{
+    static constexpr size_t SIZE = 16 * 1024 * 1024;
+
+    std::unique_ptr<RenderBuffer> buffer;
+    uint8_t* memory = nullptr;
+    size_t size = 0;
+    size_t offset = 0;
+    uint32_t pendingCount = 0;
+    uint64_t lastFrame = 0;
+};
+
+struct StagingAllocation
+{
+    StagingBuffer* stagingBuffer = nullptr;
+    uint64_t offset = 0;
+    uint8_t* memory = nullptr;
+    bool hasCopies = false;
+};
+
+enum class StagingCopyType
+{
+    Buffer,
+    Texture
+};
+
+struct StagingCopy
+{
+    StagingCopyType type;
+    StagingBuffer* source;
+    uint64_t sourceOffset;
+    RenderBuffer* destBuffer;
+    uint64_t size;
+    RenderTexture* destTexture;
+    uint32_t mipLevel;
+    uint32_t arrayIndex;
+    RenderFormat format;
+    uint32_t width;
+    uint32_t height;
+    uint32_t depth;
+    uint32_t rowWidth;
+};
+
+struct StagingAllocator
+{
+    Mutex mutex;
+    std::vector<std::unique_ptr<StagingBuffer>> buffers;
+    StagingBuffer* current = nullptr;
+    std::vector<StagingCopy> pendingCopies;
+    std::atomic<bool> hasPendingCopies;
+
+    // Only accessed by the render thread.
+    std::vector<StagingCopy> copies;
+    std::vector<RenderBuffer*> barrierBuffers;
+    std::vector<RenderBufferBarrier> bufferBarriers;
+    std::vector<RenderTextureBarrier> textureBarriers;
+    ankerl::unordered_dense::set<RenderTexture*> barrierTextures;
+    ankerl::unordered_dense::set<XXH64_hash_t> destinations;
+
+    bool isReusable(const StagingBuffer& buffer) const
+    {
+        return buffer.pendingCount == 0 && buffer.lastFrame <= g_completedFrames;
+    }
+
+    StagingBuffer* createBuffer(size_t size)
+    {
+        auto& buffer = buffers.emplace_back(std::make_unique<StagingBuffer>());
+        buffer->buffer = g_device->createBuffer(RenderBufferDesc::UploadBuffer(size));
+        buffer->memory = reinterpret_cast<uint8_t*>(buffer->buffer->map());
+        buffer->size = size;
+        return buffer.get();
+    }
+
+    StagingBuffer* acquire(size_t size)
+    {
+        // Oversized buffers are dedicated to a single upload, release the ones the GPU is done with.
+        std::erase_if(buffers, [&](const auto& buffer) { return buffer->size > StagingBuffer::SIZE && isReusable(*buffer); });
+
+        if (size > StagingBuffer::SIZE)
+            return createBuffer(size);
+
+        for (auto& buffer : buffers)
+        {
+            if (buffer->size == StagingBuffer::SIZE && buffer.get() != current && isReusable(*buffer))
+            {
+                buffer->offset = 0;
+                return buffer.get();
+            }
+        }
+
+        return createBuffer(StagingBuffer::SIZE);
+    }
+
+    StagingAllocation allocate(size_t size, size_t alignment)
+    {
+        std::lock_guard lock(mutex);
+
+        StagingBuffer* buffer;
+        size_t offset = 0;
+
+        if (size > StagingBuffer::SIZE)
+        {
+            buffer = acquire(size);
+        }
+        else
+        {
+            if (current != nullptr)
+                offset = (current->offset + alignment - 1) & ~(alignment - 1);
+
+            if (current == nullptr || offset + size > StagingBuffer::SIZE)
+            {
+                current = acquire(size);
+                offset = 0;
+            }
+
+            buffer = current;
+        }
+
+        buffer->offset = offset + size;
+        buffer->pendingCount++;
+
+        return { buffer, offset, buffer->memory + offset };
+    }
+
+    // The allocation holds the reference of its first copy, every other copy needs its own.
+    void enqueue(StagingAllocation& allocation, const StagingCopy& copy)
+    {
+        std::lock_guard lock(mutex);
+
+        if (allocation.hasCopies)
+            ++allocation.stagingBuffer->pendingCount;
+
+        allocation.hasCopies = true;
+        pendingCopies.push_back(copy);
+        hasPendingCopies = true;
+    }
+
+    void copyBuffer(RenderBuffer* dest, StagingAllocation& allocation, uint64_t size)
+    {
+        StagingCopy copy{};
+        copy.type = StagingCopyType::Buffer;
+        copy.source = allocation.stagingBuffer;
+        copy.sourceOffset = allocation.offset;
+        copy.destBuffer = dest;
+        copy.size = size;
+        enqueue(allocation, copy);
+    }
+
+    void copyTexture(RenderTexture* dest, uint32_t mipLevel, uint32_t arrayIndex, StagingAllocation& allocation, uint64_t offset,
+        RenderFormat format, uint32_t width, uint32_t height, uint32_t depth, uint32_t rowWidth)
+    {
+        StagingCopy copy{};
+        copy.type = StagingCopyType::Texture;
+        copy.source = allocation.stagingBuffer;
+        copy.sourceOffset = allocation.offset + offset;
+        copy.destTexture = dest;
+        copy.mipLevel = mipLevel;
+        copy.arrayIndex = arrayIndex;
+        copy.format = format;
+        copy.width = width;
+        copy.height = height;
+        copy.depth = depth;
+        copy.rowWidth = rowWidth;
+        enqueue(allocation, copy);
+    }
+
+    // Copies sharing a batch are recorded between a single set of barriers,
+    // so the same destination showing up twice needs to start a new batch.
+    void recordBatch(RenderCommandList* commandList, size_t begin, size_t end)
+    {
+        for (auto buffer : barrierBuffers)
+            bufferBarriers.emplace_back(buffer, RenderBufferAccess::WRITE);
+
+        if (!bufferBarriers.empty() || !textureBarriers.empty())
+        {
+            commandList->barriers(RenderBarrierStage::COPY, bufferBarriers.data(), uint32_t(bufferBarriers.size()),
+                textureBarriers.data(), uint32_t(textureBarriers.size()));
+        }
+
+        for (size_t i = begin; i < end; i++)
+        {
+            auto& copy = copies[i];
+
+            if (copy.type == StagingCopyType::Buffer)
+            {
+                commandList->copyBufferRegion(copy.destBuffer->at(0), copy.source->buffer->at(copy.sourceOffset), copy.size);
+            }
+            else
+            {
+                commandList->copyTextureRegion(
+                    RenderTextureCopyLocation::Subresource(copy.destTexture, copy.mipLevel, copy.arrayIndex),
+                    RenderTextureCopyLocation::PlacedFootprint(copy.source->buffer.get(), copy.format, copy.width, copy.height, copy.depth, copy.rowWidth, copy.sourceOffset));
+            }
+        }
+
+        if (!barrierBuffers.empty())
+        {
+            bufferBarriers.clear();
+
+            for (auto buffer : barrierBuffers)
+                bufferBarriers.emplace_back(buffer, RenderBufferAccess::READ);
+
+            commandList->barriers(RenderBarrierStage::GRAPHICS, bufferBarriers.data(), uint32_t(bufferBarriers.size()));
+        }
+
+        barrierBuffers.clear();
+        bufferBarriers.clear();
+        textureBarriers.clear();
+        barrierTextures.clear();
+        destinations.clear();
+    }
+
+    void flush(RenderCommandList* commandList, uint64_t frame)
+    {
+        if (!hasPendingCopies)
+            return;
+
+        {
+            std::lock_guard lock(mutex);
+            std::swap(copies, pendingCopies);
+            hasPendingCopies = false;
+        }
+
+        size_t begin = 0;
+
+        for (size_t i = 0; i < copies.size(); i++)
+        {
+            auto& copy = copies[i];
+
+            struct
+            {
+                const void* resource;
+                uint32_t mipLevel;
+                uint32_t arrayIndex;
+            } destination{};
+
+            if (copy.type == StagingCopyType::Buffer)
+            {
+                destination.resource = copy.destBuffer;
+            }
+            else
+            {
+                destination.resource = copy.destTexture;
+                destination.mipLevel = copy.mipLevel;
+                destination.arrayIndex = copy.arrayIndex;
+            }
+
+            if (!destinations.emplace(XXH3_64bits(&destination, sizeof(destination))).second)
+            {
+                recordBatch(commandList, begin, i);
+                destinations.emplace(XXH3_64bits(&destination, sizeof(destination)));
+                begin = i;
+            }
+
+            if (copy.type == StagingCopyType::Buffer)
+                barrierBuffers.push_back(copy.destBuffer);
+            else if (barrierTextures.emplace(copy.destTexture).second)
+                textureBarriers.emplace_back(copy.destTexture, RenderTextureLayout::COPY_DEST);
+        }
+
+        recordBatch(commandList, begin, copies.size());
+
+        {
+            std::lock_guard lock(mutex);
+
+            for (auto& copy : copies)
+            {
+                --copy.source->pendingCount;
+                copy.source->lastFrame = frame;
+            }
+        }
+
+        copies.clear();
+    }
+};
+
+static StagingAllocator g_stagingAllocator;
+
 struct IntermediaryUploadAllocator
 {
     static constexpr size_t SIZE = 16 * 1024 * 1024;
@@ -624,8 +1080,55 @@ struct IntermediaryUploadAllocator
 
 static IntermediaryUploadAllocator g_intermediaryUploadAllocator;
 
+// Identical constant blocks uploaded within the same frame share the same allocation.
+static xxHashMap<UploadAllocation> g_shaderConstantAllocations;
+
+static std::atomic<uint32_t> g_shaderConstantUploadCount;
+static std::atomic<uint32_t> g_shaderConstantDeduplicatedCount;
+static std::atomic<uint32_t> g_shaderConstantReusedCount;
+static std::atomic<uint64_t> g_shaderConstantUploadedRegisters;
+static std::atomic<uint64_t> g_shaderConstantDirtyRegisters;
+
+template<size_t TRegisterCount>
+static UploadAllocation UploadShaderConstants(ShaderConstants<TRegisterCount>& constants)
+{
+    if (!constants.isDirty() && constants.hasAllocation)
+    {
+        ++g_shaderConstantReusedCount;
+        return constants.allocation;
+    }
+
+    if (constants.isDirty())
+        g_shaderConstantDirtyRegisters += constants.dirtyLast - constants.dirtyFirst + 1;
+
+    auto& allocation = g_shaderConstantAllocations[XXH3_64bits(constants.values, sizeof(constants.values))];
+    if (allocation.buffer == nullptr)
+    {
+        allocation = g_uploadAllocators[g_frame].allocate<false>(constants.values, sizeof(constants.values), 0x100);
+        ++g_shaderConstantUploadCount;
+        g_shaderConstantUploadedRegisters += TRegisterCount;
+    }
+    else
+    {
+        ++g_shaderConstantDeduplicatedCount;
+    }
+
+    constants.allocation = allocation;
+    constants.hasAllocation = true;
+    constants.dirtyFirst = UINT32_MAX;
+    constants.dirtyLast = 0;
+
+    return allocation;
+}
+
+static void ResetShaderConstantAllocations()
+{
+    g_shaderConstantAllocations.clear();
+    g_vertexShaderConstants.hasAllocation = false;
+    g_pixelShaderConstants.hasAllocation = false;
+}
+
 static std::vector<GuestResource*> g_tempResources[NUM_FRAMES];
-static std::vector<std::unique_ptr<RenderBuffer>> g_tempBuffers[NUM_FRAMES];
 
 template<GuestPrimitiveType PrimitiveType>
 struct PrimitiveIndexData
@@ -729,10 +1232,10 @@ static void DestructTempResources()
                 g_userHeap.Free(texture->mappedMemory);
             }
 
-            g_textureDescriptorAllocator.free(texture->descriptorIndex);
+            g_textureDescriptorSlab.free(texture, g_submittedFrames + 1);
 
             if (texture->patchedTexture != nullptr)
-                g_textureDescriptorAllocator.free(texture->patchedTexture->descriptorIndex);
+                g_textureDescriptorSlab.free(texture->patchedTexture.get(), g_submittedFrames + 1);
 
             texture->~GuestTexture();
             break;
@@ -757,7 +1260,7 @@ static void DestructTempResources()
             const auto surface = reinterpret_cast<GuestSurface*>(resource);
 
             if (surface->descriptorIndex != NULL)
-                g_textureDescriptorAllocator.free(surface->descriptorIndex);
+                g_textureDescriptorSlab.free(surface, g_submittedFrames + 1);
 
             surface->~GuestSurface();
             break;
@@ -779,7 +1282,6 @@ static void DestructTempResources()
     }
 
     g_tempResources[g_frame].clear();
-    g_tempBuffers[g_frame].clear();
 }
 
 static std::thread::id g_presentThreadId = std::this_thread::get_id();
@@ -1060,6 +1562,48 @@ struct RenderCommand
 
 static moodycamel::BlockingConcurrentQueue<RenderCommand> g_renderQueue;
 
+// Commands get recorded into a buffer local to the calling thread and are submitted in bulk at draw and
+// present boundaries. Each thread submits through its own producer token, so the queue isn't contended
+// per command and the commands of a thread are always dequeued in the order they were recorded.
+struct LocalRenderCommandQueue
+{
+    RenderCommand commands[256];
+    uint32_t count = 0;
+    std::optional<moodycamel::ProducerToken> token;
+
+    ~LocalRenderCommandQueue()
+    {
+        submit();
+    }
+
+    RenderCommand& enqueue()
+    {
+        if (count == std::size(commands))
+            submit();
+
+        return commands[count++];
+    }
+
+    void enqueue(const RenderCommand& cmd)
+    {
+        enqueue() = cmd;
+    }
+
+    void submit()
+    {
+        if (count == 0)
+            return;
+
+        if (!token.has_value())
+            token.emplace(g_renderQueue);
+
+        g_renderQueue.enqueue_bulk(*token, commands, count);
+        count = 0;
+    }
+};
+
+static thread_local LocalRenderCommandQueue g_localRenderQueue;
+
 template<GuestRenderState TType>
 static void SetRenderState(GuestDevice* device, uint32_t value)
 {
@@ -1067,7 +1611,7 @@ static void SetRenderState(GuestDevice* device, uint32_t value)
     cmd.type = RenderCommandType::SetRenderState;
     cmd.setRenderState.type = TType;
     cmd.setRenderState.value = value;
-    g_renderQueue.enqueue(cmd);
+    g_localRenderQueue.enqueue(cmd);
 }
 
 static void SetRenderStateUnimplemented(GuestDevice* device, uint32_t value)
@@ -1480,26 +2024,11 @@ static bool DetectWine()
 }
 #endif
 
-static constexpr size_t TEXTURE_DESCRIPTOR_SIZE = 65536;
-static constexpr size_t SAMPLER_DESCRIPTOR_SIZE = 1024;
-
 static std::unique_ptr<GuestTexture> g_imFontTexture;
 static std::unique_ptr<RenderPipelineLayout> g_imPipelineLayout;
 static std::unique_ptr<RenderPipeline> g_imPipeline;
 static std::unique_ptr<RenderPipeline> g_imAdditivePipeline;
 
-template<typename T>
-static void ExecuteCopyCommandList(const T& function)
-{
-    std::lock_guard lock(g_copyMutex);
-
-    g_copyCommandList->begin();
-    function();
-    g_copyCommandList->end();
-    g_copyQueue->executeCommandLists(g_copyCommandList.get(), g_copyCommandFence.get());
-    g_copyQueue->waitForCommandFence(g_copyCommandFence.get());
-}
-
 static constexpr uint32_t PITCH_ALIGNMENT = 0x100;
 static constexpr uint32_t PLACEMENT_ALIGNMENT = 0x200;
 
@@ -1575,8 +2104,8 @@ static void CreateImGuiBackend()
 
     uint32_t rowPitch = (width * 4 + PITCH_ALIGNMENT - 1) & ~(PITCH_ALIGNMENT - 1);
     uint32_t slicePitch = (rowPitch * height + PLACEMENT_ALIGNMENT - 1) & ~(PLACEMENT_ALIGNMENT - 1);
-    auto uploadBuffer = g_device->createBuffer(RenderBufferDesc::UploadBuffer(slicePitch));
-    uint8_t* mappedMemory = reinterpret_cast<uint8_t*>(uploadBuffer->map());
+    auto allocation = g_stagingAllocator.allocate(slicePitch, PLACEMENT_ALIGNMENT);
+    uint8_t* mappedMemory = allocation.memory;
 
     if (rowPitch == (width * 4))
     {
@@ -1592,16 +2121,7 @@ static void CreateImGuiBackend()
         }
     }
 
-    uploadBuffer->unmap();
-
-    ExecuteCopyCommandList([&]
-        {
-            g_copyCommandList->barriers(RenderBarrierStage::COPY, RenderTextureBarrier(g_imFontTexture->texture, RenderTextureLayout::COPY_DEST));
-
-            g_copyCommandList->copyTextureRegion(
-                RenderTextureCopyLocation::Subresource(g_imFontTexture->texture, 0),
-                RenderTextureCopyLocation::PlacedFootprint(uploadBuffer.get(), RenderFormat::R8G8B8A8_UNORM, width, height, 1, rowPitch / 4, 0));
-        });
+    g_stagingAllocator.copyTexture(g_imFontTexture->texture, 0, 0, allocation, 0, RenderFormat::R8G8B8A8_UNORM, width, height, 1, rowPitch / 4);
 
     g_imFontTexture->layout = RenderTextureLayout::COPY_DEST;
 
@@ -1611,7 +2131,7 @@ static void CreateImGuiBackend()
     textureViewDesc.mipLevels = 1;
     g_imFontTexture->textureView = g_imFontTexture->texture->createTextureView(textureViewDesc);
 
-    g_imFontTexture->descriptorIndex = g_textureDescriptorAllocator.allocate();
+    g_textureDescriptorSlab.allocate(g_imFontTexture.get());
     g_textureDescriptorSet->setTexture(g_imFontTexture->descriptorIndex, g_imFontTexture->texture, RenderTextureLayout::SHADER_READ, g_imFontTexture->textureView.get());
 #endif
 
@@ -1734,7 +2254,7 @@ static void BeginCommandList()
             g_intermediaryBackBufferTextureHeight != height)
         {
             if (g_intermediaryBackBufferTextureDescriptorIndex == NULL)
-                g_intermediaryBackBufferTextureDescriptorIndex = g_textureDescriptorAllocator.allocate();
+                g_intermediaryBackBufferTextureDescriptorIndex = g_textureDescriptorSlab.allocate();
 
             Video::WaitForGPU(); // Fine to wait for GPU, this'll only happen during resize.
 
@@ -2001,10 +2521,6 @@ bool Video::CreateHostDevice(const char *sdlVideoDriver, bool graphicsApiRetry)
     for (auto& queryPool : g_queryPools)
         queryPool = g_device->createQueryPool(NUM_QUERIES);
 
-    g_copyQueue = g_device->createCommandQueue(RenderCommandListType::COPY);
-    g_copyCommandList = g_copyQueue->createCommandList();
-    g_copyCommandFence = g_device->createCommandFence();
-
     uint32_t bufferCount = 2;
 
     switch (Config::TripleBuffering)
@@ -2243,6 +2759,8 @@ void Video::WaitForGPU()
         }
     }
 
+    g_completedFrames = *std::max_element(std::begin(g_commandListFrames), std::end(g_commandListFrames));
+
     // Execute an empty command list and wait for it to end to guarantee that any remaining presentation has finished.
     g_commandLists[0]->begin();
     g_commandLists[0]->end();
@@ -2330,7 +2848,8 @@ static void DestructResource(GuestResource* resource)
     RenderCommand cmd;
     cmd.type = RenderCommandType::DestructResource;
     cmd.destructResource.resource = resource;
-    g_renderQueue.enqueue(cmd);
+    g_localRenderQueue.enqueue(cmd);
+    g_localRenderQueue.submit();
 }
 
 static void ProcDestructResource(const RenderCommand& cmd)
@@ -2363,7 +2882,8 @@ static void UnlockTextureRect(GuestTexture* texture)
     RenderCommand cmd;
     cmd.type = RenderCommandType::UnlockTextureRect;
     cmd.unlockTextureRect.texture = texture;
-    g_renderQueue.enqueue(cmd);
+    g_localRenderQueue.enqueue(cmd);
+    g_localRenderQueue.submit();
 }
 
 static void ProcUnlockTextureRect(const RenderCommand& cmd)
@@ -2402,48 +2922,23 @@ static void* LockVertexBuffer(GuestBuffer* buffer, uint32_t, uint32_t, uint32_t
 static std::atomic<uint32_t> g_bufferUploadCount = 0;
 
 template<typename T>
-static void UnlockBuffer(GuestBuffer* buffer, bool useCopyQueue)
+static void UnlockBuffer(GuestBuffer* buffer, bool outsideRenderThread)
 {
     auto copyBuffer = [&](T* dest)
         {
-            auto src = reinterpret_cast<const T*>(buffer->mappedMemory);
-
-            for (size_t i = 0; i < buffer->dataSize; i += sizeof(T))
-            {
-                *dest = ByteSwap(*src);
-                ++dest;
-                ++src;
-            }
+            ByteSwapCopy(dest, reinterpret_cast<const T*>(buffer->mappedMemory), (buffer->dataSize + sizeof(T) - 1) / sizeof(T));
         };
 
-    if (useCopyQueue && g_capabilities.gpuUploadHeap)
+    if (outsideRenderThread && g_capabilities.gpuUploadHeap)
     {
         copyBuffer(reinterpret_cast<T*>(buffer->buffer->map()));
         buffer->buffer->unmap();
     }
     else
     {
-        auto uploadBuffer = g_device->createBuffer(RenderBufferDesc::UploadBuffer(buffer->dataSize));
-        copyBuffer(reinterpret_cast<T*>(uploadBuffer->map()));
-        uploadBuffer->unmap();
-
-        if (useCopyQueue)
-        {
-            ExecuteCopyCommandList([&]
-                {
-                    g_copyCommandList->copyBufferRegion(buffer->buffer->at(0), uploadBuffer->at(0), buffer->dataSize);
-                });
-        }
-        else
-        {
-            auto& commandList = g_commandLists[g_frame];
-
-            commandList->barriers(RenderBarrierStage::COPY, RenderBufferBarrier(buffer->buffer.get(), RenderBufferAccess::WRITE));
-            commandList->copyBufferRegion(buffer->buffer->at(0), uploadBuffer->at(0), buffer->dataSize);
-            commandList->barriers(RenderBarrierStage::GRAPHICS, RenderBufferBarrier(buffer->buffer.get(), RenderBufferAccess::READ));
-
-            g_tempBuffers[g_frame].emplace_back(std::move(uploadBuffer));
-        }
+        auto allocation = g_stagingAllocator.allocate(buffer->dataSize, 0x10);
+        copyBuffer(reinterpret_cast<T*>(allocation.memory));
+        g_stagingAllocator.copyBuffer(buffer->buffer.get(), allocation, buffer->dataSize);
     }
 
     g_bufferUploadCount++;
@@ -2561,6 +3056,19 @@ static void DrawProfiler()
 
     g_profilerWasToggled = toggleProfiler;
 
+    // The first press starts recording, every press after saves the frames recorded so far.
+    bool toggleTrace = SDL_GetKeyboardState(nullptr)[SDL_SCANCODE_F2] != 0;
+
+    if (!g_traceWasToggled && toggleTrace)
+    {
+        if (Trace::s_isRecording)
+            Trace::Export(Trace::GetExportPath());
+        else
+            Trace::StartRecording();
+    }
+
+    g_traceWasToggled = toggleTrace;
+
     if (!g_profilerVisible)
         return;
 
@@ -2633,14 +3141,68 @@ static void DrawProfiler()
                 physicalDiagnostics = o1heapGetDiagnostics(g_userHeap.physicalHeap);
             }
 
+            g_heapStatsElapsedTime += App::s_deltaTime;
+
+            if (g_heapStatsElapsedTime >= 1.0)
+            {
+                uint64_t allocations = g_userHeap.stats.allocations.load();
+                uint64_t contentions = g_userHeap.stats.contentions.load();
+
+                g_heapAllocationRate = double(allocations - g_heapStatsAllocations) / g_heapStatsElapsedTime;
+                g_heapContentionRate = double(contentions - g_heapStatsContentions) / g_heapStatsElapsedTime;
+
+                g_heapStatsAllocations = allocations;
+                g_heapStatsContentions = contentions;
+                g_heapStatsElapsedTime = 0.0;
+            }
+
             ImGui::Text("Heap Allocated: %d MB", int32_t(diagnostics.allocated / (1024 * 1024)));
             ImGui::Text("Physical Heap Allocated: %d MB", int32_t(physicalDiagnostics.allocated / (1024 * 1024)));
+            ImGui::Text("Heap Allocations: %g/s", g_heapAllocationRate);
+            ImGui::Text("Heap Lock Contentions: %g/s", g_heapContentionRate);
+            ImGui::Text("Heap Shared Allocations: %llu (%llu total)", (unsigned long long)g_userHeap.stats.sharedAllocations.load(), (unsigned long long)g_userHeap.stats.allocations.load());
+            ImGui::Text("Heap Shared Frees: %llu (%llu total)", (unsigned long long)g_userHeap.stats.sharedFrees.load(), (unsigned long long)g_userHeap.stats.frees.load());
+            ImGui::Text("Heap Reallocations: %llu in place, %llu copied", (unsigned long long)g_userHeap.stats.inPlaceReallocations.load(), (unsigned long long)g_userHeap.stats.copiedReallocations.load());
         }
 
         ImGui::Text("GPU Waits: %d", int32_t(g_waitForGPUCount));
         ImGui::Text("Buffer Uploads: %d", int32_t(g_bufferUploadCount));
         ImGui::NewLine();
 
+        XAudioStats audioStats = XAudioGetStats();
+        ImGui::Text("Audio Queued Frames: %d / %d", int32_t(audioStats.queuedFrames), int32_t(audioStats.targetFrames));
+        ImGui::Text("Audio Underruns: %llu", (unsigned long long)audioStats.underruns);
+        ImGui::Text("Audio Overruns: %llu", (unsigned long long)audioStats.overruns);
+        ImGui::Text("Audio Submit: %g ms average, %g ms max", audioStats.averageSubmitTime, audioStats.maxSubmitTime);
+
+        XmaCache::Stats xmaCacheStats = XmaCache::GetStats();
+        ImGui::Text("XMA Cache: %llu hits, %llu misses, %llu evicted, %llu loaded from disk", (unsigned long long)xmaCacheStats.hits,
+            (unsigned long long)xmaCacheStats.misses, (unsigned long long)xmaCacheStats.evictions, (unsigned long long)xmaCacheStats.diskLoads);
+        ImGui::Text("XMA Cache Size: %d KB in memory, %d KB on disk", int32_t(xmaCacheStats.memoryUsage / 1024), int32_t(xmaCacheStats.diskUsage / 1024));
+        ImGui::NewLine();
+
+        ImGui::Text("Shader Constant Uploads: %d", g_shaderConstantUploadCount.load());
+        ImGui::Text("Shader Constant Uploads Deduplicated: %d", g_shaderConstantDeduplicatedCount.load());
+        ImGui::Text("Shader Constant Uploads Reused: %d", g_shaderConstantReusedCount.load());
+        ImGui::Text("Shader Constant Registers Uploaded: %llu (%llu dirty)", (unsigned long long)g_shaderConstantUploadedRegisters.load(), (unsigned long long)g_shaderConstantDirtyRegisters.load());
+        ImGui::NewLine();
+
+        ImGui::Text("Texture Descriptors: %d", g_textureDescriptorSlab.liveCount.load());
+        ImGui::Text("Texture Descriptors Peak: %d", g_textureDescriptorSlab.peakLiveCount.load());
+        ImGui::Text("Texture Descriptors High Water Mark: %d / %d", g_textureDescriptorSlab.highWaterMark.load(), int32_t(TEXTURE_DESCRIPTOR_SIZE));
+        ImGui::Text("Texture Descriptors Pending Reclaim: %d", g_textureDescriptorSlab.retiredCount.load());
+        ImGui::NewLine();
+
+        ImGui::Text("Pipelines Created In Render Thread: %d", g_pipelinesCreatedInRenderThread.load());
+        ImGui::Text("Pipelines Created Asynchronously: %d", g_pipelinesCreatedAsynchronously.load());
+        ImGui::Text("Pipelines Dropped: %d", g_pipelinesDropped.load());
+        ImGui::Text("Pipelines Currently Compiling: %d", g_pipelinesCurrentlyCompiling.load());
+        ImGui::NewLine();
+
+        ImGui::Text("Trace: %s", Trace::s_isRecording ? "Recording (F2 to save)" : "Stopped (F2 to record)");
+        ImGui::Text("Heap Diagnostics: F3");
+        ImGui::NewLine();
+
         ImGui::Text("Present Wait: %s", g_capabilities.presentWait ? "Supported" : "Unsupported");
         ImGui::Text("Triangle Fan: %s", g_capabilities.triangleFan ? "Supported" : "Unsupported");
         ImGui::Text("Dynamic Depth Bias: %s", g_capabilities.dynamicDepthBias ? "Supported" : "Unsupported");
@@ -2677,6 +3239,36 @@ static void DrawProfiler()
         ImGui::Checkbox("Show FPS", &Config::ShowFPS.Value);
         ImGui::NewLine();
 
+        if (ImGui::TreeNode("Contended Critical Sections"))
+        {
+            ImGui::Indent();
+
+            auto criticalSectionStats = GetCriticalSectionStats();
+
+            for (size_t i = 0; i < std::min<size_t>(criticalSectionStats.size(), 16); i++)
+            {
+                auto& stats = criticalSectionStats[i];
+                ImGui::Text("0x%08X: %u contended, %u spun, %u parked, %u average spins", stats.address, stats.contentions, stats.spinAcquisitions, stats.parks, stats.averageSpins);
+            }
+
+            ImGui::Unindent();
+            ImGui::TreePop();
+        }
+
+        if (ImGui::TreeNode("XMA Streams"))
+        {
+            ImGui::Indent();
+
+            for (auto& stats : XmaGetStreamStats())
+            {
+                ImGui::Text("0x%08X: %u Hz, %u channels, %llu passes, %g ms average wait, %g ms max wait, %g ms average decode", stats.address, stats.sampleRate,
+                    stats.channelCount, (unsigned long long)stats.decodePassCount, stats.averageQueueLatency, stats.maxQueueLatency, stats.averageDecodeTime);
+            }
+
+            ImGui::Unindent();
+            ImGui::TreePop();
+        }
+
         if (ImGui::TreeNode("Device Names"))
         {
             ImGui::Indent();
@@ -2697,6 +3289,124 @@ static void DrawProfiler()
     font->Scale = defaultScale;
 }
 
+static void DrawHeapDiagnostics()
+{
+    bool toggleHeapDiagnostics = SDL_GetKeyboardState(nullptr)[SDL_SCANCODE_F3] != 0;
+
+    if (!g_heapDiagnosticsWasToggled && toggleHeapDiagnostics)
+        g_heapDiagnosticsVisible = !g_heapDiagnosticsVisible;
+
+    g_heapDiagnosticsWasToggled = toggleHeapDiagnostics;
+
+    if (!g_heapDiagnosticsVisible || g_userHeap.heap == nullptr || g_userHeap.physicalHeap == nullptr)
+        return;
+
+    // Walking the heaps locks them, so only sample once a second.
+    g_heapDiagnosticsElapsedTime += App::s_deltaTime;
+
+    if (g_heapDiagnosticsElapsedTime >= 1.0)
+    {
+        g_heapDiagnostics = g_userHeap.GetDiagnostics(false);
+        g_physicalHeapDiagnostics = g_userHeap.GetDiagnostics(true);
+        g_heapCallSites = g_userHeap.GetCallSites();
+
+        g_heapLiveHistory[g_heapHistoryIndex] = double(g_heapDiagnostics.liveBytes) / (1024.0 * 1024.0);
+        g_heapLargestFreeHistory[g_heapHistoryIndex] = double(g_heapDiagnostics.largestFreeBlock) / (1024.0 * 1024.0);
+        g_heapHistoryIndex = (g_heapHistoryIndex + 1) % HEAP_HISTORY_COUNT;
+
+        g_heapDiagnosticsElapsedTime = 0.0;
+    }
+
+    ImFont* font = ImFontAtlasSnapshot::GetFont("FOT-RodinPro-DB.otf");
+    float defaultScale = font->Scale;
+    font->Scale = ImGui::GetDefaultFont()->FontSize / font->FontSize;
+    ImGui::PushFont(font);
+
+    if (ImGui::Begin("Heap", &g_heapDiagnosticsVisible))
+    {
+        if (ImPlot::BeginPlot("Heap Over Time"))
+        {
+            ImPlot::SetupAxis(ImAxis_X1, "s", ImPlotAxisFlags_None);
+            ImPlot::SetupAxis(ImAxis_Y1, "MB", ImPlotAxisFlags_AutoFit);
+            ImPlot::PlotLine<double>("Live", g_heapLiveHistory, HEAP_HISTORY_COUNT, 1.0, 0.0, ImPlotLineFlags_None, g_heapHistoryIndex);
+            ImPlot::PlotLine<double>("Largest Free Block", g_heapLargestFreeHistory, HEAP_HISTORY_COUNT, 1.0, 0.0, ImPlotLineFlags_None, g_heapHistoryIndex);
+            ImPlot::EndPlot();
+        }
+
+        auto drawDiagnostics = [](const char* name, const HeapDiagnostics& diagnostics)
+            {
+                ImGui::Text("%s Live: %.2f MB", name, double(diagnostics.liveBytes) / (1024.0 * 1024.0));
+                ImGui::Text("%s Thread Cached: %.2f MB (%u blocks)", name, double(diagnostics.cachedBytes) / (1024.0 * 1024.0), diagnostics.cachedFragments);
+                ImGui::Text("%s Peak: %.2f MB", name, double(diagnostics.peakBytes) / (1024.0 * 1024.0));
+                ImGui::Text("%s Capacity: %.2f MB", name, double(diagnostics.capacity) / (1024.0 * 1024.0));
+                ImGui::Text("%s Largest Free Block: %.2f MB", name, double(diagnostics.largestFreeBlock) / (1024.0 * 1024.0));
+                ImGui::Text("%s Fragments: %u used, %u free", name, diagnostics.usedFragments, diagnostics.freeFragments);
+                ImGui::Text("%s Out Of Memory: %llu", name, (unsigned long long)diagnostics.oomCount);
+            };
+
+        drawDiagnostics("Heap", g_heapDiagnostics);
+        ImGui::NewLine();
+        drawDiagnostics("Physical Heap", g_physicalHeapDiagnostics);
+        ImGui::NewLine();
+
+        if (ImPlot::BeginPlot("Heap Fragment Sizes"))
+        {
+            double usedCounts[HeapDiagnostics::HISTOGRAM_SIZE];
+            double freeCounts[HeapDiagnostics::HISTOGRAM_SIZE];
+
+            for (size_t i = 0; i < HeapDiagnostics::HISTOGRAM_SIZE; i++)
+            {
+                usedCounts[i] = g_heapDiagnostics.usedHistogram[i];
+                freeCounts[i] = g_heapDiagnostics.freeHistogram[i];
+            }
+
+            ImPlot::SetupAxis(ImAxis_X1, "log2(size)", ImPlotAxisFlags_AutoFit);
+            ImPlot::SetupAxis(ImAxis_Y1, "count", ImPlotAxisFlags_AutoFit);
+            ImPlot::PlotBars<double>("Used", usedCounts, HeapDiagnostics::HISTOGRAM_SIZE, 0.4, -0.2);
+            ImPlot::PlotBars<double>("Free", freeCounts, HeapDiagnostics::HISTOGRAM_SIZE, 0.4, 0.2);
+            ImPlot::EndPlot();
+        }
+
+        bool isTrackingCallSites = g_userHeap.isTrackingCallSites;
+        if (ImGui::Checkbox("Track Call Sites", &isTrackingCallSites))
+            g_userHeap.SetCallSiteTracking(isTrackingCallSites);
+
+        ImGui::SameLine();
+
+        if (ImGui::Button("Export JSON"))
+            g_userHeap.ExportDiagnostics(g_userHeap.GetDiagnosticsExportPath());
+
+        if (ImGui::BeginTable("Call Sites", 4, ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg | ImGuiTableFlags_ScrollY, { 0.0f, 300.0f }))
+        {
+            ImGui::TableSetupScrollFreeze(0, 1);
+            ImGui::TableSetupColumn("LR");
+            ImGui::TableSetupColumn("Live");
+            ImGui::TableSetupColumn("Live Count");
+            ImGui::TableSetupColumn("Allocations");
+            ImGui::TableHeadersRow();
+
+            for (auto& callSite : g_heapCallSites)
+            {
+                ImGui::TableNextRow();
+                ImGui::TableNextColumn();
+                ImGui::Text("0x%08X", callSite.lr);
+                ImGui::TableNextColumn();
+                ImGui::Text("%.2f KB", double(callSite.liveBytes) / 1024.0);
+                ImGui::TableNextColumn();
+                ImGui::Text("%u", callSite.liveCount);
+                ImGui::TableNextColumn();
+                ImGui::Text("%llu", (unsigned long long)callSite.allocations);
+            }
+
+            ImGui::EndTable();
+        }
+    }
+    ImGui::End();
+
+    ImGui::PopFont();
+    font->Scale = defaultScale;
+}
+
 static void DrawFPS()
 {
     if (!Config::ShowFPS)
@@ -2802,6 +3512,7 @@ static void DrawImGui()
 
     DrawFPS();
     DrawProfiler();
+    DrawHeapDiagnostics();
     ImGui::Render();
 
     auto drawData = ImGui::GetDrawData();
@@ -2809,7 +3520,7 @@ static void DrawImGui()
     {
         RenderCommand cmd;
         cmd.type = RenderCommandType::DrawImGui;
-        g_renderQueue.enqueue(cmd);
+        g_localRenderQueue.enqueue(cmd);
     }
 }
 
@@ -2817,6 +3528,8 @@ static void SetFramebuffer(GuestSurface *renderTarget, GuestSurface *depthStenci
 
 static void ProcDrawImGui(const RenderCommand& cmd)
 {
+    g_stagingAllocator.flush(g_commandLists[g_frame].get(), g_submittedFrames + 1);
+
     // Make sure the backbuffer is the current target.
     AddBarrier(g_backBuffer, RenderTextureLayout::COLOR_WRITE);
     FlushBarriers();
@@ -2984,20 +3697,38 @@ void Video::WaitOnSwapChain()
 }
 
 static bool g_shouldPrecompilePipelines;
+static bool g_loadedPipelineCache;
 static std::atomic<bool> g_executedCommandList;
+static std::atomic<uint64_t> g_executeCommandListTimestamp;
+
+static void LoadPipelineCache();
+static void CompileCachedPipelineStates(XXH64_hash_t shaderHash);
 
 void Video::Present() 
 {
+    static bool s_isThreadNamed;
+
+    if (!s_isThreadNamed)
+    {
+        Trace::SetThreadName("Main Thread");
+        s_isThreadNamed = true;
+    }
+
+    TraceScope traceScope("Video::Present");
+
     g_readyForCommands = false;
 
     RenderCommand cmd;
     cmd.type = RenderCommandType::ExecutePendingStretchRectCommands;
-    g_renderQueue.enqueue(cmd);
+    g_localRenderQueue.enqueue(cmd);
 
     DrawImGui();
 
+    g_executeCommandListTimestamp = Trace::GetTimestamp();
+
     cmd.type = RenderCommandType::ExecuteCommandList;
-    g_renderQueue.enqueue(cmd);
+    g_localRenderQueue.enqueue(cmd);
+    g_localRenderQueue.submit();
 
     // All the shaders are available at this point. We can precompile embedded PSOs then.
     if (g_shouldPrecompilePipelines)
@@ -3006,11 +3737,23 @@ void Video::Present()
         g_shouldPrecompilePipelines = false;
     }
 
-    g_executedCommandList.wait(false);
-    g_executedCommandList = false;
+    // The runtime pipeline cache doesn't depend on the embedded one being precompiled.
+    if (!g_loadedPipelineCache)
+    {
+        LoadPipelineCache();
+        g_loadedPipelineCache = true;
+    }
+
+    {
+        TraceScope waitScope("Wait For Render Thread");
+        g_executedCommandList.wait(false);
+        g_executedCommandList = false;
+    }
 
     if (g_swapChainValid)
     {
+        TraceScope presentScope("Swap Chain Present");
+
         if (g_pendingWaitOnSwapChain)
         {
             g_presentWaitProfiler.Begin();
@@ -3029,10 +3772,13 @@ void Video::Present()
 
     if (g_commandListStates[g_frame])
     {
+        TraceScope fenceScope("Frame Fence");
+
         g_frameFenceProfiler.Begin();
         g_queue->waitForCommandFence(g_commandFences[g_frame].get());
         g_frameFenceProfiler.End();
         g_commandListStates[g_frame] = false;
+        g_completedFrames = g_commandListFrames[g_frame];
 
         // Update the GPU profiler with the results from the timestamps of the frame.
         g_queryPools[g_frame]->queryResults();
@@ -3049,12 +3795,15 @@ void Video::Present()
     CheckSwapChain();
 
     cmd.type = RenderCommandType::BeginCommandList;
-    g_renderQueue.enqueue(cmd);
+    g_localRenderQueue.enqueue(cmd);
+    g_localRenderQueue.submit();
 
     if (Config::FPS >= FPS_MIN && Config::FPS < FPS_MAX)
     {
         using namespace std::chrono_literals;
 
+        TraceScope limiterScope("Frame Limiter");
+
         static std::chrono::steady_clock::time_point s_next;
 
         auto now = std::chrono::steady_clock::now();
@@ -3075,6 +3824,7 @@ void Video::Present()
     }
 
     g_presentProfiler.Reset();
+    Trace::BeginFrame();
 }
 
 void Video::StartPipelinePrecompilation()
@@ -3094,6 +3844,10 @@ static void SetRootDescriptor(const UploadAllocation& allocation, size_t index)
 
 static void ProcExecuteCommandList(const RenderCommand& cmd)
 {    
+    Trace::AddCounter("Main To Render Latency (us)", int64_t(Trace::GetTimestamp() - g_executeCommandListTimestamp) / 1000);
+
+    g_stagingAllocator.flush(g_commandLists[g_frame].get(), g_submittedFrames + 1);
+
     if (g_swapChainValid)
     {
         auto swapChainTexture = g_swapChain->getTexture(g_backBufferIndex);
@@ -3178,6 +3932,7 @@ static void ProcExecuteCommandList(const RenderCommand& cmd)
     }
 
     g_commandListStates[g_frame] = true;
+    g_commandListFrames[g_frame] = ++g_submittedFrames;
 
     g_executedCommandList = true;
     g_executedCommandList.notify_one();
@@ -3186,6 +3941,8 @@ static void ProcExecuteCommandList(const RenderCommand& cmd)
 static void ProcBeginCommandList(const RenderCommand& cmd)
 {
     DestructTempResources();
+    g_textureDescriptorSlab.reclaim(g_completedFrames);
+    ResetShaderConstantAllocations();
     BeginCommandList();
 }
 
@@ -3364,7 +4121,7 @@ static GuestTexture* CreateTexture(uint32_t width, uint32_t height, uint32_t dep
     texture->format = desc.format;
     texture->mipLevels = viewDesc.mipLevels;
     texture->viewDimension = viewDesc.dimension;
-    texture->descriptorIndex = g_textureDescriptorAllocator.allocate();
+    g_textureDescriptorSlab.allocate(texture);
 
     g_textureDescriptorSet->setTexture(texture->descriptorIndex, texture->texture, RenderTextureLayout::SHADER_READ, texture->textureView.get());
    
@@ -3459,7 +4216,7 @@ static GuestSurface* CreateSurface(uint32_t width, uint32_t height, uint32_t for
         viewDesc.format = desc.format;
         viewDesc.mipLevels = 1;
         surface->textureView = surface->textureHolder->createTextureView(viewDesc);
-        surface->descriptorIndex = g_textureDescriptorAllocator.allocate();
+        g_textureDescriptorSlab.allocate(surface);
         g_textureDescriptorSet->setTexture(surface->descriptorIndex, surface->textureHolder.get(), RenderTextureLayout::SHADER_READ, surface->textureView.get());
 
     #ifdef _DEBUG 
@@ -3512,7 +4269,8 @@ static void StretchRect(GuestDevice* device, uint32_t flags, uint32_t, GuestText
     cmd.stretchRect.flags = flags;
     cmd.stretchRect.texture = texture;
     cmd.stretchRect.destSliceOrFace = destSliceOrFace;
-    g_renderQueue.enqueue(cmd);
+    g_localRenderQueue.enqueue(cmd);
+    g_localRenderQueue.submit();
 }
 
 static void SetTextureInRenderThread(uint32_t index, GuestTexture* texture);
@@ -3569,7 +4327,7 @@ static void SetDefaultViewport(GuestDevice* device, GuestSurface* surface)
         cmd.setViewport.height = float(surface->height);
         cmd.setViewport.minDepth = 0.0f;
         cmd.setViewport.maxDepth = 1.0f;
-        g_renderQueue.enqueue(cmd);
+        g_localRenderQueue.enqueue(cmd);
 
         device->viewport.x = 0.0f;
         device->viewport.y = 0.0f;
@@ -3587,7 +4345,7 @@ static void SetRenderTarget(GuestDevice* device, uint32_t index, GuestSurface* r
         RenderCommand cmd;
         cmd.type = RenderCommandType::SetRenderTarget;
         cmd.setRenderTarget.renderTarget = renderTarget;
-        g_renderQueue.enqueue(cmd);
+        g_localRenderQueue.enqueue(cmd);
 
         SetDefaultViewport(device, renderTarget);
     }
@@ -3614,7 +4372,7 @@ static void SetDepthStencilSurface(GuestDevice* device, GuestSurface* depthStenc
     RenderCommand cmd;
     cmd.type = RenderCommandType::SetDepthStencilSurface;
     cmd.setDepthStencilSurface.depthStencil = depthStencil;
-    g_renderQueue.enqueue(cmd);
+    g_localRenderQueue.enqueue(cmd);
 
     SetDefaultViewport(device, depthStencil);
 }
@@ -3943,7 +4701,8 @@ static void Clear(GuestDevice* device, uint32_t flags, uint32_t, be<float>* colo
     cmd.clear.color[3] = color[3];
     cmd.clear.z = float(z);
     cmd.clear.stencil = stencil;
-    g_renderQueue.enqueue(cmd);
+    g_localRenderQueue.enqueue(cmd);
+    g_localRenderQueue.submit();
 }
 
 static void ProcClear(const RenderCommand& cmd)
@@ -4001,7 +4760,7 @@ static void SetViewport(GuestDevice* device, GuestViewport* viewport)
     cmd.setViewport.height = viewport->height;
     cmd.setViewport.minDepth = viewport->minZ;
     cmd.setViewport.maxDepth = viewport->maxZ;
-    g_renderQueue.enqueue(cmd);
+    g_localRenderQueue.enqueue(cmd);
 
     device->viewport.x = float(viewport->x);
     device->viewport.y = float(viewport->y);
@@ -4048,11 +4807,13 @@ static void SetTexture(GuestDevice* device, uint32_t index, GuestTexture* textur
     cmd.type = RenderCommandType::SetTexture;
     cmd.setTexture.index = index;
     cmd.setTexture.texture = texture;
-    g_renderQueue.enqueue(cmd);
+    g_localRenderQueue.enqueue(cmd);
 }
 
 static void SetTextureInRenderThread(uint32_t index, GuestTexture* texture)
 {
+    assert((texture == nullptr || g_textureDescriptorSlab.isValid(texture)) && "Texture has a stale descriptor index.");
+
     AddBarrier(texture, RenderTextureLayout::SHADER_READ);
 
     auto viewDimension = texture != nullptr ? texture->viewDimension : RenderTextureViewDimension::UNKNOWN;
@@ -4069,6 +4830,8 @@ static void SetTextureInRenderThread(uint32_t index, GuestTexture* texture)
 
 static void SetSurface(uint32_t index, GuestSurface* surface)
 {
+    assert(g_textureDescriptorSlab.isValid(surface) && "Surface has a stale descriptor index.");
+
     AddBarrier(surface, RenderTextureLayout::SHADER_READ);
 
     SetDirtyValue(g_dirtyStates.sharedConstants, g_sharedConstants.texture2DIndices[index], surface->descriptorIndex);
@@ -4112,7 +4875,7 @@ static void SetScissorRect(GuestDevice* device, GuestRect* rect)
     cmd.setScissorRect.left = rect->left;
     cmd.setScissorRect.bottom = rect->bottom;
     cmd.setScissorRect.right = rect->right;
-    g_renderQueue.enqueue(cmd);
+    g_localRenderQueue.enqueue(cmd);
 }
 
 static void ProcSetScissorRect(const RenderCommand& cmd)
@@ -4372,9 +5135,7 @@ static void SanitizePipelineState(PipelineState& pipelineState)
 
 static std::unique_ptr<RenderPipeline> CreateGraphicsPipeline(const PipelineState& pipelineState)
 {
-#ifdef ASYNC_PSO_DEBUG
     ++g_pipelinesCurrentlyCompiling;
-#endif
 
     RenderGraphicsPipelineDesc desc;
     desc.pipelineLayout = g_pipelineLayout.get();
@@ -4457,35 +5218,120 @@ static std::unique_ptr<RenderPipeline> CreateGraphicsPipeline(const PipelineStat
     
     auto pipeline = g_device->createGraphicsPipeline(desc);
 
-#ifdef ASYNC_PSO_DEBUG
     --g_pipelinesCurrentlyCompiling;
-#endif
 
     return pipeline;
 }
 
+// Strips the state that depends on config options, so cached states stay valid when they change.
+// ApplyPipelineStateConfig puts it back according to the current config when the cache gets loaded.
+static void MaskPipelineStateConfig(PipelineState& pipelineState)
+{
+    pipelineState.enableAlphaToCoverage = false;
+
+    pipelineState.specConstants &= ~SPEC_CONSTANT_BICUBIC_GI_FILTER;
+    if ((pipelineState.specConstants & SPEC_CONSTANT_ALPHA_TO_COVERAGE) != 0)
+    {
+        pipelineState.specConstants &= ~SPEC_CONSTANT_ALPHA_TO_COVERAGE;
+        pipelineState.specConstants |= SPEC_CONSTANT_ALPHA_TEST;
+    }
+}
+
+static void ApplyPipelineStateConfig(PipelineState& pipelineState)
+{
+    if (Config::CSMTextureFiltering == ECSMTextureFiltering::Bicubic)
+        pipelineState.specConstants |= SPEC_CONSTANT_BICUBIC_GI_FILTER;
+
+    // Matches SetAlphaTestMode.
+    if (Config::TransparencyAntiAliasing && pipelineState.sampleCount != RenderSampleCount::COUNT_1 &&
+        (pipelineState.specConstants & SPEC_CONSTANT_ALPHA_TEST) != 0)
+    {
+        pipelineState.enableAlphaToCoverage = true;
+        pipelineState.specConstants &= ~SPEC_CONSTANT_ALPHA_TEST;
+        pipelineState.specConstants |= SPEC_CONSTANT_ALPHA_TO_COVERAGE;
+    }
+}
+
+static void RecordPipelineState(PipelineState pipelineState)
+{
+    // Custom shaders are not in the shader cache, and can't be looked up by hash.
+    if (pipelineState.vertexShader->shaderCacheEntry == nullptr ||
+        (pipelineState.pixelShader != nullptr && pipelineState.pixelShader->shaderCacheEntry == nullptr))
+    {
+        return;
+    }
+
+    auto vertexDeclaration = pipelineState.vertexDeclaration;
+
+    pipelineState.vertexShader = reinterpret_cast<GuestShader*>(pipelineState.vertexShader->shaderCacheEntry->hash);
+
+    if (pipelineState.pixelShader != nullptr)
+        pipelineState.pixelShader = reinterpret_cast<GuestShader*>(pipelineState.pixelShader->shaderCacheEntry->hash);
+
+    pipelineState.vertexDeclaration = reinterpret_cast<GuestVertexDeclaration*>(vertexDeclaration->hash);
+
+    MaskPipelineStateConfig(pipelineState);
+
+    XXH64_hash_t hash = XXH3_64bits(&pipelineState, sizeof(pipelineState));
+
+    std::lock_guard lock(g_pipelineCacheMutex);
+
+    if (g_pipelineStatesToCache.emplace(hash, pipelineState).second)
+    {
+        g_vertexElementsToCache.try_emplace(vertexDeclaration->hash, vertexDeclaration->vertexElements.get(),
+            vertexDeclaration->vertexElements.get() + vertexDeclaration->vertexElementCount);
+
+        g_pipelineCacheDirty = true;
+    }
+}
+
+enum class PipelineEnqueueResult
+{
+    Queued,
+    AlreadyQueued,
+    Failed
+};
+
+static PipelineEnqueueResult EnqueueGraphicsPipelineCompilation(const PipelineState& pipelineState, const char* name, bool isPrecompiledPipeline = false);
+
+// Returns null if the pipeline is being compiled asynchronously, in which case the draw call should be skipped.
 static RenderPipeline* CreateGraphicsPipelineInRenderThread(PipelineState pipelineState)
 {
     SanitizePipelineState(pipelineState);
 
     XXH64_hash_t hash = XXH3_64bits(&pipelineState, sizeof(pipelineState));
+    auto findResult = g_pipelines.find(hash);
+    if (findResult != g_pipelines.end() && findResult->second != nullptr)
+        return findResult->second.get();
+
+    // Scene geometry can get skipped for a few frames while its pipeline compiles in the background.
+    // Passes without depth (UI, post processing, fullscreen copies) would visibly flicker instead, so
+    // they still get compiled here, and any copy that was already in flight will get dropped later.
+    // Pipelines that failed to compile in the background fall back to getting compiled here too.
+    if (pipelineState.depthStencilFormat != RenderFormat::UNKNOWN)
+    {
+        switch (EnqueueGraphicsPipelineCompilation(pipelineState, "Render Thread"))
+        {
+        case PipelineEnqueueResult::Queued:
+            RecordPipelineState(pipelineState);
+            return nullptr;
+        case PipelineEnqueueResult::AlreadyQueued:
+            return nullptr;
+        case PipelineEnqueueResult::Failed:
+            break;
+        }
+    }
+
     auto& pipeline = g_pipelines[hash];
     if (pipeline == nullptr)
     {
         pipeline = CreateGraphicsPipeline(pipelineState);
+        ++g_pipelinesCreatedInRenderThread;
 
 #ifdef ASYNC_PSO_DEBUG
-        bool loading = *SWA::SGlobals::ms_IsLoading;
-
-        if (loading)
-            ++g_pipelinesCreatedAsynchronously;
-        else
-            ++g_pipelinesCreatedInRenderThread;
-
-        pipeline->setName(fmt::format("{} {} {} {:X}", loading ? "ASYNC" : "",
+        pipeline->setName(fmt::format("{} {} {:X}",
             pipelineState.vertexShader->name, pipelineState.pixelShader != nullptr ? pipelineState.pixelShader->name : "<none>", hash));
         
-        if (!loading)
         {
             std::lock_guard lock(g_debugMutex);
             g_pipelineDebugText = fmt::format(
@@ -4551,10 +5397,7 @@ static RenderPipeline* CreateGraphicsPipelineInRenderThread(PipelineState pipeli
         }
 #endif
 
-#ifdef PSO_CACHING
-        std::lock_guard lock(g_pipelineCacheMutex);
-        g_pipelineStatesToCache.emplace(hash, pipelineState);
-#endif
+        RecordPipelineState(pipelineState);
     }
     
     return pipeline.get();
@@ -4609,23 +5452,6 @@ static RenderBorderColor ConvertBorderColor(uint32_t value)
     }
 }
 
-struct LocalRenderCommandQueue
-{
-    RenderCommand commands[20];
-    uint32_t count = 0;
-
-    RenderCommand& enqueue()
-    {
-        assert(count < std::size(commands));
-        return commands[count++];
-    }
-
-    void submit()
-    {
-        g_renderQueue.enqueue_bulk(commands, count);
-    }
-};
-
 static void FlushRenderStateForMainThread(GuestDevice* device, LocalRenderCommandQueue& queue)
 {
     constexpr size_t BOOL_MASK = 0x2ull;
@@ -4747,19 +5573,17 @@ static void ProcSetSamplerState(const RenderCommand& cmd)
 static void ProcSetVertexShaderConstants(const RenderCommand& cmd)
 {
     auto& args = cmd.setVertexShaderConstants;
-    assert((args.index * sizeof(uint32_t) + args.size) <= sizeof(g_vertexShaderConstants));
 
-    memcpy(&g_vertexShaderConstants[args.index], args.memory, args.size);
-    g_dirtyStates.vertexShaderConstants = true;
+    g_vertexShaderConstants.set(args.index, reinterpret_cast<const uint32_t*>(args.memory), args.size);
+    g_dirtyStates.vertexShaderConstants |= g_vertexShaderConstants.isDirty();
 }
 
 static void ProcSetPixelShaderConstants(const RenderCommand& cmd)
 {
     auto& args = cmd.setPixelShaderConstants;
-    assert((args.index * sizeof(uint32_t) + args.size) <= sizeof(g_pixelShaderConstants));
 
-    memcpy(&g_pixelShaderConstants[args.index], args.memory, args.size);
-    g_dirtyStates.pixelShaderConstants = true;
+    g_pixelShaderConstants.set(args.index, reinterpret_cast<const uint32_t*>(args.memory), args.size);
+    g_dirtyStates.pixelShaderConstants |= g_pixelShaderConstants.isDirty();
 }
 
 static void ProcAddPipeline(const RenderCommand& cmd)
@@ -4770,15 +5594,11 @@ static void ProcAddPipeline(const RenderCommand& cmd)
     if (pipeline == nullptr)
     {
         pipeline = std::unique_ptr<RenderPipeline>(args.pipeline);
-#ifdef ASYNC_PSO_DEBUG
         ++g_pipelinesCreatedAsynchronously;
-#endif
     }
     else
     {
-#ifdef ASYNC_PSO_DEBUG
         ++g_pipelinesDropped;
-#endif
         delete args.pipeline;
     }
 }
@@ -4786,8 +5606,11 @@ static void ProcAddPipeline(const RenderCommand& cmd)
 static constexpr int32_t COMMON_DEPTH_BIAS_VALUE = int32_t((1 << 24) * 0.002f);
 static constexpr float COMMON_SLOPE_SCALED_DEPTH_BIAS_VALUE = 1.0f;
 
-static void FlushRenderStateForRenderThread()
+// Returns false if the draw call should be skipped.
+static bool FlushRenderStateForRenderThread()
 {
+    g_stagingAllocator.flush(g_commandLists[g_frame].get(), g_submittedFrames + 1);
+
     auto renderTarget = g_pipelineState.colorWriteEnable ? g_renderTarget : nullptr;
     auto depthStencil = g_pipelineState.zEnable || g_pipelineState.stencilEnable ? g_depthStencil : nullptr;
 
@@ -4837,9 +5660,14 @@ static void FlushRenderStateForRenderThread()
         SetDirtyValue(g_dirtyStates.pipelineState, g_pipelineState.slopeScaledDepthBias, slopeScaledDepthBias);
     }
 
+    RenderPipeline* pipeline = nullptr;
+
     if (g_dirtyStates.pipelineState)
     {
-        commandList->setPipeline(CreateGraphicsPipelineInRenderThread(g_pipelineState));
+        pipeline = CreateGraphicsPipelineInRenderThread(g_pipelineState);
+
+        if (pipeline != nullptr)
+            commandList->setPipeline(pipeline);
 
         // D3D12 resets the depth bias values. Check if they need to be set again.
         if (g_capabilities.dynamicDepthBias && g_backend == Backend::D3D12)
@@ -4850,16 +5678,10 @@ static void FlushRenderStateForRenderThread()
         commandList->setDepthBias(g_depthBias, 0.0f, g_slopeScaledDepthBias);
 
     if (g_dirtyStates.vertexShaderConstants)
-    {
-        auto vertexShaderConstants = g_uploadAllocators[g_frame].allocate<true>(g_vertexShaderConstants, sizeof(g_vertexShaderConstants), 0x100);
-        SetRootDescriptor(vertexShaderConstants, 0);
-    }
+        SetRootDescriptor(UploadShaderConstants(g_vertexShaderConstants), 0);
 
     if (g_dirtyStates.pixelShaderConstants)
-    {
-        auto pixelShaderConstants = g_uploadAllocators[g_frame].allocate<true>(g_pixelShaderConstants, sizeof(g_pixelShaderConstants), 0x100);
-        SetRootDescriptor(pixelShaderConstants, 1);
-    }
+        SetRootDescriptor(UploadShaderConstants(g_pixelShaderConstants), 1);
 
     if (g_dirtyStates.sharedConstants)
     {
@@ -4879,7 +5701,15 @@ static void FlushRenderStateForRenderThread()
     if (g_dirtyStates.indices && (g_backend == Backend::D3D12 || g_indexBufferView.buffer.ref != nullptr))
         commandList->setIndexBuffer(&g_indexBufferView);
 
+    bool pipelineReady = !g_dirtyStates.pipelineState || pipeline != nullptr;
+
     g_dirtyStates = DirtyStates(false);
+
+    // Keep checking for the pipeline in subsequent draw calls until it finishes compiling.
+    if (!pipelineReady)
+        g_dirtyStates.pipelineState = true;
+
+    return pipelineReady;
 }
 
 static RenderPrimitiveTopology ConvertPrimitiveType(uint32_t primitiveType)
@@ -4942,7 +5772,7 @@ static void UnsetInstancingStream()
 
 static void DrawPrimitive(GuestDevice* device, uint32_t primitiveType, uint32_t startVertex, uint32_t primitiveCount) 
 {
-    LocalRenderCommandQueue queue;
+    auto& queue = g_localRenderQueue;
     FlushRenderStateForMainThread(device, queue);
 
     auto& cmd = queue.enqueue();
@@ -4972,7 +5802,8 @@ static void ProcDrawPrimitive(const RenderCommand& cmd)
         UnsetInstancingStream();
     }
 
-    FlushRenderStateForRenderThread();
+    if (!FlushRenderStateForRenderThread())
+        return;
 
     auto& commandList = g_commandLists[g_frame];
 
@@ -4984,7 +5815,7 @@ static void ProcDrawPrimitive(const RenderCommand& cmd)
 
 static void DrawIndexedPrimitive(GuestDevice* device, uint32_t primitiveType, int32_t baseVertexIndex, uint32_t startIndex, uint32_t primCount)
 {
-    LocalRenderCommandQueue queue;
+    auto& queue = g_localRenderQueue;
     FlushRenderStateForMainThread(device, queue);
 
     auto& cmd = queue.enqueue();
@@ -5006,14 +5837,16 @@ static void ProcDrawIndexedPrimitive(const RenderCommand& cmd)
         UnsetInstancingStream();
 
     SetPrimitiveType(args.primitiveType);
-    FlushRenderStateForRenderThread();
+
+    if (!FlushRenderStateForRenderThread())
+        return;
 
     g_commandLists[g_frame]->drawIndexedInstanced(args.primCount, 1, args.startIndex, args.baseVertexIndex, 0);
 }
 
 static void DrawPrimitiveUP(GuestDevice* device, uint32_t primitiveType, uint32_t primitiveCount, void* vertexStreamZeroData, uint32_t vertexStreamZeroStride)
 {
-    LocalRenderCommandQueue queue;
+    auto& queue = g_localRenderQueue;
     FlushRenderStateForMainThread(device, queue);
 
     auto& cmd = queue.enqueue();
@@ -5061,7 +5894,8 @@ static void ProcDrawPrimitiveUP(const RenderCommand& cmd)
             args.csdFilterState == CsdFilterState::On ? g_csdFilterShader.get() : g_csdShader);
     }
 
-    FlushRenderStateForRenderThread();
+    if (!FlushRenderStateForRenderThread())
+        return;
 
     if (indexCount != 0)
         g_commandLists[g_frame]->drawIndexedInstanced(indexCount, 1, 0, 0, 0);
@@ -5398,7 +6232,7 @@ static void SetVertexDeclaration(GuestDevice* device, GuestVertexDeclaration* ve
     RenderCommand cmd;
     cmd.type = RenderCommandType::SetVertexDeclaration;
     cmd.setVertexDeclaration.vertexDeclaration = vertexDeclaration;
-    g_renderQueue.enqueue(cmd);
+    g_localRenderQueue.enqueue(cmd);
 
     device->vertexDeclaration = g_memory.MapVirtual(vertexDeclaration);
 }
@@ -5465,6 +6299,8 @@ static GuestShader* CreateShader(const be<uint32_t>* function, ResourceType reso
                 shader->shaderCacheEntry = findResult;
 
             findResult->guestShader = shader;
+
+            CompileCachedPipelineStates(hash);
         }
         else
         {
@@ -5493,7 +6329,7 @@ static void SetVertexShader(GuestDevice* device, GuestShader* shader)
     RenderCommand cmd;
     cmd.type = RenderCommandType::SetVertexShader;
     cmd.setVertexShader.shader = shader;
-    g_renderQueue.enqueue(cmd);
+    g_localRenderQueue.enqueue(cmd);
 }
 
 static void ProcSetVertexShader(const RenderCommand& cmd)
@@ -5509,7 +6345,7 @@ static void SetStreamSource(GuestDevice* device, uint32_t index, GuestBuffer* bu
     cmd.setStreamSource.buffer = buffer;
     cmd.setStreamSource.offset = offset;
     cmd.setStreamSource.stride = stride;
-    g_renderQueue.enqueue(cmd);
+    g_localRenderQueue.enqueue(cmd);
 }
 
 static void ProcSetStreamSource(const RenderCommand& cmd)
@@ -5536,7 +6372,7 @@ static void SetIndices(GuestDevice* device, GuestBuffer* buffer)
     RenderCommand cmd;
     cmd.type = RenderCommandType::SetIndices;
     cmd.setIndices.buffer = buffer;
-    g_renderQueue.enqueue(cmd);
+    g_localRenderQueue.enqueue(cmd);
 }
 
 static void ProcSetIndices(const RenderCommand& cmd)
@@ -5558,7 +6394,7 @@ static void SetPixelShader(GuestDevice* device, GuestShader* shader)
     RenderCommand cmd;
     cmd.type = RenderCommandType::SetPixelShader;
     cmd.setPixelShader.shader = shader;
-    g_renderQueue.enqueue(cmd);
+    g_localRenderQueue.enqueue(cmd);
 }
 
 static void ProcSetPixelShader(const RenderCommand& cmd)
@@ -5573,6 +6409,7 @@ static std::thread g_renderThread([]
         SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_ABOVE_NORMAL);
         GuestThread::SetThreadName(GetCurrentThreadId(), "Render Thread");
 #endif
+        Trace::SetThreadName("Render Thread");
 
         RenderCommand commands[32];
 
@@ -5580,9 +6417,14 @@ static std::thread g_renderThread([]
         {
             size_t count = g_renderQueue.wait_dequeue_bulk(commands, std::size(commands));
 
+            Trace::AddCounter("Render Queue Depth", int64_t(count + g_renderQueue.size_approx()));
+
             for (size_t i = 0; i < count; i++)
             {
                 auto& cmd = commands[i];
+
+                TraceScope traceScope(magic_enum::enum_name(cmd.type).data());
+
                 switch (cmd.type)
                 {
                 case RenderCommandType::SetRenderState:                    ProcSetRenderState(cmd); break;
@@ -5624,20 +6466,10 @@ static void D3DXFillTexture(GuestTexture* texture, uint32_t function, void* data
 {
     if (texture->width == 1 && texture->height == 1 && texture->format == RenderFormat::R8_UNORM && function == 0x82BA2150)
     {
-        auto uploadBuffer = g_device->createBuffer(RenderBufferDesc::UploadBuffer(PLACEMENT_ALIGNMENT));
+        auto allocation = g_stagingAllocator.allocate(PLACEMENT_ALIGNMENT, PLACEMENT_ALIGNMENT);
+        *allocation.memory = 0xFF;
 
-        uint8_t* mappedData = reinterpret_cast<uint8_t*>(uploadBuffer->map());
-        *mappedData = 0xFF;
-        uploadBuffer->unmap();
-
-        ExecuteCopyCommandList([&]
-            {
-                g_copyCommandList->barriers(RenderBarrierStage::COPY, RenderTextureBarrier(texture->texture, RenderTextureLayout::COPY_DEST));
-
-                g_copyCommandList->copyTextureRegion(
-                    RenderTextureCopyLocation::Subresource(texture->texture, 0),
-                    RenderTextureCopyLocation::PlacedFootprint(uploadBuffer.get(), texture->format, 1, 1, 1, PLACEMENT_ALIGNMENT, 0));
-            });
+        g_stagingAllocator.copyTexture(texture->texture, 0, 0, allocation, 0, texture->format, 1, 1, 1, PLACEMENT_ALIGNMENT);
 
         texture->layout = RenderTextureLayout::COPY_DEST;
     }
@@ -5651,8 +6483,8 @@ static void D3DXFillVolumeTexture(GuestTexture* texture, uint32_t function, void
     uint32_t rowPitch1 = ((texture->width / 2) * 4 + PITCH_ALIGNMENT - 1) & ~(PITCH_ALIGNMENT - 1);
     uint32_t slicePitch1 = (rowPitch1 * (texture->height / 2) * (texture->depth / 2) + PLACEMENT_ALIGNMENT - 1) & ~(PLACEMENT_ALIGNMENT - 1);
 
-    auto uploadBuffer = g_device->createBuffer(RenderBufferDesc::UploadBuffer(slicePitch0 + slicePitch1));
-    uint8_t* mappedData = reinterpret_cast<uint8_t*>(uploadBuffer->map());
+    auto allocation = g_stagingAllocator.allocate(slicePitch0 + slicePitch1, PLACEMENT_ALIGNMENT);
+    uint8_t* mappedData = allocation.memory;
 
     thread_local std::vector<float> mipData;
     mipData.resize((texture->width / 2) * (texture->height / 2) * (texture->depth / 2) * 4);
@@ -5722,20 +6554,11 @@ static void D3DXFillVolumeTexture(GuestTexture* texture, uint32_t function, void
         }
     }
 
-    uploadBuffer->unmap();
-
-    ExecuteCopyCommandList([&]
-        {
-            g_copyCommandList->barriers(RenderBarrierStage::COPY, RenderTextureBarrier(texture->texture, RenderTextureLayout::COPY_DEST));
-
-            g_copyCommandList->copyTextureRegion(
-                RenderTextureCopyLocation::Subresource(texture->texture, 0),
-                RenderTextureCopyLocation::PlacedFootprint(uploadBuffer.get(), texture->format, texture->width, texture->height, texture->depth, rowPitch0 / RenderFormatSize(texture->format), 0));
+    g_stagingAllocator.copyTexture(texture->texture, 0, 0, allocation, 0, texture->format,
+        texture->width, texture->height, texture->depth, rowPitch0 / RenderFormatSize(texture->format));
 
-            g_copyCommandList->copyTextureRegion(
-                RenderTextureCopyLocation::Subresource(texture->texture, 1),
-                RenderTextureCopyLocation::PlacedFootprint(uploadBuffer.get(), texture->format, texture->width / 2, texture->height / 2, texture->depth / 2, rowPitch1 / RenderFormatSize(texture->format), slicePitch0));
-        });
+    g_stagingAllocator.copyTexture(texture->texture, 1, 0, allocation, slicePitch0, texture->format,
+        texture->width / 2, texture->height / 2, texture->depth / 2, rowPitch1 / RenderFormatSize(texture->format));
 
     texture->layout = RenderTextureLayout::COPY_DEST;
 }
@@ -6017,7 +6840,7 @@ static bool LoadTexture(GuestTexture& texture, const uint8_t* data, size_t dataS
 
         viewDesc.componentMapping = componentMapping;
         texture.textureView = texture.texture->createTextureView(viewDesc);
-        texture.descriptorIndex = g_textureDescriptorAllocator.allocate();
+        g_textureDescriptorSlab.allocate(&texture);
         g_textureDescriptorSet->setTexture(texture.descriptorIndex, texture.texture, RenderTextureLayout::SHADER_READ, texture.textureView.get());
 
         texture.width = ddsDesc.width;
@@ -6062,8 +6885,8 @@ static bool LoadTexture(GuestTexture& texture, const uint8_t* data, size_t dataS
             }
         }
 
-        auto uploadBuffer = g_device->createBuffer(RenderBufferDesc::UploadBuffer(curDstOffset));
-        uint8_t* mappedMemory = reinterpret_cast<uint8_t*>(uploadBuffer->map());
+        auto allocation = g_stagingAllocator.allocate(curDstOffset, PLACEMENT_ALIGNMENT);
+        uint8_t* mappedMemory = allocation.memory;
 
         for (auto& slice : slices)
         {
@@ -6085,21 +6908,13 @@ static bool LoadTexture(GuestTexture& texture, const uint8_t* data, size_t dataS
             }
         }
 
-        uploadBuffer->unmap();
-
-        ExecuteCopyCommandList([&]
-            {
-                g_copyCommandList->barriers(RenderBarrierStage::COPY, RenderTextureBarrier(texture.texture, RenderTextureLayout::COPY_DEST));
-
-                for (size_t i = 0; i < slices.size(); i++)
-                {
-                    auto& slice = slices[i];
+        for (size_t i = 0; i < slices.size(); i++)
+        {
+            auto& slice = slices[i];
 
-                    g_copyCommandList->copyTextureRegion(
-                        RenderTextureCopyLocation::Subresource(texture.texture, i % desc.mipLevels, i / desc.mipLevels),
-                        RenderTextureCopyLocation::PlacedFootprint(uploadBuffer.get(), desc.format, slice.width, slice.height, slice.depth, (slice.dstRowPitch * 8) / ddsDesc.bitsPerPixelOrBlock * ddsDesc.blockWidth, slice.dstOffset));
-                }
-            });
+            g_stagingAllocator.copyTexture(texture.texture, i % desc.mipLevels, i / desc.mipLevels, allocation, slice.dstOffset, desc.format,
+                slice.width, slice.height, slice.depth, (slice.dstRowPitch * 8) / ddsDesc.bitsPerPixelOrBlock * ddsDesc.blockWidth);
+        }
 
         return true;
     }
@@ -6115,14 +6930,14 @@ static bool LoadTexture(GuestTexture& texture, const uint8_t* data, size_t dataS
             texture.viewDimension = RenderTextureViewDimension::TEXTURE_2D;
             texture.layout = RenderTextureLayout::COPY_DEST;
 
-            texture.descriptorIndex = g_textureDescriptorAllocator.allocate();
+            g_textureDescriptorSlab.allocate(&texture);
             g_textureDescriptorSet->setTexture(texture.descriptorIndex, texture.texture, RenderTextureLayout::SHADER_READ);
 
             uint32_t rowPitch = (width * 4 + PITCH_ALIGNMENT - 1) & ~(PITCH_ALIGNMENT - 1);
             uint32_t slicePitch = rowPitch * height;
 
-            auto uploadBuffer = g_device->createBuffer(RenderBufferDesc::UploadBuffer(slicePitch));
-            uint8_t* mappedMemory = reinterpret_cast<uint8_t*>(uploadBuffer->map());
+            auto allocation = g_stagingAllocator.allocate(slicePitch, PLACEMENT_ALIGNMENT);
+            uint8_t* mappedMemory = allocation.memory;
 
             if (rowPitch == (width * 4))
             {
@@ -6140,18 +6955,9 @@ static bool LoadTexture(GuestTexture& texture, const uint8_t* data, size_t dataS
                 }
             }
 
-            uploadBuffer->unmap();
-
             stbi_image_free(stbImage);
 
-            ExecuteCopyCommandList([&]
-                {
-                    g_copyCommandList->barriers(RenderBarrierStage::COPY, RenderTextureBarrier(texture.texture, RenderTextureLayout::COPY_DEST));
-
-                    g_copyCommandList->copyTextureRegion(
-                        RenderTextureCopyLocation::Subresource(texture.texture, 0),
-                        RenderTextureCopyLocation::PlacedFootprint(uploadBuffer.get(), RenderFormat::R8G8B8A8_UNORM, width, height, 1, rowPitch / 4, 0));
-                });
+            g_stagingAllocator.copyTexture(texture.texture, 0, 0, allocation, 0, RenderFormat::R8G8B8A8_UNORM, width, height, 1, rowPitch / 4);
 
             return true;
         }
@@ -6589,17 +7395,34 @@ enum
 //    }
 //};
 
-//struct PipelineStateQueueItem
-//{
-//    XXH64_hash_t pipelineHash;
-//    PipelineState pipelineState;
-//    std::shared_ptr<PipelineTaskToken> token;
-//#ifdef ASYNC_PSO_DEBUG
-//    std::string pipelineName;
-//#endif
-//};
+struct PipelineStateQueueItem
+{
+    XXH64_hash_t pipelineHash;
+    PipelineState pipelineState;
+#ifdef ASYNC_PSO_DEBUG
+    std::string pipelineName;
+#endif
+};
+
+// Pipelines the render thread is waiting on take priority over the ones that are
+// precompiled in advance. The semaphore gets signaled for every item added to either queue.
+static moodycamel::ConcurrentQueue<PipelineStateQueueItem> g_pipelineStateQueue;
+static moodycamel::ConcurrentQueue<PipelineStateQueueItem> g_priorityPipelineStateQueue;
+static moodycamel::LightweightSemaphore g_pipelineStateQueueSemaphore;
+
+enum class AsyncPipelineStatus
+{
+    Queued,
+    PriorityQueued,
+    // Stays set after the compilation finishes, g_pipelines takes over from there.
+    Compiling,
+    Failed
+};
 
-//static moodycamel::BlockingConcurrentQueue<PipelineStateQueueItem> g_pipelineStateQueue;
+// Having this separate, because I don't want to lock a mutex in the render thread before
+// every single draw. It only gets checked when a pipeline is missing from g_pipelines.
+static xxHashMap<AsyncPipelineStatus> g_asyncPipelineStates;
+static Mutex g_asyncPipelineMutex;
 
 static void CompilePipeline(XXH64_hash_t pipelineHash, const PipelineState& pipelineState
 #ifdef ASYNC_PSO_DEBUG
@@ -6608,6 +7431,16 @@ static void CompilePipeline(XXH64_hash_t pipelineHash, const PipelineState& pipe
 )
 {
     auto pipeline = CreateGraphicsPipeline(pipelineState);
+    if (pipeline == nullptr)
+    {
+        LOGFN_ERROR("Failed to compile pipeline {:X}.", pipelineHash);
+
+        // Lets the render thread fall back to compiling it on its own.
+        std::lock_guard lock(g_asyncPipelineMutex);
+        g_asyncPipelineStates[pipelineHash] = AsyncPipelineStatus::Failed;
+        return;
+    }
+
 #ifdef ASYNC_PSO_DEBUG
     pipeline->setName(pipelineName);
 #endif
@@ -6617,7 +7450,8 @@ static void CompilePipeline(XXH64_hash_t pipelineHash, const PipelineState& pipe
     cmd.type = RenderCommandType::AddPipeline;
     cmd.addPipeline.hash = pipelineHash;
     cmd.addPipeline.pipeline = pipeline.release();
-    g_renderQueue.enqueue(cmd);
+    g_localRenderQueue.enqueue(cmd);
+    g_localRenderQueue.submit();
 }
 
 static void PipelineCompilerThread()
@@ -6630,38 +7464,55 @@ static void PipelineCompilerThread()
 
     std::unique_ptr<GuestThreadContext> ctx;
 
-//    while (true)
-//    {
-//        PipelineStateQueueItem queueItem;
-//        g_pipelineStateQueue.wait_dequeue(queueItem);
-//
-//        if (ctx == nullptr)
-//            ctx = std::make_unique<GuestThreadContext>(0);
-//
-//#ifdef _WIN32
-//        int newThreadPriority = threadPriority;
-//
-//        bool loading = *SWA::SGlobals::ms_IsLoading;
-//        if (loading)
-//            newThreadPriority = THREAD_PRIORITY_HIGHEST;
-//        else
-//            newThreadPriority = THREAD_PRIORITY_LOWEST;
-//
-//        if (newThreadPriority != threadPriority)
-//        {
-//            SetThreadPriority(GetCurrentThread(), newThreadPriority);
-//            threadPriority = newThreadPriority;
-//        }
-//#endif
-//
-//        CompilePipeline(queueItem.pipelineHash, queueItem.pipelineState
-//#ifdef ASYNC_PSO_DEBUG
-//            , queueItem.pipelineName.c_str()
-//#endif
-//        );
-//
-//        std::this_thread::yield();
-//    }
+    while (true)
+    {
+        PipelineStateQueueItem queueItem;
+        if (!g_priorityPipelineStateQueue.try_dequeue(queueItem) && !g_pipelineStateQueue.try_dequeue(queueItem))
+        {
+            g_pipelineStateQueueSemaphore.wait();
+            continue;
+        }
+
+        {
+            // A state that got moved to the priority queue leaves a copy behind in the other one.
+            // Whichever copy gets dequeued second has nothing left to do.
+            std::lock_guard lock(g_asyncPipelineMutex);
+            auto& status = g_asyncPipelineStates[queueItem.pipelineHash];
+            if (status != AsyncPipelineStatus::Queued && status != AsyncPipelineStatus::PriorityQueued)
+                continue;
+
+            status = AsyncPipelineStatus::Compiling;
+        }
+
+        if (ctx == nullptr)
+            ctx = std::make_unique<GuestThreadContext>(0);
+
+#ifdef _WIN32
+        int newThreadPriority = threadPriority;
+
+        // Loading screens can afford to take CPU time away from the game, and
+        // so can draw calls that are getting skipped until their pipeline is ready.
+        bool boost = App::s_isLoading || g_priorityPipelineStateQueue.size_approx() != 0;
+        if (boost)
+            newThreadPriority = THREAD_PRIORITY_HIGHEST;
+        else
+            newThreadPriority = THREAD_PRIORITY_LOWEST;
+
+        if (newThreadPriority != threadPriority)
+        {
+            SetThreadPriority(GetCurrentThread(), newThreadPriority);
+            threadPriority = newThreadPriority;
+        }
+#endif
+
+        CompilePipeline(queueItem.pipelineHash, queueItem.pipelineState
+#ifdef ASYNC_PSO_DEBUG
+            , queueItem.pipelineName
+#endif
+        );
+
+        std::this_thread::yield();
+    }
 }
 
 static std::vector<std::unique_ptr<std::thread>> g_pipelineCompilerThreads = []()
@@ -6675,6 +7526,274 @@ static std::vector<std::unique_ptr<std::thread>> g_pipelineCompilerThreads = [](
         return threads;
     }();
 
+struct PipelineCacheHeader
+{
+    char signature[4] PIPELINE_CACHE_SIGNATURE;
+    uint32_t version = PIPELINE_CACHE_VERSION;
+    uint32_t pipelineStateSize = sizeof(PipelineState);
+    uint32_t vertexDeclarationCount{};
+    uint32_t pipelineStateCount{};
+    uint32_t reserved{};
+    XXH64_hash_t checksum{};
+};
+
+static std::filesystem::path GetPipelineCachePath()
+{
+    return GetUserPath() / PIPELINE_CACHE_FILENAME;
+}
+
+// Replaces the hashes of a cached state with the objects they refer to. If a guest shader
+// hasn't been created yet, its hash gets returned through missingShaderHash.
+static bool ResolvePipelineState(PipelineState& pipelineState, XXH64_hash_t& missingShaderHash)
+{
+    // The hashes were reinterpret casted to pointers in the cache.
+    XXH64_hash_t vertexShaderHash = reinterpret_cast<XXH64_hash_t>(pipelineState.vertexShader);
+    XXH64_hash_t pixelShaderHash = reinterpret_cast<XXH64_hash_t>(pipelineState.pixelShader);
+
+    auto vertexShaderEntry = FindShaderCacheEntry(vertexShaderHash);
+    if (vertexShaderEntry == nullptr)
+        return false;
+
+    if (vertexShaderEntry->guestShader == nullptr)
+    {
+        missingShaderHash = vertexShaderHash;
+        return false;
+    }
+
+    ShaderCacheEntry* pixelShaderEntry = nullptr;
+    if (pipelineState.pixelShader != nullptr)
+    {
+        pixelShaderEntry = FindShaderCacheEntry(pixelShaderHash);
+        if (pixelShaderEntry == nullptr)
+            return false;
+
+        if (pixelShaderEntry->guestShader == nullptr)
+        {
+            missingShaderHash = pixelShaderHash;
+            return false;
+        }
+    }
+
+    GuestVertexDeclaration* vertexDeclaration;
+    {
+        std::lock_guard lock(g_vertexDeclarationMutex);
+        auto findResult = g_vertexDeclarations.find(reinterpret_cast<XXH64_hash_t>(pipelineState.vertexDeclaration));
+        if (findResult == g_vertexDeclarations.end())
+            return false;
+
+        vertexDeclaration = findResult->second;
+    }
+
+    pipelineState.vertexShader = vertexShaderEntry->guestShader;
+    pipelineState.pixelShader = pixelShaderEntry != nullptr ? pixelShaderEntry->guestShader : nullptr;
+    pipelineState.vertexDeclaration = vertexDeclaration;
+
+    return true;
+}
+
+// Called with the pending cached pipeline mutex held. Either hands the state off to the compiler
+// threads, or parks it until the guest shader it's still missing gets created. States that can
+// never be resolved (unknown shaders or vertex declarations) are dropped.
+static void CompileOrDeferCachedPipelineState(const PipelineState& pipelineState)
+{
+    PipelineState resolvedState = pipelineState;
+    XXH64_hash_t missingShaderHash = 0;
+
+    if (ResolvePipelineState(resolvedState, missingShaderHash))
+    {
+        ApplyPipelineStateConfig(resolvedState);
+        SanitizePipelineState(resolvedState);
+        EnqueueGraphicsPipelineCompilation(resolvedState, "Cached Pipeline", true);
+    }
+    else if (missingShaderHash != 0)
+    {
+        g_pendingCachedPipelineStates[missingShaderHash].push_back(pipelineState);
+    }
+}
+
+static void CompileCachedPipelineStates(XXH64_hash_t shaderHash)
+{
+    std::lock_guard lock(g_pendingCachedPipelineMutex);
+
+    auto findResult = g_pendingCachedPipelineStates.find(shaderHash);
+    if (findResult == g_pendingCachedPipelineStates.end())
+        return;
+
+    auto pipelineStates = std::move(findResult->second);
+    g_pendingCachedPipelineStates.erase(findResult);
+
+    for (auto& pipelineState : pipelineStates)
+        CompileOrDeferCachedPipelineState(pipelineState);
+}
+
+static void LoadPipelineCache()
+{
+    auto cachePath = GetPipelineCachePath();
+
+    std::error_code ec;
+    if (!std::filesystem::exists(cachePath, ec))
+        return;
+
+    std::ifstream file(cachePath, std::ios::binary);
+    if (!file)
+    {
+        LOGN_WARNING("Failed to open pipeline cache.");
+        return;
+    }
+
+    PipelineCacheHeader header{};
+    file.read(reinterpret_cast<char*>(&header), sizeof(header));
+
+    constexpr PipelineCacheHeader expectedHeader{};
+
+    if (!file ||
+        memcmp(header.signature, expectedHeader.signature, sizeof(header.signature)) != 0 ||
+        header.version != expectedHeader.version ||
+        header.pipelineStateSize != expectedHeader.pipelineStateSize)
+    {
+        LOGN_WARNING("Pipeline cache is outdated or invalid, discarding.");
+        return;
+    }
+
+    uint64_t fileSize = std::filesystem::file_size(cachePath, ec);
+    if (ec || fileSize < sizeof(header))
+    {
+        LOGN_WARNING("Pipeline cache is truncated, discarding.");
+        return;
+    }
+
+    std::vector<uint8_t> data(fileSize - sizeof(header));
+    file.read(reinterpret_cast<char*>(data.data()), data.size());
+
+    if (!file || XXH3_64bits(data.data(), data.size()) != header.checksum)
+    {
+        LOGN_WARNING("Pipeline cache checksum mismatch, discarding.");
+        return;
+    }
+
+    size_t offset = 0;
+
+    auto read = [&](void* dest, size_t size)
+        {
+            if (offset + size > data.size())
+                return false;
+
+            memcpy(dest, data.data() + offset, size);
+            offset += size;
+            return true;
+        };
+
+    std::vector<PipelineState> pipelineStates;
+    pipelineStates.reserve(header.pipelineStateCount);
+
+    {
+        std::lock_guard lock(g_pipelineCacheMutex);
+
+        for (uint32_t i = 0; i < header.vertexDeclarationCount; i++)
+        {
+            XXH64_hash_t hash;
+            uint32_t vertexElementCount;
+
+            if (!read(&hash, sizeof(hash)) || !read(&vertexElementCount, sizeof(vertexElementCount)))
+                return;
+
+            std::vector<GuestVertexElement> vertexElements(vertexElementCount);
+            if (vertexElementCount == 0 || !read(vertexElements.data(), vertexElementCount * sizeof(GuestVertexElement)))
+                return;
+
+            CreateVertexDeclarationWithoutAddRef(vertexElements.data());
+            g_vertexElementsToCache.try_emplace(hash, std::move(vertexElements));
+        }
+
+        for (uint32_t i = 0; i < header.pipelineStateCount; i++)
+        {
+            XXH64_hash_t hash;
+            PipelineState pipelineState;
+
+            if (!read(&hash, sizeof(hash)) || !read(&pipelineState, sizeof(pipelineState)))
+                return;
+
+            if (g_pipelineStatesToCache.emplace(hash, pipelineState).second)
+                pipelineStates.push_back(pipelineState);
+        }
+    }
+
+    LOGFN("Loaded {} pipeline states from pipeline cache.", pipelineStates.size());
+
+    // Guest shaders only get created once the game loads them, so states that can't be resolved yet
+    // get compiled by CreateShader as soon as the last shader they're missing becomes available.
+    std::lock_guard lock(g_pendingCachedPipelineMutex);
+
+    for (auto& pipelineState : pipelineStates)
+        CompileOrDeferCachedPipelineState(pipelineState);
+}
+
+void Video::SavePipelineCache()
+{
+    std::lock_guard lock(g_pipelineCacheMutex);
+
+    if (!g_pipelineCacheDirty)
+        return;
+
+    PipelineCacheHeader header{};
+    header.vertexDeclarationCount = uint32_t(g_vertexElementsToCache.size());
+    header.pipelineStateCount = uint32_t(g_pipelineStatesToCache.size());
+
+    std::vector<uint8_t> data;
+
+    auto write = [&](const void* src, size_t size)
+        {
+            auto bytes = reinterpret_cast<const uint8_t*>(src);
+            data.insert(data.end(), bytes, bytes + size);
+        };
+
+    for (auto& [hash, vertexElements] : g_vertexElementsToCache)
+    {
+        uint32_t vertexElementCount = uint32_t(vertexElements.size());
+
+        write(&hash, sizeof(hash));
+        write(&vertexElementCount, sizeof(vertexElementCount));
+        write(vertexElements.data(), vertexElementCount * sizeof(GuestVertexElement));
+    }
+
+    for (auto& [hash, pipelineState] : g_pipelineStatesToCache)
+    {
+        write(&hash, sizeof(hash));
+        write(&pipelineState, sizeof(pipelineState));
+    }
+
+    header.checksum = XXH3_64bits(data.data(), data.size());
+
+    // Write to a temporary file first to not leave a corrupted cache behind.
+    auto cachePath = GetPipelineCachePath();
+    auto tempPath = cachePath;
+    tempPath += ".tmp";
+
+    {
+        std::ofstream file(tempPath, std::ios::binary);
+
+        if (!file)
+        {
+            LOGN_ERROR("Failed to write pipeline cache.");
+            return;
+        }
+
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char*>(data.data()), data.size());
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(tempPath, cachePath, ec);
+
+    if (ec)
+    {
+        LOGFN_ERROR("Failed to write pipeline cache: {}", ec.message());
+        return;
+    }
+
+    g_pipelineCacheDirty = false;
+}
+
 static constexpr uint32_t MODEL_DATA_VFTABLE = 0x82073A44;
 static constexpr uint32_t TERRAIN_MODEL_DATA_VFTABLE = 0x8211D25C;
 static constexpr uint32_t PARTICLE_MATERIAL_VFTABLE = 0x8211F198;
@@ -6687,63 +7806,45 @@ struct PipelineTaskTokenPair
 //    std::shared_ptr<PipelineTaskToken> sharedToken;
 };
 
-// Having this separate, because I don't want to lock a mutex in the render thread before
-// every single draw. Might be worth profiling to see if it actually has an impact and merge them.
-static xxHashMap<PipelineState> g_asyncPipelineStates;
-
-//static void EnqueueGraphicsPipelineCompilation(
-//    const PipelineState& pipelineState,
-//    PipelineTaskTokenPair& tokenPair,
-//    const char* name,
-//    bool isPrecompiledPipeline = false)
-//{
-//    XXH64_hash_t hash = XXH3_64bits(&pipelineState, sizeof(pipelineState));
-//    bool shouldCompile = g_asyncPipelineStates.emplace(hash, pipelineState).second;
-//
-//    if (shouldCompile)
-//    {
-//        bool loading = *SWA::SGlobals::ms_IsLoading;
-//        if (!loading && isPrecompiledPipeline)
-//        {
-//            // We can just compile here during the logos.
-//            CompilePipeline(hash, pipelineState
-//#ifdef ASYNC_PSO_DEBUG
-//                , fmt::format("CACHE {} {:X}", name, hash)
-//#endif
-//            );
-//        }
-//        else
-//        {
-//            if (tokenPair.sharedToken == nullptr && tokenPair.token.type != PipelineTaskType::Null)
-//                tokenPair.sharedToken = std::make_shared<PipelineTaskToken>(std::move(tokenPair.token));
-//
-//            PipelineStateQueueItem queueItem;
-//            queueItem.pipelineHash = hash;
-//            queueItem.pipelineState = pipelineState;
-//            queueItem.token = tokenPair.sharedToken;
-//#ifdef ASYNC_PSO_DEBUG
-//            queueItem.pipelineName = fmt::format("ASYNC {} {:X}", name, hash);
-//#endif
-//            g_pipelineStateQueue.enqueue(queueItem);
-//        }
-//    }
-//
-//#ifdef PSO_CACHING_CLEANUP
-//    if (shouldCompile && isPrecompiledPipeline)
-//    {
-//        std::lock_guard lock(g_pipelineCacheMutex);
-//        g_pipelineStatesToCache.emplace(hash, pipelineState);
-//    }
-//#endif
-//
-//#ifdef PSO_CACHING
-//    if (!isPrecompiledPipeline)
-//    {
-//        std::lock_guard lock(g_pipelineCacheMutex);
-//        g_pipelineStatesToCache.erase(hash);
-//    }
-//#endif
-//}
+static PipelineEnqueueResult EnqueueGraphicsPipelineCompilation(const PipelineState& pipelineState, const char* name, bool isPrecompiledPipeline)
+{
+    XXH64_hash_t hash = XXH3_64bits(&pipelineState, sizeof(pipelineState));
+    auto status = isPrecompiledPipeline ? AsyncPipelineStatus::Queued : AsyncPipelineStatus::PriorityQueued;
+
+    {
+        std::lock_guard lock(g_asyncPipelineMutex);
+        auto [findResult, inserted] = g_asyncPipelineStates.try_emplace(hash, status);
+
+        if (!inserted)
+        {
+            if (findResult->second == AsyncPipelineStatus::Failed)
+                return PipelineEnqueueResult::Failed;
+
+            // The render thread is waiting on a state that's still stuck behind the precompiled ones, so queue it again with priority.
+            if (status != AsyncPipelineStatus::PriorityQueued || findResult->second != AsyncPipelineStatus::Queued)
+                return PipelineEnqueueResult::AlreadyQueued;
+
+            findResult->second = status;
+        }
+    }
+
+    PipelineStateQueueItem queueItem;
+    queueItem.pipelineHash = hash;
+    queueItem.pipelineState = pipelineState;
+#ifdef ASYNC_PSO_DEBUG
+    queueItem.pipelineName = fmt::format("ASYNC {} {:X}", name, hash);
+#endif
+
+    // Anything else was requested by the render thread and is currently being skipped, so it goes first.
+    if (isPrecompiledPipeline)
+        g_pipelineStateQueue.enqueue(std::move(queueItem));
+    else
+        g_priorityPipelineStateQueue.enqueue(std::move(queueItem));
+
+    g_pipelineStateQueueSemaphore.signal();
+
+    return PipelineEnqueueResult::Queued;
+}
 
 struct CompilationArgs
 {
@@ -7769,39 +8870,31 @@ public:
         FILE* f = fopen("send_this_file_to_skyth.txt", "ab");
         if (f != nullptr)
         {
-            ankerl::unordered_dense::set<GuestVertexDeclaration*> vertexDeclarations;
+            // The recorded states already have their pointers replaced with hashes and the config dependent spec constants masked out.
+            ankerl::unordered_dense::set<XXH64_hash_t> vertexDeclarations;
             xxHashMap<PipelineState> pipelineStatesToCache;
 
-            for (auto& [hash, pipelineState] : g_pipelineStatesToCache)
+            for (auto [hash, pipelineState] : g_pipelineStatesToCache)
             {
-                if (pipelineState.vertexShader->shaderCacheEntry == nullptr ||
-                    (pipelineState.pixelShader != nullptr && pipelineState.pixelShader->shaderCacheEntry == nullptr))
-                {
-                    continue;
-                }
-
-                vertexDeclarations.emplace(pipelineState.vertexDeclaration);
+                vertexDeclarations.emplace(reinterpret_cast<XXH64_hash_t>(pipelineState.vertexDeclaration));
 
                 // Mask out the config options.
                 pipelineState.sampleCount = 1;
                 pipelineState.enableAlphaToCoverage = false;
 
-                pipelineState.specConstants &= ~SPEC_CONSTANT_BICUBIC_GI_FILTER;
-                if ((pipelineState.specConstants & SPEC_CONSTANT_ALPHA_TO_COVERAGE) != 0)
-                {
-                    pipelineState.specConstants &= ~SPEC_CONSTANT_ALPHA_TO_COVERAGE;
-                    pipelineState.specConstants |= SPEC_CONSTANT_ALPHA_TEST;
-                }
-
                 pipelineStatesToCache.emplace(XXH3_64bits(&pipelineState, sizeof(pipelineState)), pipelineState);
             }
 
             for (auto vertexDeclaration : vertexDeclarations)
             {
-                fmt::print(f, "static uint8_t g_vertexElements_{:016X}[] = {{", vertexDeclaration->hash);
+                auto findResult = g_vertexElementsToCache.find(vertexDeclaration);
+                if (findResult == g_vertexElementsToCache.end())
+                    continue;
+
+                fmt::print(f, "static uint8_t g_vertexElements_{:016X}[] = {{", vertexDeclaration);
 
-                auto bytes = reinterpret_cast<uint8_t*>(vertexDeclaration->vertexElements.get());
-                for (size_t i = 0; i < vertexDeclaration->vertexElementCount * sizeof(GuestVertexElement); i++)
+                auto bytes = reinterpret_cast<const uint8_t*>(findResult->second.data());
+                for (size_t i = 0; i < findResult->second.size() * sizeof(GuestVertexElement); i++)
                     fmt::print(f, "0x{:X},", bytes[i]);
 
                 fmt::println(f, "}};");
@@ -7835,9 +8928,9 @@ public:
                     "{},"
                     "{},"
                     "0x{:X} }},",
-                    pipelineState.vertexShader->shaderCacheEntry->hash,
-                    pipelineState.pixelShader != nullptr ? pipelineState.pixelShader->shaderCacheEntry->hash : 0,
-                    pipelineState.vertexDeclaration->hash,
+                    reinterpret_cast<XXH64_hash_t>(pipelineState.vertexShader),
+                    reinterpret_cast<XXH64_hash_t>(pipelineState.pixelShader),
+                    reinterpret_cast<XXH64_hash_t>(pipelineState.vertexDeclaration),
                     pipelineState.instancing,
                     pipelineState.zEnable,
                     pipelineState.zWriteEnable,
@@ -30,6 +30,7 @@ struct Video
     static void WaitOnSwapChain();
     static void Present();
     static void StartPipelinePrecompilation();
+    static void SavePipelineCache();
     static void WaitForGPU();
     static void ComputeViewportDimensions();
 };
@@ -165,6 +166,7 @@ struct GuestBaseTexture : GuestResource
     uint32_t height = 0;
     RenderFormat format = RenderFormat::UNKNOWN;
     uint32_t descriptorIndex = 0;
+    uint32_t descriptorGeneration = 0;
     RenderTextureLayout layout = RenderTextureLayout::UNKNOWN;
 
     GuestBaseTexture(ResourceType type) : GuestResource(type)
@@ -1,7 +1,12 @@
 #include "installer.h"
 
+#include <condition_variable>
+#include <deque>
+
 #include <xxh3.h>
 
+#include <os/logger.h>
+
 #include "directory_file_system.h"
 #include "iso_file_system.h"
 #include "xcontent_file_system.h"
@@ -130,83 +135,320 @@ static bool checkFile(const FilePair &pair, const uint64_t *fileHashes, const st
     return true;
 }
 
-static bool copyFile(const FilePair &pair, const uint64_t *fileHashes, VirtualFileSystem &sourceVfs, const std::filesystem::path &targetDirectory, bool skipHashChecks, std::vector<uint8_t> &fileData, Journal &journal, const std::function<bool()> &progressCallback) {
-    const std::string filename(pair.first);
-    const uint32_t hashCount = pair.second;
-    if (!sourceVfs.exists(filename))
-    {
-        journal.lastResult = Journal::Result::FileMissing;
-        journal.lastErrorMessage = fmt::format("File {} does not exist in {}.", filename, sourceVfs.getName());
-        return false;
-    }
+// Files are copied through a pipeline of fixed size chunks. Reader threads each take a whole file at a time, load it a chunk at a time and
+// feed it to a streaming hash, while the calling thread writes out the chunks in the order they come in. The chunk pool bounds the memory
+// in flight regardless of how large the files are, and readers stall whenever the writer falls behind.
+static const size_t CopyChunkSize = 4 * 1024 * 1024;
+static const size_t CopyChunkCount = 16;
 
-    if (!sourceVfs.load(filename, fileData))
-    {
-        journal.lastResult = Journal::Result::FileReadFailed;
-        journal.lastErrorMessage = fmt::format("Failed to read file {} from {}.", filename, sourceVfs.getName());
-        return false;
+struct CopyJob
+{
+    FilePair pair;
+    const uint64_t *fileHashes = nullptr;
+};
+
+struct CopyChunk
+{
+    uint32_t jobIndex = 0;
+    size_t offset = 0;
+    size_t size = 0;
+    bool lastChunk = false;
+    bool hashMatched = true;
+    std::unique_ptr<uint8_t[]> data = std::make_unique<uint8_t[]>(CopyChunkSize);
+};
+
+struct CopyPipeline
+{
+    std::mutex mutex;
+    std::condition_variable freeCondition;
+    std::condition_variable readyCondition;
+    std::vector<std::unique_ptr<CopyChunk>> freeChunks;
+    std::deque<std::unique_ptr<CopyChunk>> readyChunks;
+    std::atomic<uint32_t> nextJobIndex = 0;
+    uint32_t activeReaders = 0;
+    bool stopped = false;
+    Journal::Result readerResult = Journal::Result::Success;
+    std::string readerErrorMessage;
+    std::atomic<uint64_t> readBytes = 0;
+    std::atomic<uint64_t> readNanoseconds = 0;
+    std::atomic<uint64_t> hashBytes = 0;
+    std::atomic<uint64_t> hashNanoseconds = 0;
+
+    void stop()
+    {
+        std::lock_guard lock(mutex);
+        stopped = true;
+        freeCondition.notify_all();
+        readyCondition.notify_all();
+    }
+
+    void fail(Journal::Result result, std::string errorMessage)
+    {
+        std::lock_guard lock(mutex);
+        if (!stopped)
+        {
+            stopped = true;
+            readerResult = result;
+            readerErrorMessage = std::move(errorMessage);
+        }
+
+        freeCondition.notify_all();
+        readyCondition.notify_all();
     }
+};
 
-    if (!skipHashChecks)
+static uint64_t elapsedNanoseconds(std::chrono::steady_clock::time_point begin, std::chrono::steady_clock::time_point end)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count();
+}
+
+static void copyReaderThread(CopyPipeline &pipeline, std::span<const CopyJob> jobs, VirtualFileSystem &sourceVfs, bool skipHashChecks)
+{
+    XXH3_state_t hashState;
+    while (true)
     {
-        uint64_t fileHash = XXH3_64bits(fileData.data(), fileData.size());
-        bool fileHashFound = false;
-        for (uint32_t i = 0; i < hashCount && !fileHashFound; i++)
+        uint32_t jobIndex = pipeline.nextJobIndex++;
+        if (jobIndex >= jobs.size())
         {
-            fileHashFound = fileHash == fileHashes[i];
+            break;
         }
 
-        if (!fileHashFound)
+        const CopyJob &job = jobs[jobIndex];
+        const std::string filename(job.pair.first);
+        if (!sourceVfs.exists(filename))
         {
-            journal.lastResult = Journal::Result::FileHashFailed;
-            journal.lastErrorMessage = fmt::format("File {} from {} did not match any of the known hashes.", filename, sourceVfs.getName());
-            return false;
+            pipeline.fail(Journal::Result::FileMissing, fmt::format("File {} does not exist in {}.", filename, sourceVfs.getName()));
+            break;
+        }
+
+        size_t fileSize = sourceVfs.getSize(filename);
+        if (fileSize == 0)
+        {
+            pipeline.fail(Journal::Result::FileReadFailed, fmt::format("Failed to read file {} from {}.", filename, sourceVfs.getName()));
+            break;
+        }
+
+        XXH3_64bits_reset(&hashState);
+
+        bool failed = false;
+        for (size_t offset = 0; offset < fileSize && !failed; )
+        {
+            std::unique_ptr<CopyChunk> chunk;
+            {
+                std::unique_lock lock(pipeline.mutex);
+                pipeline.freeCondition.wait(lock, [&]() { return !pipeline.freeChunks.empty() || pipeline.stopped; });
+                if (pipeline.stopped)
+                {
+                    failed = true;
+                    break;
+                }
+
+                chunk = std::move(pipeline.freeChunks.back());
+                pipeline.freeChunks.pop_back();
+            }
+
+            chunk->jobIndex = jobIndex;
+            chunk->offset = offset;
+            chunk->size = std::min(CopyChunkSize, fileSize - offset);
+            chunk->lastChunk = (offset + chunk->size) == fileSize;
+            chunk->hashMatched = true;
+
+            auto readBegin = std::chrono::steady_clock::now();
+            if (!sourceVfs.loadRange(filename, offset, chunk->data.get(), chunk->size))
+            {
+                pipeline.fail(Journal::Result::FileReadFailed, fmt::format("Failed to read file {} from {}.", filename, sourceVfs.getName()));
+                failed = true;
+                break;
+            }
+
+            auto readEnd = std::chrono::steady_clock::now();
+            pipeline.readBytes += chunk->size;
+            pipeline.readNanoseconds += elapsedNanoseconds(readBegin, readEnd);
+
+            if (!skipHashChecks)
+            {
+                XXH3_64bits_update(&hashState, chunk->data.get(), chunk->size);
+
+                if (chunk->lastChunk)
+                {
+                    uint64_t fileHash = XXH3_64bits_digest(&hashState);
+                    bool fileHashFound = false;
+                    for (uint32_t i = 0; i < job.pair.second && !fileHashFound; i++)
+                    {
+                        fileHashFound = fileHash == job.fileHashes[i];
+                    }
+
+                    chunk->hashMatched = fileHashFound;
+                }
+
+                pipeline.hashBytes += chunk->size;
+                pipeline.hashNanoseconds += elapsedNanoseconds(readEnd, std::chrono::steady_clock::now());
+            }
+
+            offset += chunk->size;
+
+            std::lock_guard lock(pipeline.mutex);
+            pipeline.readyChunks.emplace_back(std::move(chunk));
+            pipeline.readyCondition.notify_one();
+        }
+
+        if (failed)
+        {
+            break;
         }
     }
 
-    std::filesystem::path targetPath = targetDirectory / std::filesystem::path(std::u8string_view((const char8_t *)(pair.first)));
-    std::filesystem::path parentPath = targetPath.parent_path();
-    if (!std::filesystem::exists(parentPath))
+    std::lock_guard lock(pipeline.mutex);
+    pipeline.activeReaders--;
+    pipeline.readyCondition.notify_all();
+}
+
+static bool copyFilesPipelined(std::span<const CopyJob> jobs, VirtualFileSystem &sourceVfs, const std::filesystem::path &targetDirectory, bool skipHashChecks, Journal &journal, const std::function<bool()> &progressCallback)
+{
+    if (jobs.empty())
     {
-        std::error_code ec;
-        std::filesystem::create_directories(parentPath, ec);
+        return true;
     }
-    
-    while (!parentPath.empty()) {
-        journal.createdDirectories.insert(parentPath);
 
-        if (parentPath != targetDirectory) {
-            parentPath = parentPath.parent_path();
+    CopyPipeline pipeline;
+    for (size_t i = 0; i < CopyChunkCount; i++)
+    {
+        pipeline.freeChunks.emplace_back(std::make_unique<CopyChunk>());
+    }
+
+    uint32_t readerCount = std::min(std::clamp(std::thread::hardware_concurrency(), 2U, 4U), uint32_t(jobs.size()));
+    pipeline.activeReaders = readerCount;
+
+    std::vector<std::thread> readerThreads;
+    for (uint32_t i = 0; i < readerCount; i++)
+    {
+        readerThreads.emplace_back(copyReaderThread, std::ref(pipeline), jobs, std::ref(sourceVfs), skipHashChecks);
+    }
+
+    // Only as many files as there are readers can be in flight at once.
+    std::unordered_map<uint32_t, std::ofstream> outStreams;
+    bool writeFailed = false;
+    while (!writeFailed)
+    {
+        std::unique_ptr<CopyChunk> chunk;
+        {
+            std::unique_lock lock(pipeline.mutex);
+            pipeline.readyCondition.wait(lock, [&]() { return !pipeline.readyChunks.empty() || pipeline.activeReaders == 0 || pipeline.stopped; });
+            if (pipeline.stopped || pipeline.readyChunks.empty())
+            {
+                break;
+            }
+
+            chunk = std::move(pipeline.readyChunks.front());
+            pipeline.readyChunks.pop_front();
         }
-        else {
-            parentPath = std::filesystem::path();
+
+        const FilePair &pair = jobs[chunk->jobIndex].pair;
+        std::filesystem::path targetPath = targetDirectory / std::filesystem::path(std::u8string_view((const char8_t *)(pair.first)));
+        auto writeBegin = std::chrono::steady_clock::now();
+        if (chunk->offset == 0)
+        {
+            std::filesystem::path parentPath = targetPath.parent_path();
+            if (!std::filesystem::exists(parentPath))
+            {
+                std::error_code ec;
+                std::filesystem::create_directories(parentPath, ec);
+            }
+
+            while (!parentPath.empty()) {
+                journal.createdDirectories.insert(parentPath);
+
+                if (parentPath != targetDirectory) {
+                    parentPath = parentPath.parent_path();
+                }
+                else {
+                    parentPath = std::filesystem::path();
+                }
+            }
+
+            std::ofstream &outStream = outStreams[chunk->jobIndex];
+            outStream.open(targetPath, std::ios::binary);
+            if (!outStream.is_open())
+            {
+                journal.lastResult = Journal::Result::FileCreationFailed;
+                journal.lastErrorMessage = fmt::format("Failed to create file at {}.", fromPath(targetPath));
+                writeFailed = true;
+                break;
+            }
+
+            journal.createdFiles.push_back(targetPath);
+        }
+
+        std::ofstream &outStream = outStreams[chunk->jobIndex];
+        outStream.write((const char *)(chunk->data.get()), chunk->size);
+        if (chunk->lastChunk)
+        {
+            outStream.close();
+        }
+
+        // Closing flushes the rest of the file, and a failed flush only sets the fail bit.
+        if (outStream.fail())
+        {
+            journal.lastResult = Journal::Result::FileWriteFailed;
+            journal.lastErrorMessage = fmt::format("Failed to create file at {}.", fromPath(targetPath));
+            writeFailed = true;
+            break;
+        }
+
+        journal.writeCounter.byteCount += chunk->size;
+        journal.writeCounter.duration += std::chrono::steady_clock::now() - writeBegin;
+        journal.progressCounter += chunk->size;
+
+        if (chunk->lastChunk)
+        {
+            outStreams.erase(chunk->jobIndex);
+
+            // The file was already written by the time the hash is known, but it's in the journal and will be removed by the rollback.
+            if (!chunk->hashMatched)
+            {
+                journal.lastResult = Journal::Result::FileHashFailed;
+                journal.lastErrorMessage = fmt::format("File {} from {} did not match any of the known hashes.", pair.first, sourceVfs.getName());
+                writeFailed = true;
+                break;
+            }
+        }
+
+        {
+            std::lock_guard lock(pipeline.mutex);
+            pipeline.freeChunks.emplace_back(std::move(chunk));
+            pipeline.freeCondition.notify_one();
+        }
+
+        if (!progressCallback())
+        {
+            journal.lastResult = Journal::Result::Cancelled;
+            journal.lastErrorMessage = "Installation was cancelled.";
+            writeFailed = true;
+            break;
         }
     }
 
-    std::ofstream outStream(targetPath, std::ios::binary);
-    if (!outStream.is_open())
+    pipeline.stop();
+
+    for (std::thread &readerThread : readerThreads)
     {
-        journal.lastResult = Journal::Result::FileCreationFailed;
-        journal.lastErrorMessage = fmt::format("Failed to create file at {}.", fromPath(targetPath));
-        return false;
+        readerThread.join();
     }
 
-    journal.createdFiles.push_back(targetPath);
+    journal.readCounter.byteCount += pipeline.readBytes;
+    journal.readCounter.duration += std::chrono::nanoseconds(pipeline.readNanoseconds);
+    journal.hashCounter.byteCount += pipeline.hashBytes;
+    journal.hashCounter.duration += std::chrono::nanoseconds(pipeline.hashNanoseconds);
 
-    outStream.write((const char *)(fileData.data()), fileData.size());
-    if (outStream.bad())
+    if (writeFailed)
     {
-        journal.lastResult = Journal::Result::FileWriteFailed;
-        journal.lastErrorMessage = fmt::format("Failed to create file at {}.", fromPath(targetPath));
         return false;
     }
 
-    journal.progressCounter += fileData.size();
-    
-    if (!progressCallback())
+    if (pipeline.readerResult != Journal::Result::Success)
     {
-        journal.lastResult = Journal::Result::Cancelled;
-        journal.lastErrorMessage = "Installation was cancelled.";
+        journal.lastResult = pipeline.readerResult;
+        journal.lastErrorMessage = pipeline.readerErrorMessage;
         return false;
     }
 
@@ -425,20 +667,39 @@ bool Installer::copyFiles(std::span<const FilePair> filePairs, const uint64_t *f
         return false;
     }
 
-    uint32_t hashIndex = 0;
+    // The validation file is what marks the installation as present, so it's held back until everything else has been written.
+    std::vector<CopyJob> jobs;
+    std::vector<CopyJob> validationJobs;
     uint32_t hashCount = 0;
-    std::vector<uint8_t> fileData;
     for (FilePair pair : filePairs)
     {
-        hashIndex = hashCount;
+        CopyJob job = { pair, &fileHashes[hashCount] };
         hashCount += pair.second;
 
-        if (!copyFile(pair, &fileHashes[hashIndex], sourceVfs, targetDirectory, skipHashChecks, fileData, journal, progressCallback))
+        if (validationFile == pair.first)
         {
-            return false;
+            validationJobs.emplace_back(job);
+        }
+        else
+        {
+            jobs.emplace_back(job);
         }
     }
 
+    if (!copyFilesPipelined(jobs, sourceVfs, targetDirectory, skipHashChecks, journal, progressCallback))
+    {
+        return false;
+    }
+
+    if (!copyFilesPipelined(validationJobs, sourceVfs, targetDirectory, skipHashChecks, journal, progressCallback))
+    {
+        return false;
+    }
+
+    // The counters add up over the whole installation, reads and hashes are per thread.
+    LOGF_UTILITY("Copied files from {} to \"{}\". Read: {:.2f} MiB/s per thread, hash: {:.2f} MiB/s per thread, write: {:.2f} MiB/s.",
+        sourceVfs.getName(), fromPath(targetDirectory), journal.readCounter.getMiBPerSecond(), journal.hashCounter.getMiBPerSecond(), journal.writeCounter.getMiBPerSecond());
+
     return true;
 }
 
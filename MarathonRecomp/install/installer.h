@@ -35,8 +35,25 @@ struct Journal
         UnknownDLCType
     };
 
+    struct StageCounter
+    {
+        uint64_t byteCount = 0;
+        std::chrono::nanoseconds duration{};
+
+        double getMiBPerSecond() const
+        {
+            double seconds = std::chrono::duration<double>(duration).count();
+            return seconds > 0.0 ? (double(byteCount) / (1024.0 * 1024.0)) / seconds : 0.0;
+        }
+    };
+
     uint64_t progressCounter = 0;
     uint64_t progressTotal = 0;
+
+    // Throughput of each stage of the file copies. Reads and hashes run on several threads at once, so their durations are summed across all of them.
+    StageCounter readCounter;
+    StageCounter hashCounter;
+    StageCounter writeCounter;
     std::list<std::filesystem::path> createdFiles;
     std::set<std::filesystem::path> createdDirectories;
     Result lastResult = Result::Success;
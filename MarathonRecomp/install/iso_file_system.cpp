@@ -157,6 +157,27 @@ bool ISOFileSystem::load(const std::string &path, uint8_t *fileData, size_t file
     }
 }
 
+bool ISOFileSystem::loadRange(const std::string &path, size_t offset, uint8_t *fileData, size_t byteCount) const
+{
+    auto it = fileMap.find(path);
+    if (it != fileMap.end())
+    {
+        size_t fileSize = std::get<1>(it->second);
+        if (offset > fileSize || byteCount > (fileSize - offset))
+        {
+            return false;
+        }
+
+        const uint8_t *mappedFileData = mappedFile.data();
+        memcpy(fileData, &mappedFileData[std::get<0>(it->second) + offset], byteCount);
+        return true;
+    }
+    else
+    {
+        return false;
+    }
+}
+
 size_t ISOFileSystem::getSize(const std::string &path) const
 {
     auto it = fileMap.find(path);
@@ -26,6 +26,7 @@ struct ISOFileSystem : VirtualFileSystem
 
     ISOFileSystem(const std::filesystem::path &isoPath);
     bool load(const std::string &path, uint8_t *fileData, size_t fileDataMaxByteCount) const override;
+    bool loadRange(const std::string &path, size_t offset, uint8_t *fileData, size_t byteCount) const override;
     size_t getSize(const std::string &path) const override;
     bool exists(const std::string &path) const override;
     const std::string &getName() const override;
@@ -6,6 +6,10 @@
 struct VirtualFileSystem {
     virtual ~VirtualFileSystem() { };
     virtual bool load(const std::string &path, uint8_t *fileData, size_t fileDataMaxByteCount) const = 0;
+
+    // Loads byteCount bytes starting at offset. Fails if the range goes past the end of the file.
+    // Must be safe to call from multiple threads at once.
+    virtual bool loadRange(const std::string &path, size_t offset, uint8_t *fileData, size_t byteCount) const = 0;
     virtual size_t getSize(const std::string &path) const = 0;
     virtual bool exists(const std::string &path) const = 0;
     virtual const std::string &getName() const = 0;
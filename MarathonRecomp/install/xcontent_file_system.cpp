@@ -591,6 +591,121 @@ bool XContentFileSystem::load(const std::string &path, uint8_t *fileData, size_t
     }
 }
 
+bool XContentFileSystem::loadRange(const std::string &path, size_t offset, uint8_t *fileData, size_t byteCount) const
+{
+    auto it = fileMap.find(path);
+    if (it != fileMap.end())
+    {
+        if (offset > it->second.size || byteCount > (it->second.size - offset))
+        {
+            return false;
+        }
+
+        if (volumeType == XContentVolumeType::STFS)
+        {
+            const MemoryMappedFile &rootMappedFile = mappedFiles.back();
+            const uint8_t *rootMappedFileData = rootMappedFile.data();
+            std::shared_ptr<const std::vector<uint32_t>> blockChain = getBlockChain(path, it->second);
+            size_t chainIndex = offset / StfsBlockSize;
+            size_t blockDataOffset = offset % StfsBlockSize;
+            size_t fileDataOffset = 0;
+            size_t remainingSize = byteCount;
+            while (remainingSize > 0 && chainIndex < blockChain->size())
+            {
+                size_t blockSize = std::min(size_t(StfsBlockSize) - blockDataOffset, remainingSize);
+                size_t blockOffset = blockIndexToOffset(baseOffset, (*blockChain)[chainIndex]) + blockDataOffset;
+                if (blockOffset + blockSize > rootMappedFile.size())
+                {
+                    return false;
+                }
+
+                memcpy(&fileData[fileDataOffset], &rootMappedFileData[blockOffset], blockSize);
+
+                fileDataOffset += blockSize;
+                remainingSize -= blockSize;
+                blockDataOffset = 0;
+                chainIndex++;
+            }
+
+            return remainingSize == 0;
+        }
+        else if (volumeType == XContentVolumeType::SVOD)
+        {
+            size_t blockDataOffset = offset % 0x800;
+            size_t fileDataOffset = 0;
+            size_t remainingSize = byteCount;
+            size_t currentBlock = it->second.blockIndex + (offset / 0x800);
+            while (remainingSize > 0)
+            {
+                size_t blockFileOffset, blockFileIndex;
+                blockToOffsetAndFile(svodLayoutType, svodStartDataBlock, svodBaseOffset, currentBlock, blockFileOffset, blockFileIndex);
+                if (blockFileIndex >= mappedFiles.size())
+                {
+                    return false;
+                }
+
+                const MemoryMappedFile &mappedFile = mappedFiles[blockFileIndex];
+                const uint8_t *mappedFileData = mappedFile.data();
+                size_t blockSize = std::min(size_t(0x800) - blockDataOffset, remainingSize);
+                blockFileOffset += blockDataOffset;
+                if (blockFileOffset + blockSize > mappedFile.size())
+                {
+                    return false;
+                }
+
+                memcpy(&fileData[fileDataOffset], &mappedFileData[blockFileOffset], blockSize);
+
+                fileDataOffset += blockSize;
+                remainingSize -= blockSize;
+                blockDataOffset = 0;
+                currentBlock++;
+            }
+
+            return remainingSize == 0;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    else
+    {
+        return false;
+    }
+}
+
+std::shared_ptr<const std::vector<uint32_t>> XContentFileSystem::getBlockChain(const std::string &path, const File &file) const
+{
+    std::lock_guard lock(blockChainMutex);
+
+    std::shared_ptr<const std::vector<uint32_t>> &blockChain = blockChains[path];
+    if (blockChain == nullptr)
+    {
+        const MemoryMappedFile &rootMappedFile = mappedFiles.back();
+        const uint8_t *rootMappedFileData = rootMappedFile.data();
+        auto resolvedChain = std::make_shared<std::vector<uint32_t>>();
+        resolvedChain->reserve(file.blockCount);
+
+        uint32_t fileBlockIndex = file.blockIndex;
+        for (uint32_t i = 0; i < file.blockCount && fileBlockIndex != StfsEndOfChain; i++)
+        {
+            if (blockIndexToHashBlockOffset(baseOffset, fileBlockIndex) + sizeof(StfsHashTable) > rootMappedFile.size())
+            {
+                break;
+            }
+
+            resolvedChain->push_back(fileBlockIndex);
+
+            const StfsHashEntry *hashEntry = hashEntryFromBlockIndex(rootMappedFileData, baseOffset, fileBlockIndex);
+            fileBlockIndex = hashEntry->infoRaw & 0xFFFFFF;
+        }
+
+        blockChain = std::move(resolvedChain);
+    }
+
+    return blockChain;
+}
+
 size_t XContentFileSystem::getSize(const std::string &path) const
 {
     auto it = fileMap.find(path);
@@ -13,6 +13,7 @@
 
 #include <filesystem>
 #include <map>
+#include <mutex>
 
 #include "virtual_file_system.h"
 
@@ -51,12 +52,19 @@ struct XContentFileSystem : VirtualFileSystem
     std::map<std::string, File> fileMap;
     std::string name;
 
+    // STFS blocks are chained through the hash tables, so the chain of a file gets resolved
+    // once and shared between all the ranges read from it instead of walking it every time.
+    mutable std::mutex blockChainMutex;
+    mutable std::map<std::string, std::shared_ptr<const std::vector<uint32_t>>> blockChains;
+
     XContentFileSystem(const std::filesystem::path &contentPath);
     bool load(const std::string &path, uint8_t *fileData, size_t fileDataMaxByteCount) const override;
+    bool loadRange(const std::string &path, size_t offset, uint8_t *fileData, size_t byteCount) const override;
     size_t getSize(const std::string &path) const override;
     bool exists(const std::string &path) const override;
     const std::string &getName() const override;
     bool empty() const;
+    std::shared_ptr<const std::vector<uint32_t>> getBlockChain(const std::string &path, const File &file) const;
 
     static std::unique_ptr<XContentFileSystem> create(const std::filesystem::path &contentPath);
     static bool check(const std::filesystem::path &contentPath);
@@ -3,21 +3,167 @@
 #include "memory.h"
 #include "function.h"
 #include "xdm.h"
+#include <bit>
+#include <cpu/ppc_context.h>
+#include <os/logger.h>
+#include <user/paths.h>
 
 constexpr size_t RESERVED_BEGIN = 0x7FEA0000;
 constexpr size_t RESERVED_END = 0xA0000000;
 
+constexpr size_t MAGAZINE_CLASS_COUNT = std::countr_zero(Heap::MAGAZINE_MAX_FRAGMENT_SIZE) - std::countr_zero(Heap::MAGAZINE_MIN_FRAGMENT_SIZE) + 1;
+
+// Local counts get added to the heap stats in batches to keep every allocation from writing to a shared cache line.
+constexpr uint32_t STATS_PUBLISH_INTERVAL = 256;
+
+struct HeapMagazine
+{
+    void* blocks[Heap::MAGAZINE_CAPACITY];
+    size_t count = 0;
+
+    // Copy of count for diagnostics running on other threads. Only the owning thread
+    // writes it, so the relaxed stores don't cost more than a regular store.
+    std::atomic<uint32_t> publishedCount;
+
+    void PublishCount()
+    {
+        publishedCount.store(uint32_t(count), std::memory_order_relaxed);
+    }
+};
+
+struct HeapThreadCache;
+
+static Mutex g_heapThreadCacheMutex;
+static std::vector<HeapThreadCache*> g_heapThreadCaches;
+
+struct HeapThreadCache
+{
+    HeapMagazine magazines[MAGAZINE_CLASS_COUNT];
+    uint32_t allocations = 0;
+    uint32_t frees = 0;
+
+    HeapThreadCache()
+    {
+        std::lock_guard lock(g_heapThreadCacheMutex);
+        g_heapThreadCaches.push_back(this);
+    }
+
+    void PublishStats()
+    {
+        g_userHeap.stats.allocations.fetch_add(allocations, std::memory_order_relaxed);
+        g_userHeap.stats.frees.fetch_add(frees, std::memory_order_relaxed);
+        allocations = 0;
+        frees = 0;
+    }
+
+    ~HeapThreadCache()
+    {
+        PublishStats();
+
+        std::lock_guard cacheLock(g_heapThreadCacheMutex);
+        g_heapThreadCaches.erase(std::find(g_heapThreadCaches.begin(), g_heapThreadCaches.end(), this));
+
+        std::lock_guard lock(g_userHeap.mutex);
+
+        for (auto& magazine : magazines)
+        {
+            for (size_t i = 0; i < magazine.count; i++)
+                o1heapFree(g_userHeap.heap, magazine.blocks[i]);
+
+            g_userHeap.stats.sharedFrees.fetch_add(magazine.count, std::memory_order_relaxed);
+            magazine.count = 0;
+            magazine.PublishCount();
+        }
+    }
+};
+
+static thread_local HeapThreadCache g_heapThreadCache;
+
+static bool GetMagazineClass(size_t fragmentSize, size_t& classIndex)
+{
+    if (fragmentSize > Heap::MAGAZINE_MAX_FRAGMENT_SIZE)
+        return false;
+
+    // Matches the rounding o1heap does, so cached blocks are interchangeable with freshly allocated ones.
+    fragmentSize = std::max(fragmentSize, Heap::MAGAZINE_MIN_FRAGMENT_SIZE);
+    classIndex = std::countr_zero(fragmentSize) - std::countr_zero(Heap::MAGAZINE_MIN_FRAGMENT_SIZE);
+
+    return true;
+}
+
 void Heap::Init()
 {
     heap = o1heapInit(g_memory.Translate(0x20000), RESERVED_BEGIN - 0x20000);
     physicalHeap = o1heapInit(g_memory.Translate(RESERVED_END), 0x100000000 - RESERVED_END);
 }
 
+void Heap::Lock()
+{
+    if (!mutex.try_lock())
+    {
+        stats.contentions.fetch_add(1, std::memory_order_relaxed);
+        mutex.lock();
+    }
+}
+
 void* Heap::Alloc(size_t size)
 {
-    std::lock_guard lock(mutex);
+    size = std::max<size_t>(1, size);
+
+    size_t classIndex;
+    if (GetMagazineClass(std::bit_ceil(size + O1HEAP_ALIGNMENT), classIndex))
+    {
+        auto& cache = g_heapThreadCache;
+        auto& magazine = cache.magazines[classIndex];
 
-    return o1heapAllocate(heap, std::max<size_t>(1, size));
+        if (magazine.count == 0)
+        {
+            size_t fragmentSize = MAGAZINE_MIN_FRAGMENT_SIZE << classIndex;
+
+            Lock();
+
+            while (magazine.count < MAGAZINE_BATCH_SIZE)
+            {
+                void* ptr = o1heapAllocate(heap, fragmentSize - O1HEAP_ALIGNMENT);
+                if (ptr == nullptr)
+                    break;
+
+                magazine.blocks[magazine.count++] = ptr;
+            }
+
+            magazine.PublishCount();
+            mutex.unlock();
+
+            stats.sharedAllocations.fetch_add(magazine.count, std::memory_order_relaxed);
+            cache.PublishStats();
+
+            if (magazine.count == 0)
+                return nullptr;
+        }
+
+        if (++cache.allocations >= STATS_PUBLISH_INTERVAL)
+            cache.PublishStats();
+
+        void* ptr = magazine.blocks[--magazine.count];
+        magazine.PublishCount();
+
+        if (isTrackingCallSites)
+            TrackAllocation(ptr);
+
+        return ptr;
+    }
+
+    stats.allocations.fetch_add(1, std::memory_order_relaxed);
+    stats.sharedAllocations.fetch_add(1, std::memory_order_relaxed);
+
+    Lock();
+    void* ptr = o1heapAllocate(heap, size);
+    mutex.unlock();
+
+    if (isTrackingCallSites && ptr != nullptr)
+        TrackAllocation(ptr);
+
+    return ptr;
 }
 
 void* Heap::AllocPhysical(size_t size, size_t alignment)
@@ -42,12 +188,75 @@ void Heap::Free(void* ptr)
     {
         std::lock_guard lock(physicalMutex);
         o1heapFree(physicalHeap, *((void**)ptr - 1));
+        return;
     }
-    else
+
+    if (isTrackingCallSites && ptr != nullptr)
+        TrackFree(ptr);
+
+    size_t classIndex;
+    if (ptr != nullptr && GetMagazineClass(Size(ptr) + O1HEAP_ALIGNMENT, classIndex))
     {
-        std::lock_guard lock(mutex);
-        o1heapFree(heap, ptr);
+        auto& cache = g_heapThreadCache;
+        auto& magazine = cache.magazines[classIndex];
+
+        if (magazine.count == MAGAZINE_CAPACITY)
+        {
+            // Return the oldest blocks, the most recently freed ones are the likeliest to still be in cache.
+            Lock();
+
+            for (size_t i = 0; i < MAGAZINE_BATCH_SIZE; i++)
+                o1heapFree(heap, magazine.blocks[i]);
+
+            magazine.count -= MAGAZINE_BATCH_SIZE;
+            magazine.PublishCount();
+            mutex.unlock();
+
+            memmove(magazine.blocks, magazine.blocks + MAGAZINE_BATCH_SIZE, magazine.count * sizeof(void*));
+
+            stats.sharedFrees.fetch_add(MAGAZINE_BATCH_SIZE, std::memory_order_relaxed);
+            cache.PublishStats();
+        }
+
+        magazine.blocks[magazine.count++] = ptr;
+        magazine.PublishCount();
+
+        if (++cache.frees >= STATS_PUBLISH_INTERVAL)
+            cache.PublishStats();
+
+        return;
     }
+
+    stats.frees.fetch_add(1, std::memory_order_relaxed);
+    stats.sharedFrees.fetch_add(1, std::memory_order_relaxed);
+
+    Lock();
+    o1heapFree(heap, ptr);
+    mutex.unlock();
+}
+
+bool Heap::Resize(void* ptr, size_t size)
+{
+    if (ptr >= physicalHeap)
+        return false;
+
+    size = std::max<size_t>(1, size);
+
+    // Sizes that round to the same fragment don't need to touch the shared heap.
+    if (std::max(std::bit_ceil(size + O1HEAP_ALIGNMENT), MAGAZINE_MIN_FRAGMENT_SIZE) == Size(ptr) + O1HEAP_ALIGNMENT)
+        return true;
+
+    Lock();
+    bool result = o1heapReallocateInPlace(heap, ptr, size);
+    mutex.unlock();
+
+    if (result && isTrackingCallSites)
+    {
+        TrackFree(ptr);
+        TrackAllocation(ptr);
+    }
+
+    return result;
 }
 
 size_t Heap::Size(void* ptr)
@@ -58,6 +267,215 @@ size_t Heap::Size(void* ptr)
     return 0;
 }
 
+HeapDiagnostics Heap::GetDiagnostics(bool physical)
+{
+    HeapDiagnostics diagnostics;
+
+    auto visitor = [](void* context, size_t size, bool used)
+        {
+            auto& diagnostics = *reinterpret_cast<HeapDiagnostics*>(context);
+            size_t bucket = std::min<size_t>(std::bit_width(size) - 1, HeapDiagnostics::HISTOGRAM_SIZE - 1);
+
+            if (used)
+            {
+                ++diagnostics.usedFragments;
+                ++diagnostics.usedHistogram[bucket];
+            }
+            else
+            {
+                ++diagnostics.freeFragments;
+                ++diagnostics.freeHistogram[bucket];
+                diagnostics.largestFreeBlock = std::max(diagnostics.largestFreeBlock, size - O1HEAP_ALIGNMENT);
+            }
+        };
+
+    auto collect = [&](O1HeapInstance* instance)
+        {
+            auto o1heapDiagnostics = o1heapGetDiagnostics(instance);
+            diagnostics.capacity = o1heapDiagnostics.capacity;
+            diagnostics.liveBytes = o1heapDiagnostics.allocated;
+            diagnostics.peakBytes = o1heapDiagnostics.peak_allocated;
+            diagnostics.oomCount = o1heapDiagnostics.oom_count;
+
+            o1heapTraverse(instance, visitor, &diagnostics);
+        };
+
+    if (physical)
+    {
+        std::lock_guard lock(physicalMutex);
+        collect(physicalHeap);
+    }
+    else
+    {
+        // Blocks sitting in the thread magazines are still allocated as far as o1heap
+        // is concerned, so move them out of the live figures and count them on their own.
+        std::lock_guard cacheLock(g_heapThreadCacheMutex);
+        std::lock_guard lock(mutex);
+        collect(heap);
+
+        for (auto cache : g_heapThreadCaches)
+        {
+            for (size_t i = 0; i < MAGAZINE_CLASS_COUNT; i++)
+            {
+                size_t fragmentSize = MAGAZINE_MIN_FRAGMENT_SIZE << i;
+                uint32_t count = cache->magazines[i].publishedCount.load(std::memory_order_relaxed);
+                size_t bucket = std::min<size_t>(std::bit_width(fragmentSize) - 1, HeapDiagnostics::HISTOGRAM_SIZE - 1);
+
+                diagnostics.cachedBytes += count * fragmentSize;
+                diagnostics.cachedFragments += count;
+                diagnostics.usedHistogram[bucket] -= std::min(diagnostics.usedHistogram[bucket], count);
+            }
+        }
+
+        // The owning threads keep running, so the counts can be slightly ahead of the traversal.
+        diagnostics.cachedBytes = std::min(diagnostics.cachedBytes, diagnostics.liveBytes);
+        diagnostics.cachedFragments = std::min(diagnostics.cachedFragments, diagnostics.usedFragments);
+        diagnostics.liveBytes -= diagnostics.cachedBytes;
+        diagnostics.usedFragments -= diagnostics.cachedFragments;
+    }
+
+    return diagnostics;
+}
+
+void Heap::SetCallSiteTracking(bool enable)
+{
+    std::lock_guard lock(callSiteMutex);
+
+    // Blocks allocated while tracking was off are unknown, so start from a clean slate.
+    trackedBlocks.clear();
+    callSites.clear();
+
+    isTrackingCallSites = enable;
+}
+
+void Heap::TrackAllocation(void* ptr)
+{
+    auto ctx = GetPPCContext();
+    uint32_t lr = ctx != nullptr ? uint32_t(ctx->lr) : 0;
+    uint32_t size = uint32_t(Size(ptr));
+
+    std::lock_guard lock(callSiteMutex);
+
+    if (!isTrackingCallSites)
+        return;
+
+    trackedBlocks[ptr] = { lr, size };
+
+    auto& callSite = callSites[lr];
+    callSite.lr = lr;
+    ++callSite.allocations;
+    callSite.liveBytes += size;
+    ++callSite.liveCount;
+}
+
+void Heap::TrackFree(void* ptr)
+{
+    std::lock_guard lock(callSiteMutex);
+
+    auto findResult = trackedBlocks.find(ptr);
+    if (findResult == trackedBlocks.end())
+        return;
+
+    auto& callSite = callSites[findResult->second.first];
+    callSite.liveBytes -= findResult->second.second;
+    --callSite.liveCount;
+
+    trackedBlocks.erase(findResult);
+}
+
+std::vector<HeapCallSite> Heap::GetCallSites()
+{
+    std::vector<HeapCallSite> result;
+    {
+        std::lock_guard lock(callSiteMutex);
+        result.reserve(callSites.size());
+
+        for (auto& [lr, callSite] : callSites)
+            result.push_back(callSite);
+    }
+
+    std::sort(result.begin(), result.end(), [](auto& lhs, auto& rhs) { return lhs.liveBytes > rhs.liveBytes; });
+
+    return result;
+}
+
+bool Heap::ExportDiagnostics(const std::filesystem::path& path)
+{
+    std::string json = "{";
+
+    auto appendDiagnostics = [&](const char* name, const HeapDiagnostics& diagnostics)
+        {
+            json += fmt::format("\"{}\":{{\"capacity\":{},\"liveBytes\":{},\"cachedBytes\":{},\"peakBytes\":{},\"largestFreeBlock\":{},\"oomCount\":{},\"usedFragments\":{},\"cachedFragments\":{},\"freeFragments\":{}",
+                name, diagnostics.capacity, diagnostics.liveBytes, diagnostics.cachedBytes, diagnostics.peakBytes, diagnostics.largestFreeBlock, diagnostics.oomCount,
+                diagnostics.usedFragments, diagnostics.cachedFragments, diagnostics.freeFragments);
+
+            auto appendHistogram = [&](const char* name, const uint32_t* histogram)
+                {
+                    json += fmt::format(",\"{}\":{{", name);
+
+                    bool isFirst = true;
+                    for (size_t i = 0; i < HeapDiagnostics::HISTOGRAM_SIZE; i++)
+                    {
+                        if (histogram[i] == 0)
+                            continue;
+
+                        json += fmt::format("{}\"{}\":{}", isFirst ? "" : ",", 1ull << i, histogram[i]);
+                        isFirst = false;
+                    }
+
+                    json += "}";
+                };
+
+            appendHistogram("usedHistogram", diagnostics.usedHistogram);
+            appendHistogram("freeHistogram", diagnostics.freeHistogram);
+
+            json += "},";
+        };
+
+    appendDiagnostics("heap", GetDiagnostics(false));
+    appendDiagnostics("physicalHeap", GetDiagnostics(true));
+
+    json += "\"callSites\":[";
+
+    bool isFirst = true;
+    for (auto& callSite : GetCallSites())
+    {
+        json += fmt::format("{}{{\"lr\":\"0x{:08X}\",\"allocations\":{},\"liveBytes\":{},\"liveCount\":{}}}",
+            isFirst ? "" : ",\n", callSite.lr, callSite.allocations, callSite.liveBytes, callSite.liveCount);
+
+        isFirst = false;
+    }
+
+    json += "]}\n";
+
+    std::error_code ec;
+    std::filesystem::create_directories(path.parent_path(), ec);
+
+    std::ofstream stream(path, std::ios::binary);
+    if (!stream.is_open())
+    {
+        LOGFN_ERROR("Failed to write heap diagnostics to \"{}\".", path.string());
+        return false;
+    }
+
+    stream.write(json.data(), json.size());
+
+    if (stream.bad())
+    {
+        LOGFN_ERROR("Failed to write heap diagnostics to \"{}\".", path.string());
+        return false;
+    }
+
+    LOGFN("Saved heap diagnostics to \"{}\".", path.string());
+
+    return true;
+}
+
+std::filesystem::path Heap::GetDiagnosticsExportPath()
+{
+    return GetUserPath() / "heap" / fmt::format("heap_{}.json", std::chrono::system_clock::now().time_since_epoch() / std::chrono::seconds(1));
+}
+
 uint32_t RtlAllocateHeap(uint32_t heapHandle, uint32_t flags, uint32_t size)
 {
     void* ptr = g_userHeap.Alloc(size);
@@ -70,6 +488,23 @@ uint32_t RtlAllocateHeap(uint32_t heapHandle, uint32_t flags, uint32_t size)
 
 uint32_t RtlReAllocateHeap(uint32_t heapHandle, uint32_t flags, uint32_t memoryPointer, uint32_t size)
 {
+    if (memoryPointer != 0)
+    {
+        void* oldPtr = g_memory.Translate(memoryPointer);
+        size_t oldSize = g_userHeap.Size(oldPtr);
+
+        if (g_userHeap.Resize(oldPtr, size))
+        {
+            if ((flags & 0x8) != 0 && size > oldSize)
+                memset((uint8_t*)oldPtr + oldSize, 0, size - oldSize);
+
+            g_userHeap.stats.inPlaceReallocations.fetch_add(1, std::memory_order_relaxed);
+            return memoryPointer;
+        }
+
+        g_userHeap.stats.copiedReallocations.fetch_add(1, std::memory_order_relaxed);
+    }
+
     void* ptr = g_userHeap.Alloc(size);
     if ((flags & 0x8) != 0)
         memset(ptr, 0, size);
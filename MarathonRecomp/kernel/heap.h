@@ -2,22 +2,98 @@
 
 #include "mutex.h"
 
+struct HeapDiagnostics
+{
+    // Indexed by the base 2 logarithm of the fragment size.
+    static constexpr size_t HISTOGRAM_SIZE = 32;
+
+    size_t capacity{};
+    size_t liveBytes{};
+
+    // Freed blocks kept in the per thread magazines, left out of the live and used figures.
+    size_t cachedBytes{};
+
+    // Includes cached blocks, as o1heap only tracks the high water mark itself.
+    size_t peakBytes{};
+
+    // What the shared heap can hand out right now, so cached blocks count as taken.
+    size_t largestFreeBlock{};
+
+    uint64_t oomCount{};
+    uint32_t usedFragments{};
+    uint32_t cachedFragments{};
+    uint32_t freeFragments{};
+    uint32_t usedHistogram[HISTOGRAM_SIZE]{};
+    uint32_t freeHistogram[HISTOGRAM_SIZE]{};
+};
+
+struct HeapCallSite
+{
+    uint32_t lr{};
+    uint64_t allocations{};
+    uint64_t liveBytes{};
+    uint32_t liveCount{};
+};
+
 struct Heap
 {
+    // Small blocks are cached per thread by o1heap fragment size, and only go back to the shared
+    // heap in batches. Cached blocks keep their fragment header, so Size keeps working on them.
+    static constexpr size_t MAGAZINE_MIN_FRAGMENT_SIZE = O1HEAP_ALIGNMENT * 2;
+    static constexpr size_t MAGAZINE_MAX_FRAGMENT_SIZE = 0x1000;
+    static constexpr size_t MAGAZINE_CAPACITY = 64;
+    static constexpr size_t MAGAZINE_BATCH_SIZE = 32;
+
+    struct Stats
+    {
+        std::atomic<uint64_t> allocations;
+        std::atomic<uint64_t> frees;
+        std::atomic<uint64_t> sharedAllocations;
+        std::atomic<uint64_t> sharedFrees;
+        std::atomic<uint64_t> contentions;
+        std::atomic<uint64_t> inPlaceReallocations;
+        std::atomic<uint64_t> copiedReallocations;
+    };
+
     Mutex mutex;
     O1HeapInstance* heap;
 
     Mutex physicalMutex;
     O1HeapInstance* physicalHeap;
 
+    Stats stats;
+
+    // Blocks allocated while tracking is enabled are attributed to the guest link register of the caller.
+    std::atomic<bool> isTrackingCallSites;
+    Mutex callSiteMutex;
+    ankerl::unordered_dense::map<void*, std::pair<uint32_t, uint32_t>> trackedBlocks;
+    ankerl::unordered_dense::map<uint32_t, HeapCallSite> callSites;
+
     void Init();
 
+    // Takes the shared heap lock, counting the times it was already held by another thread.
+    void Lock();
+
     void* Alloc(size_t size);
     void* AllocPhysical(size_t size, size_t alignment);
     void Free(void* ptr);
 
+    // Returns false if the block has to be moved to fit the new size.
+    bool Resize(void* ptr, size_t size);
+
     size_t Size(void* ptr);
 
+    // Walks every fragment of the heap while holding its lock, so this should not be called every frame.
+    HeapDiagnostics GetDiagnostics(bool physical);
+
+    void SetCallSiteTracking(bool enable);
+    void TrackAllocation(void* ptr);
+    void TrackFree(void* ptr);
+    std::vector<HeapCallSite> GetCallSites();
+
+    bool ExportDiagnostics(const std::filesystem::path& path);
+    std::filesystem::path GetDiagnosticsExportPath();
+
     template<typename T, typename... Args>
     T* Alloc(Args&&... args)
     {
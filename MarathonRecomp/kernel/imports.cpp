@@ -10,18 +10,97 @@
 #include "heap.h"
 #include "memory.h"
 #include <memory>
+#include <condition_variable>
 #include "xam.h"
 #include "xdm.h"
 #include <user/config.h>
 #include <os/logger.h>
+#include <utils/trace.h>
 
 #ifdef _WIN32
 #include <ntstatus.h>
 #endif
 
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
+
 std::unordered_map<uint32_t, uint32_t> g_handleDuplicates{};
 
-struct Event final : KernelObject, HostObject<XKEVENT>
+// Thread blocked in a wait on multiple objects, or in a wait with a timeout.
+// It gets registered to every object it waits on, and only those objects wake it up.
+struct ObjectWaiter
+{
+    std::mutex mutex;
+    std::condition_variable condition;
+    bool notified = false;
+
+    void Notify()
+    {
+        {
+            std::lock_guard lock(mutex);
+            notified = true;
+        }
+
+        condition.notify_one();
+    }
+
+    // Returns false if the deadline passed before getting notified.
+    bool Wait(std::chrono::steady_clock::time_point deadline, bool infinite)
+    {
+        std::unique_lock lock(mutex);
+
+        if (infinite)
+            condition.wait(lock, [&]() { return notified; });
+        else if (!condition.wait_until(lock, deadline, [&]() { return notified; }))
+            return false;
+
+        notified = false;
+        return true;
+    }
+};
+
+struct WaitableObject : KernelObject
+{
+    Mutex waitersMutex;
+    std::vector<ObjectWaiter*> waiters;
+    std::atomic<uint32_t> waiterCount;
+
+    void AddWaiter(ObjectWaiter* waiter)
+    {
+        std::lock_guard lock(waitersMutex);
+        waiters.push_back(waiter);
+        ++waiterCount;
+    }
+
+    void RemoveWaiter(ObjectWaiter* waiter)
+    {
+        std::lock_guard lock(waitersMutex);
+        waiters.erase(std::find(waiters.begin(), waiters.end(), waiter));
+        --waiterCount;
+    }
+
+    // Must be called after the state change is visible, so that a waiter
+    // registering at the same time either sees the new state or gets notified.
+    void NotifyWaiters()
+    {
+        if (waiterCount.load() == 0)
+            return;
+
+        std::lock_guard lock(waitersMutex);
+        for (auto waiter : waiters)
+            waiter->Notify();
+    }
+
+    virtual bool IsSignaled() const = 0;
+
+    // Gives back what a successful Wait(0) took.
+    virtual void UndoWait() = 0;
+};
+
+static uint32_t WaitForObjects(WaitableObject** objects, uint32_t count, bool waitAll, uint32_t timeout);
+
+struct Event final : WaitableObject, HostObject<XKEVENT>
 {
     bool manualReset;
     std::atomic<bool> signaled;
@@ -72,7 +151,8 @@ struct Event final : KernelObject, HostObject<XKEVENT>
         }
         else
         {
-            assert(false && "Unhandled timeout value.");
+            WaitableObject* object = this;
+            return WaitForObjects(&object, 1, true, timeout);
         }
 
         return STATUS_SUCCESS;
@@ -87,6 +167,8 @@ struct Event final : KernelObject, HostObject<XKEVENT>
         else
             signaled.notify_one();
 
+        NotifyWaiters();
+
         return TRUE;
     }
 
@@ -95,11 +177,20 @@ struct Event final : KernelObject, HostObject<XKEVENT>
         signaled = false;
         return TRUE;
     }
-};
 
-static std::atomic<uint32_t> g_keSetEventGeneration;
+    bool IsSignaled() const override
+    {
+        return signaled.load();
+    }
+
+    void UndoWait() override
+    {
+        if (!manualReset)
+            Set();
+    }
+};
 
-struct Semaphore final : KernelObject, HostObject<XKSEMAPHORE>
+struct Semaphore final : WaitableObject, HostObject<XKSEMAPHORE>
 {
     std::atomic<uint32_t> count;
     uint32_t maximumCount;
@@ -148,8 +239,8 @@ struct Semaphore final : KernelObject, HostObject<XKSEMAPHORE>
         }
         else
         {
-            assert(false && "Unhandled timeout value.");
-            return STATUS_TIMEOUT;
+            WaitableObject* object = this;
+            return WaitForObjects(&object, 1, true, timeout);
         }
     }
 
@@ -162,9 +253,110 @@ struct Semaphore final : KernelObject, HostObject<XKSEMAPHORE>
 
         count += releaseCount;
         count.notify_all();
+
+        NotifyWaiters();
+    }
+
+    bool IsSignaled() const override
+    {
+        return count.load() != 0;
+    }
+
+    void UndoWait() override
+    {
+        ++count;
+        count.notify_all();
+
+        NotifyWaiters();
     }
 };
 
+// Wait all only takes the objects once every one of them is signaled, so a wait that
+// times out doesn't keep signals that other waiters could have used in the meantime.
+static bool TryWaitForAllObjects(WaitableObject** objects, uint32_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        if (!objects[i]->IsSignaled())
+            return false;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (objects[i]->Wait(0) != STATUS_SUCCESS)
+        {
+            // Another thread took it in between, give back everything taken so far.
+            while (i != 0)
+                objects[--i]->UndoWait();
+
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static uint32_t WaitForObjects(WaitableObject** objects, uint32_t count, bool waitAll, uint32_t timeout)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+
+    thread_local ObjectWaiter s_waiter;
+    s_waiter.notified = false;
+
+    for (size_t i = 0; i < count; i++)
+        objects[i]->AddWaiter(&s_waiter);
+
+    uint32_t result = STATUS_TIMEOUT;
+
+    while (true)
+    {
+        if (waitAll)
+        {
+            if (TryWaitForAllObjects(objects, count))
+                result = STATUS_SUCCESS;
+        }
+        else
+        {
+            for (size_t i = 0; i < count; i++)
+            {
+                if (objects[i]->Wait(0) == STATUS_SUCCESS)
+                {
+                    result = STATUS_WAIT_0 + i;
+                    break;
+                }
+            }
+        }
+
+        if (result != STATUS_TIMEOUT)
+            break;
+
+        if (timeout == 0 || !s_waiter.Wait(deadline, timeout == INFINITE))
+            break;
+    }
+
+    for (size_t i = 0; i < count; i++)
+        objects[i]->RemoveWaiter(&s_waiter);
+
+    return result;
+}
+
+static WaitableObject* QueryWaitableObject(XDISPATCHER_HEADER& header)
+{
+    switch (header.Type)
+    {
+        case 0:
+        case 1:
+            return QueryKernelObject<Event>(header);
+
+        case 5:
+            return QueryKernelObject<Semaphore>(header);
+
+        default:
+            assert(false && "Unrecognized kernel object type.");
+            return nullptr;
+    }
+}
+
 inline void CloseKernelObject(XDISPATCHER_HEADER& header)
 {
     if (header.WaitListHead.Flink != OBJECT_SIGNATURE)
@@ -434,6 +626,8 @@ uint32_t XamLoaderSetLaunchData()
 
 uint32_t NtWaitForSingleObjectEx(uint32_t Handle, uint32_t WaitMode, uint32_t Alertable, be<int64_t>* Timeout)
 {
+    TraceScope traceScope("NtWaitForSingleObjectEx");
+
     if (Handle == GUEST_INVALID_HANDLE_VALUE)
         return 0xFFFFFFFF;
 
@@ -763,6 +957,76 @@ void RtlLeaveCriticalSection(XRTL_CRITICAL_SECTION* cs)
     owningThread.notify_one();
 }
 
+// Guest critical sections are usually held for a very short time, and parking
+// costs a syscall and a context switch on the host, so even critical sections
+// initialized without a spin count spin for a little while.
+static constexpr uint32_t CRITICAL_SECTION_MIN_SPIN_COUNT = 128;
+static constexpr uint32_t CRITICAL_SECTION_STATS_COUNT = 4096;
+
+struct CriticalSectionStatsEntry
+{
+    std::atomic<uint32_t> address;
+    std::atomic<uint32_t> contentions;
+    std::atomic<uint32_t> spinAcquisitions;
+    std::atomic<uint32_t> parks;
+    std::atomic<uint32_t> averageSpins;
+};
+
+// Open addressed by guest address. Entries are never removed, critical sections
+// past the capacity share the last entry.
+static CriticalSectionStatsEntry g_criticalSectionStats[CRITICAL_SECTION_STATS_COUNT + 1];
+
+static CriticalSectionStatsEntry& GetCriticalSectionStatsEntry(uint32_t address)
+{
+    uint32_t index = (address >> 2) * 0x9E3779B1;
+
+    for (uint32_t i = 0; i < CRITICAL_SECTION_STATS_COUNT; i++)
+    {
+        auto& entry = g_criticalSectionStats[(index + i) % CRITICAL_SECTION_STATS_COUNT];
+        uint32_t entryAddress = entry.address.load(std::memory_order_relaxed);
+
+        if (entryAddress == address)
+            return entry;
+
+        if (entryAddress == 0 && (entry.address.compare_exchange_strong(entryAddress, address) || entryAddress == address))
+            return entry;
+    }
+
+    return g_criticalSectionStats[CRITICAL_SECTION_STATS_COUNT];
+}
+
+std::vector<CriticalSectionStats> GetCriticalSectionStats()
+{
+    std::vector<CriticalSectionStats> result;
+
+    for (auto& entry : g_criticalSectionStats)
+    {
+        uint32_t contentions = entry.contentions.load(std::memory_order_relaxed);
+        if (contentions == 0)
+            continue;
+
+        auto& stats = result.emplace_back();
+        stats.address = entry.address.load(std::memory_order_relaxed);
+        stats.contentions = contentions;
+        stats.spinAcquisitions = entry.spinAcquisitions.load(std::memory_order_relaxed);
+        stats.parks = entry.parks.load(std::memory_order_relaxed);
+        stats.averageSpins = entry.averageSpins.load(std::memory_order_relaxed);
+    }
+
+    std::sort(result.begin(), result.end(), [](auto& lhs, auto& rhs) { return lhs.contentions > rhs.contentions; });
+
+    return result;
+}
+
+static void CpuRelax()
+{
+#if defined(__x86_64__) || defined(_M_X64)
+    _mm_pause();
+#elif defined(__aarch64__) || defined(_M_ARM64)
+    __asm__ volatile("yield");
+#endif
+}
+
 void RtlEnterCriticalSection(XRTL_CRITICAL_SECTION* cs)
 {
     uint32_t thisThread = g_ppcContext->r13.u32;
@@ -771,9 +1035,51 @@ void RtlEnterCriticalSection(XRTL_CRITICAL_SECTION* cs)
 
     std::atomic_ref owningThread(cs->OwningThread);
 
+    uint32_t previousOwner = 0;
+
+    if (owningThread.compare_exchange_weak(previousOwner, thisThread) || previousOwner == thisThread)
+    {
+        cs->RecursionCount = cs->RecursionCount.get() + 1;
+        return;
+    }
+
+    auto& stats = GetCriticalSectionStatsEntry(g_memory.MapVirtual(cs));
+    stats.contentions.fetch_add(1, std::memory_order_relaxed);
+
+    // Spin for about twice as long as it took to get the lock on average recently, but
+    // never longer than the spin count the guest asked for, which is stored in units of 256.
+    uint32_t maxSpinCount = std::max<uint32_t>(cs->Header.Absolute * 256, CRITICAL_SECTION_MIN_SPIN_COUNT);
+    uint32_t averageSpins = stats.averageSpins.load(std::memory_order_relaxed);
+    uint32_t spinCount = std::min(maxSpinCount, averageSpins * 2 + 16);
+    uint32_t spins = 0;
+
+    for (; spins < spinCount; spins++)
+    {
+        // Back off to yielding halfway through, in case the owner is waiting for this core.
+        if (spins < spinCount / 2)
+            CpuRelax();
+        else
+            std::this_thread::yield();
+
+        previousOwner = 0;
+        if (owningThread.load(std::memory_order_relaxed) == 0 && owningThread.compare_exchange_weak(previousOwner, thisThread))
+            break;
+    }
+
+    stats.averageSpins.store(uint32_t(int32_t(averageSpins) + (int32_t(spins) - int32_t(averageSpins)) / 8), std::memory_order_relaxed);
+
+    if (spins < spinCount)
+    {
+        stats.spinAcquisitions.fetch_add(1, std::memory_order_relaxed);
+        cs->RecursionCount = cs->RecursionCount.get() + 1;
+        return;
+    }
+
+    stats.parks.fetch_add(1, std::memory_order_relaxed);
+
     while (true) 
     {
-        uint32_t previousOwner = 0;
+        previousOwner = 0;
 
         if (owningThread.compare_exchange_weak(previousOwner, thisThread) || previousOwner == thisThread)
         {
@@ -1078,12 +1384,17 @@ void KeUnlockL2()
 
 bool KeSetEvent(XKEVENT* pEvent, uint32_t Increment, bool Wait)
 {
-    bool result = QueryKernelObject<Event>(*pEvent)->Set();
+    return QueryKernelObject<Event>(*pEvent)->Set();
+}
 
-    ++g_keSetEventGeneration;
-    g_keSetEventGeneration.notify_all();
+void SetKernelEvent(uint32_t handle)
+{
+    GetKernelObject<Event>(handle)->Set();
+}
 
-    return result;
+void ResetKernelEvent(uint32_t handle)
+{
+    GetKernelObject<Event>(handle)->Reset();
 }
 
 bool KeResetEvent(XKEVENT* pEvent)
@@ -1093,26 +1404,15 @@ bool KeResetEvent(XKEVENT* pEvent)
 
 uint32_t KeWaitForSingleObject(XDISPATCHER_HEADER* Object, uint32_t WaitReason, uint32_t WaitMode, bool Alertable, be<int64_t>* Timeout)
 {
-    const uint32_t timeout = GuestTimeoutToMilliseconds(Timeout);
-    assert(timeout == INFINITE);
-
-    switch (Object->Type)
-    {
-        case 0:
-        case 1:
-            QueryKernelObject<Event>(*Object)->Wait(timeout);
-            break;
+    TraceScope traceScope("KeWaitForSingleObject");
 
-        case 5:
-            QueryKernelObject<Semaphore>(*Object)->Wait(timeout);
-            break;
+    const uint32_t timeout = GuestTimeoutToMilliseconds(Timeout);
 
-        default:
-            assert(false && "Unrecognized kernel object type.");
-            return STATUS_TIMEOUT;
-    }
+    auto* object = QueryWaitableObject(*Object);
+    if (object == nullptr)
+        return STATUS_TIMEOUT;
 
-    return STATUS_SUCCESS;
+    return object->Wait(timeout);
 }
 
 static std::vector<size_t> g_tlsFreeIndices;
@@ -1673,41 +1973,21 @@ void NetDll_XNetGetTitleXnAddr()
 
 uint32_t KeWaitForMultipleObjects(uint32_t Count, xpointer<XDISPATCHER_HEADER>* Objects, uint32_t WaitType, uint32_t WaitReason, uint32_t WaitMode, uint32_t Alertable, be<int64_t>* Timeout)
 {
-    // FIXME: This function is only accounting for events.
-
-    const uint64_t timeout = GuestTimeoutToMilliseconds(Timeout);
-    assert(timeout == INFINITE);
-
-    if (WaitType == 0) // Wait all
-    {
-        for (size_t i = 0; i < Count; i++)
-            QueryKernelObject<Event>(*Objects[i])->Wait(timeout);
-    }
-    else
-    {
-        thread_local std::vector<Event*> s_events;
-        s_events.resize(Count);
+    TraceScope traceScope("KeWaitForMultipleObjects");
 
-        for (size_t i = 0; i < Count; i++)
-            s_events[i] = QueryKernelObject<Event>(*Objects[i]);
+    const uint32_t timeout = GuestTimeoutToMilliseconds(Timeout);
 
-        while (true)
-        {
-            uint32_t generation = g_keSetEventGeneration.load();
+    thread_local std::vector<WaitableObject*> s_objects;
+    s_objects.resize(Count);
 
-            for (size_t i = 0; i < Count; i++)
-            {
-                if (s_events[i]->Wait(0) == STATUS_SUCCESS)
-                {
-                    return STATUS_WAIT_0 + i;
-                }
-            }
-
-            g_keSetEventGeneration.wait(generation);
-        }
+    for (size_t i = 0; i < Count; i++)
+    {
+        s_objects[i] = QueryWaitableObject(*Objects[i]);
+        if (s_objects[i] == nullptr)
+            return STATUS_TIMEOUT;
     }
 
-    return STATUS_SUCCESS;
+    return WaitForObjects(s_objects.data(), Count, WaitType == 0, timeout);
 }
 
 uint32_t KeRaiseIrqlToDpcLevel()
@@ -8,14 +8,361 @@
 #include <os/logger.h>
 #include <user/config.h>
 #include <user/paths.h>
+#include <user/path_index.h>
+#include <utils/trace.h>
 #include <stdafx.h>
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// How far ahead of a read from a mapped file the OS gets asked to read in.
+static constexpr uint64_t MAPPED_FILE_READ_AHEAD_SIZE = 4 * 1024 * 1024;
+
+#ifndef _WIN32
+static const uint64_t g_pageSize = uint64_t(sysconf(_SC_PAGESIZE));
+#endif
+
+// Reads and writes go straight to the OS at an explicit offset, so several threads can
+// read from the same file at once and there is no stream buffer to copy through.
+// Overlapped reads hold their own reference to it, so the guest can close its handle
+// while reads are still in flight and the last of them closes the file instead.
+struct FileDescriptor
+{
+#ifdef _WIN32
+    HANDLE handle = INVALID_HANDLE_VALUE;
+#else
+    int fd = -1;
+#endif
+
+    // Read-only game and DLC files can get mapped, turning reads into a copy out of the page cache.
+    // It's opt-in, as a mapped file that gets truncated or whose drive goes away crashes on access
+    // instead of failing the read.
+    const uint8_t* mapping = nullptr;
+    uint64_t mappingSize = 0;
+#ifdef _WIN32
+    HANDLE mappingHandle = nullptr;
+#endif
+
+    ~FileDescriptor()
+    {
+#ifdef _WIN32
+        if (mapping != nullptr)
+            UnmapViewOfFile(mapping);
+
+        if (mappingHandle != nullptr)
+            CloseHandle(mappingHandle);
+
+        if (handle != INVALID_HANDLE_VALUE)
+            CloseHandle(handle);
+#else
+        if (mapping != nullptr)
+            munmap((void*)mapping, mappingSize);
+
+        if (fd != -1)
+            close(fd);
+#endif
+    }
+
+    void Map()
+    {
+        int64_t size = GetSize();
+        if (size <= 0)
+            return;
+
+#ifdef _WIN32
+        mappingHandle = CreateFileMappingW(handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mappingHandle == nullptr)
+            return;
+
+        mapping = (const uint8_t*)MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0);
+        if (mapping == nullptr)
+        {
+            CloseHandle(mappingHandle);
+            mappingHandle = nullptr;
+            return;
+        }
+
+        mappingSize = uint64_t(size);
+#else
+        void* result = mmap(nullptr, size_t(size), PROT_READ, MAP_SHARED, fd, 0);
+        if (result == MAP_FAILED)
+            return;
+
+        mapping = (const uint8_t*)result;
+        mappingSize = uint64_t(size);
+
+        madvise(result, mappingSize, MADV_SEQUENTIAL);
+        madvise(result, std::min(mappingSize, MAPPED_FILE_READ_AHEAD_SIZE), MADV_WILLNEED);
+#endif
+    }
+
+    int64_t ReadMapped(void* buffer, uint32_t size, uint64_t offset)
+    {
+        if (offset >= mappingSize)
+            return 0;
+
+        uint64_t bytesRead = std::min<uint64_t>(size, mappingSize - offset);
+        memcpy(buffer, mapping + offset, bytesRead);
+
+#ifndef _WIN32
+        uint64_t readAheadOffset = offset + bytesRead;
+        if (readAheadOffset < mappingSize)
+        {
+            // madvise wants a page aligned address.
+            uint64_t alignedOffset = readAheadOffset & ~(g_pageSize - 1);
+            madvise((void*)(mapping + alignedOffset), std::min(mappingSize - alignedOffset, MAPPED_FILE_READ_AHEAD_SIZE), MADV_WILLNEED);
+        }
+#endif
+
+        return int64_t(bytesRead);
+    }
+
+    bool Open(const std::filesystem::path& filePath, bool read, bool write)
+    {
+#ifdef _WIN32
+        DWORD desiredAccess = (read ? GENERIC_READ : 0) | (write ? GENERIC_WRITE : 0);
+        DWORD creationDisposition = (write && !read) ? CREATE_ALWAYS : OPEN_EXISTING;
+        DWORD flags = write ? FILE_ATTRIBUTE_NORMAL : FILE_FLAG_SEQUENTIAL_SCAN;
+
+        handle = CreateFileW(filePath.c_str(), desiredAccess, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, creationDisposition, flags, nullptr);
+        return handle != INVALID_HANDLE_VALUE;
+#else
+        // Same semantics as the file stream this replaced, writing without reading truncates.
+        int flags = O_CLOEXEC;
+
+        if (read && write)
+            flags |= O_RDWR;
+        else if (write)
+            flags |= O_WRONLY | O_CREAT | O_TRUNC;
+        else
+            flags |= O_RDONLY;
+
+        fd = open(filePath.c_str(), flags, 0644);
+        return fd != -1;
+#endif
+    }
+
+    // Returns the amount of bytes read, which is only less than requested at the end of the file, or -1 on error.
+    int64_t Read(void* buffer, uint32_t size, uint64_t offset)
+    {
+        if (mapping != nullptr)
+            return ReadMapped(buffer, size, offset);
+
+#ifdef _WIN32
+        OVERLAPPED overlapped{};
+        overlapped.Offset = DWORD(offset);
+        overlapped.OffsetHigh = DWORD(offset >> 32U);
+
+        DWORD bytesRead = 0;
+        if (!ReadFile(handle, buffer, size, &bytesRead, &overlapped) && GetLastError() != ERROR_HANDLE_EOF)
+            return -1;
+
+        return bytesRead;
+#else
+        uint32_t totalBytesRead = 0;
+
+        while (totalBytesRead < size)
+        {
+            ssize_t bytesRead = pread(fd, (uint8_t*)buffer + totalBytesRead, size - totalBytesRead, off_t(offset + totalBytesRead));
+            if (bytesRead < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+
+                return -1;
+            }
+
+            if (bytesRead == 0)
+                break;
+
+            totalBytesRead += uint32_t(bytesRead);
+        }
+
+        return totalBytesRead;
+#endif
+    }
+
+    int64_t Write(const void* buffer, uint32_t size, uint64_t offset)
+    {
+#ifdef _WIN32
+        OVERLAPPED overlapped{};
+        overlapped.Offset = DWORD(offset);
+        overlapped.OffsetHigh = DWORD(offset >> 32U);
+
+        DWORD bytesWritten = 0;
+        if (!WriteFile(handle, buffer, size, &bytesWritten, &overlapped))
+            return -1;
+
+        return bytesWritten;
+#else
+        uint32_t totalBytesWritten = 0;
+
+        while (totalBytesWritten < size)
+        {
+            ssize_t bytesWritten = pwrite(fd, (const uint8_t*)buffer + totalBytesWritten, size - totalBytesWritten, off_t(offset + totalBytesWritten));
+            if (bytesWritten < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+
+                return -1;
+            }
+
+            totalBytesWritten += uint32_t(bytesWritten);
+        }
+
+        return totalBytesWritten;
+#endif
+    }
+
+    int64_t GetSize()
+    {
+        if (mapping != nullptr)
+            return int64_t(mappingSize);
+
+#ifdef _WIN32
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(handle, &fileSize))
+            return -1;
+
+        return fileSize.QuadPart;
+#else
+        struct stat fileStat;
+        if (fstat(fd, &fileStat) != 0)
+            return -1;
+
+        return fileStat.st_size;
+#endif
+    }
+};
+
 struct FileHandle : KernelObject
 {
-    std::fstream stream;
+    std::shared_ptr<FileDescriptor> descriptor = std::make_shared<FileDescriptor>();
+    std::atomic<uint64_t> position;
     std::filesystem::path path;
+
+    // Returns the new position, or -1 if it would be negative.
+    int64_t Seek(int64_t distance, uint32_t moveMethod)
+    {
+        int64_t base = 0;
+
+        switch (moveMethod)
+        {
+        case FILE_BEGIN:
+            break;
+        case FILE_CURRENT:
+            base = int64_t(position.load());
+            break;
+        case FILE_END:
+            base = descriptor->GetSize();
+            if (base < 0)
+                return -1;
+            break;
+        default:
+            assert(false && "Unknown move method.");
+            break;
+        }
+
+        int64_t newPosition = base + distance;
+        if (newPosition < 0)
+            return -1;
+
+        position = uint64_t(newPosition);
+        return newPosition;
+    }
 };
 
+// Overlapped reads are completed on a small pool of threads, so the guest can keep
+// decompressing and parsing while archives stream in. Completion routines get called
+// on the pool thread as well, instead of as an APC on the thread that issued the read.
+struct FileReadRequest
+{
+    std::shared_ptr<FileDescriptor> file;
+    void* buffer;
+    uint32_t size;
+    uint64_t offset;
+    XOVERLAPPED* overlapped;
+    uint32_t completionRoutine;
+
+    // Prefetches are queued without a file handle.
+    std::filesystem::path prefetchPath;
+};
+
+static constexpr size_t FILE_READ_THREAD_COUNT = 2;
+static constexpr uint32_t STATUS_IO_DEVICE_ERROR_VALUE = 0xC0000185;
+static constexpr uint32_t ERROR_READ_FAULT_VALUE = 0x1E;
+
+static moodycamel::BlockingConcurrentQueue<FileReadRequest> g_fileReadQueue;
+
+static void CompleteFileRead(const FileReadRequest& request)
+{
+    TraceScope traceScope("File Read");
+
+    int64_t bytesRead = request.file->Read(request.buffer, request.size, request.offset);
+    uint32_t status = bytesRead < 0 ? STATUS_IO_DEVICE_ERROR_VALUE : STATUS_SUCCESS;
+    uint32_t numberOfBytesRead = bytesRead < 0 ? 0 : uint32_t(bytesRead);
+
+    // The guest may poll Internal instead of waiting on the event, so it must be written last.
+    request.overlapped->InternalHigh = numberOfBytesRead;
+    std::atomic_ref(*reinterpret_cast<uint32_t*>(&request.overlapped->Internal)).store(ByteSwap(status), std::memory_order_release);
+
+    if (request.overlapped->hEvent != 0)
+        SetKernelEvent(request.overlapped->hEvent.get());
+
+    if (request.completionRoutine != 0)
+        GuestToHostFunction<void>(request.completionRoutine, status == STATUS_SUCCESS ? ERROR_SUCCESS : ERROR_READ_FAULT_VALUE, numberOfBytesRead, g_memory.MapVirtual(request.overlapped));
+}
+
+static void PrefetchFile(const std::filesystem::path& path);
+
+static void FileReadThread()
+{
+    GuestThreadContext ctx(0);
+
+    Trace::SetThreadName("File Read Thread");
+
+    while (true)
+    {
+        FileReadRequest request;
+        g_fileReadQueue.wait_dequeue(request);
+
+        if (request.file == nullptr)
+            PrefetchFile(request.prefetchPath);
+        else
+            CompleteFileRead(request);
+    }
+}
+
+static void StartFileReadThreads()
+{
+    static std::once_flag s_startThreads;
+
+    std::call_once(s_startThreads, []()
+        {
+            for (size_t i = 0; i < FILE_READ_THREAD_COUNT; i++)
+                std::thread(FileReadThread).detach();
+        });
+}
+
+static void QueueFileRead(const FileReadRequest& request)
+{
+    StartFileReadThreads();
+
+    request.overlapped->InternalHigh = 0;
+    request.overlapped->Internal = STATUS_PENDING;
+
+    // Like on Windows, the event stays unsignaled until the read completes.
+    if (request.overlapped->hEvent != 0)
+        ResetKernelEvent(request.overlapped->hEvent.get());
+
+    g_fileReadQueue.enqueue(request);
+}
+
 struct FindHandle : KernelObject
 {
     std::error_code ec;
@@ -81,6 +428,15 @@ struct FindHandle : KernelObject
     }
 };
 
+static bool IsGameDataPath(const std::filesystem::path& path)
+{
+    static const std::u8string s_gameRoot = (GetGamePath() / "game").u8string();
+    static const std::u8string s_dlcRoot = (GetGamePath() / "dlc").u8string();
+
+    std::u8string pathU8 = path.u8string();
+    return pathU8.starts_with(s_gameRoot) || pathU8.starts_with(s_dlcRoot);
+}
+
 FileHandle* XCreateFileA
 (
     const char* lpFileName,
@@ -96,28 +452,13 @@ FileHandle* XCreateFileA
     assert(((dwCreationDisposition & ~(CREATE_NEW | CREATE_ALWAYS)) == 0) && "Unknown creation disposition bits.");
 
     std::filesystem::path filePath = FileSystem::ResolvePath(lpFileName, true);
-    std::fstream fileStream;
-    std::ios::openmode fileOpenMode = std::ios::binary;
-    if (dwDesiredAccess & (GENERIC_READ | FILE_READ_DATA))
-    {
-        fileOpenMode |= std::ios::in;
-    }
-
-    if (dwDesiredAccess & GENERIC_WRITE)
-    {
-        fileOpenMode |= std::ios::out;
-    }
+    bool read = (dwDesiredAccess & (GENERIC_READ | FILE_READ_DATA)) != 0;
+    bool write = (dwDesiredAccess & GENERIC_WRITE) != 0;
 
-    fileStream.open(filePath, fileOpenMode);
-
-    if (!fileStream.is_open()) {
-        std::filesystem::path cachedPath = FindInPathCache(filePath.string());
-        if (!cachedPath.empty()) {
-            fileStream.open(cachedPath, fileOpenMode);
-        }
-    }
+    FileHandle *fileHandle = CreateKernelObject<FileHandle>();
+    bool isOpen = fileHandle->descriptor->Open(filePath, read, write);
 
-    if (!fileStream.is_open())
+    if (!isOpen)
     {
 #ifdef _WIN32
         GuestThread::SetLastError(GetLastError());
@@ -136,20 +477,21 @@ FileHandle* XCreateFileA
             break;
         }
 #endif
+        DestroyKernelObject(fileHandle);
         return GetInvalidKernelObject<FileHandle>();
     }
 
-    FileHandle *fileHandle = CreateKernelObject<FileHandle>();
-    fileHandle->stream = std::move(fileStream);
+    if (Config::MemoryMappedGameFiles && read && !write && IsGameDataPath(filePath))
+        fileHandle->descriptor->Map();
+
     fileHandle->path = std::move(filePath);
     return fileHandle;
 }
 
 static uint32_t XGetFileSizeA(FileHandle* hFile, be<uint32_t>* lpFileSizeHigh)
 {
-    std::error_code ec;
-    auto fileSize = std::filesystem::file_size(hFile->path, ec);
-    if (!ec)
+    int64_t fileSize = hFile->descriptor->GetSize();
+    if (fileSize >= 0)
     {
         if (lpFileSizeHigh != nullptr)
         {
@@ -164,9 +506,8 @@ static uint32_t XGetFileSizeA(FileHandle* hFile, be<uint32_t>* lpFileSizeHigh)
 
 uint32_t XGetFileSizeExA(FileHandle* hFile, LARGE_INTEGER* lpFileSize)
 {
-    std::error_code ec;
-    auto fileSize = std::filesystem::file_size(hFile->path, ec);
-    if (!ec)
+    int64_t fileSize = hFile->descriptor->GetSize();
+    if (fileSize >= 0)
     {
         if (lpFileSize != nullptr)
         {
@@ -188,106 +529,71 @@ uint32_t XReadFile
     XOVERLAPPED* lpOverlapped
 )
 {
-    uint32_t result = FALSE;
+    uint64_t offset = hFile->position;
     if (lpOverlapped != nullptr)
+        offset = lpOverlapped->Offset + (uint64_t(lpOverlapped->OffsetHigh.get()) << 32U);
+
+    // Without an event the guest can only poll, so there is nothing to gain from going asynchronous.
+    if (lpOverlapped != nullptr && lpOverlapped->hEvent != 0)
     {
-        std::streamoff streamOffset = lpOverlapped->Offset + (std::streamoff(lpOverlapped->OffsetHigh.get()) << 32U);
-        hFile->stream.clear();
-        hFile->stream.seekg(streamOffset, std::ios::beg);
-        if (hFile->stream.bad())
-        {
-            return FALSE;
-        }
+        hFile->position = offset + nNumberOfBytesToRead;
+
+        QueueFileRead({ hFile->descriptor, lpBuffer, nNumberOfBytesToRead, offset, lpOverlapped, 0 });
+        GuestThread::SetLastError(ERROR_IO_PENDING);
+
+        return FALSE;
     }
 
-    uint32_t numberOfBytesRead;
-    hFile->stream.read((char *)(lpBuffer), nNumberOfBytesToRead);
-    if (!hFile->stream.bad())
+    int64_t bytesRead = hFile->descriptor->Read(lpBuffer, nNumberOfBytesToRead, offset);
+    if (bytesRead < 0)
+        return FALSE;
+
+    uint32_t numberOfBytesRead = uint32_t(bytesRead);
+
+    // The file stream this replaced moved the file pointer for overlapped reads too.
+    hFile->position = offset + numberOfBytesRead;
+
+    if (lpOverlapped != nullptr)
     {
-        numberOfBytesRead = uint32_t(hFile->stream.gcount());
-        result = TRUE;
+        lpOverlapped->Internal = 0;
+        lpOverlapped->InternalHigh = numberOfBytesRead;
     }
-
-    if (result)
+    else if (lpNumberOfBytesRead != nullptr)
     {
-        if (lpOverlapped != nullptr)
-        {
-            lpOverlapped->Internal = 0;
-            lpOverlapped->InternalHigh = numberOfBytesRead;
-        }
-        else if (lpNumberOfBytesRead != nullptr)
-        {
-            *lpNumberOfBytesRead = numberOfBytesRead;
-        }
+        *lpNumberOfBytesRead = numberOfBytesRead;
     }
 
-    return result;
+    return TRUE;
 }
 
 uint32_t XSetFilePointer(FileHandle* hFile, int32_t lDistanceToMove, be<int32_t>* lpDistanceToMoveHigh, uint32_t dwMoveMethod)
 {
     int32_t distanceToMoveHigh = lpDistanceToMoveHigh ? lpDistanceToMoveHigh->get() : 0;
-    std::streamoff streamOffset = lDistanceToMove + (std::streamoff(distanceToMoveHigh) << 32U);
-    std::fstream::seekdir streamSeekDir = {};
-    switch (dwMoveMethod)
-    {
-    case FILE_BEGIN:
-        streamSeekDir = std::ios::beg;
-        break;
-    case FILE_CURRENT:
-        streamSeekDir = std::ios::cur;
-        break;
-    case FILE_END:
-        streamSeekDir = std::ios::end;
-        break;
-    default:
-        assert(false && "Unknown move method.");
-        break;
-    }
-
-    hFile->stream.clear();
-    hFile->stream.seekg(streamOffset, streamSeekDir);
-    if (hFile->stream.bad())
+    int64_t distance = lDistanceToMove + (int64_t(distanceToMoveHigh) << 32U);
+
+    int64_t position = hFile->Seek(distance, dwMoveMethod);
+    if (position < 0)
     {
         return INVALID_SET_FILE_POINTER;
     }
 
-    std::streampos streamPos = hFile->stream.tellg();
     if (lpDistanceToMoveHigh != nullptr)
-        *lpDistanceToMoveHigh = int32_t(streamPos >> 32U);
+        *lpDistanceToMoveHigh = int32_t(position >> 32U);
 
-    return uint32_t(streamPos);
+    return uint32_t(position);
 }
 
 uint32_t XSetFilePointerEx(FileHandle* hFile, int32_t lDistanceToMove, LARGE_INTEGER* lpNewFilePointer, uint32_t dwMoveMethod)
 {
-    std::fstream::seekdir streamSeekDir = {};
-    switch (dwMoveMethod)
-    {
-    case FILE_BEGIN:
-        streamSeekDir = std::ios::beg;
-        break;
-    case FILE_CURRENT:
-        streamSeekDir = std::ios::cur;
-        break;
-    case FILE_END:
-        streamSeekDir = std::ios::end;
-        break;
-    default:
-        assert(false && "Unknown move method.");
-        break;
-    }
-
-    hFile->stream.clear();
-    hFile->stream.seekg(lDistanceToMove, streamSeekDir);
-    if (hFile->stream.bad())
+    int64_t position = hFile->Seek(lDistanceToMove, dwMoveMethod);
+    if (position < 0)
     {
         return FALSE;
     }
 
     if (lpNewFilePointer != nullptr)
     {
-        lpNewFilePointer->QuadPart = ByteSwap(int64_t(hFile->stream.tellg()));
+        lpNewFilePointer->QuadPart = ByteSwap(position);
     }
 
     return TRUE;
@@ -336,55 +642,139 @@ uint32_t XFindNextFileA(FindHandle* Handle, WIN32_FIND_DATAA* lpFindFileData)
 
 uint32_t XReadFileEx(FileHandle* hFile, void* lpBuffer, uint32_t nNumberOfBytesToRead, XOVERLAPPED* lpOverlapped, uint32_t lpCompletionRoutine)
 {
-    uint32_t result = FALSE;
-    uint32_t numberOfBytesRead;
-    std::streamoff streamOffset = lpOverlapped->Offset + (std::streamoff(lpOverlapped->OffsetHigh.get()) << 32U);
-    hFile->stream.clear();
-    hFile->stream.seekg(streamOffset, std::ios::beg);
-    if (hFile->stream.bad())
-        return FALSE;
+    uint64_t offset = lpOverlapped->Offset + (uint64_t(lpOverlapped->OffsetHigh.get()) << 32U);
 
-    hFile->stream.read((char *)(lpBuffer), nNumberOfBytesToRead);
-    if (!hFile->stream.bad())
-    {
-        numberOfBytesRead = uint32_t(hFile->stream.gcount());
-        result = TRUE;
-    }
+    hFile->position = offset + nNumberOfBytesToRead;
 
-    if (result)
-    {
-        lpOverlapped->Internal = 0;
-        lpOverlapped->InternalHigh = numberOfBytesRead;
-    }
+    QueueFileRead({ hFile->descriptor, lpBuffer, nNumberOfBytesToRead, offset, lpOverlapped, lpCompletionRoutine });
 
-    return result;
+    return TRUE;
 }
 
 uint32_t XGetFileAttributesA(const char* lpFileName)
 {
     std::filesystem::path filePath = FileSystem::ResolvePath(lpFileName, true);
     if (std::filesystem::is_directory(filePath))
+    {
         return FILE_ATTRIBUTE_DIRECTORY;
+    }
     else if (std::filesystem::is_regular_file(filePath))
+    {
+        // The game checks for archives right before opening them, so get a head start on reading them in.
+        if (filePath.extension() == ".arc" && IsGameDataPath(filePath))
+            FileSystem::Prefetch(filePath);
+
         return FILE_ATTRIBUTE_NORMAL;
+    }
     else
+    {
         return INVALID_FILE_ATTRIBUTES;
+    }
 }
 
 uint32_t XWriteFile(FileHandle* hFile, const void* lpBuffer, uint32_t nNumberOfBytesToWrite, be<uint32_t>* lpNumberOfBytesWritten, void* lpOverlapped)
 {
     assert(lpOverlapped == nullptr && "Overlapped not implemented.");
 
-    hFile->stream.write((const char *)(lpBuffer), nNumberOfBytesToWrite);
-    if (hFile->stream.bad())
+    uint64_t offset = hFile->position;
+
+    int64_t bytesWritten = hFile->descriptor->Write(lpBuffer, nNumberOfBytesToWrite, offset);
+    if (bytesWritten < 0)
         return FALSE;
 
+    hFile->position = offset + uint64_t(bytesWritten);
+
     if (lpNumberOfBytesWritten != nullptr)
-        *lpNumberOfBytesWritten = uint32_t(hFile->stream.gcount());
+        *lpNumberOfBytesWritten = uint32_t(bytesWritten);
 
     return TRUE;
 }
 
+#ifdef _WIN32
+// PrefetchVirtualMemory only queues up the reads, so the views of the last
+// few prefetched files are kept around to not cut them short by unmapping.
+struct PrefetchedFile
+{
+    HANDLE mappingHandle = nullptr;
+    void* mapping = nullptr;
+
+    ~PrefetchedFile()
+    {
+        if (mapping != nullptr)
+            UnmapViewOfFile(mapping);
+
+        if (mappingHandle != nullptr)
+            CloseHandle(mappingHandle);
+    }
+};
+
+static constexpr size_t PREFETCHED_FILE_COUNT = 4;
+
+static Mutex g_prefetchedFileMutex;
+static std::unique_ptr<PrefetchedFile> g_prefetchedFiles[PREFETCHED_FILE_COUNT];
+static size_t g_prefetchedFileIndex;
+#endif
+
+static void PrefetchFile(const std::filesystem::path& path)
+{
+    TraceScope traceScope("File Prefetch");
+
+#if defined(_WIN32)
+    HANDLE handle = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (handle == INVALID_HANDLE_VALUE)
+        return;
+
+    auto prefetchedFile = std::make_unique<PrefetchedFile>();
+    LARGE_INTEGER fileSize;
+
+    if (GetFileSizeEx(handle, &fileSize) && fileSize.QuadPart > 0)
+    {
+        prefetchedFile->mappingHandle = CreateFileMappingW(handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (prefetchedFile->mappingHandle != nullptr)
+            prefetchedFile->mapping = MapViewOfFile(prefetchedFile->mappingHandle, FILE_MAP_READ, 0, 0, 0);
+    }
+
+    // The mapping keeps its own reference to the file.
+    CloseHandle(handle);
+
+    if (prefetchedFile->mapping == nullptr)
+        return;
+
+    WIN32_MEMORY_RANGE_ENTRY range{ prefetchedFile->mapping, size_t(fileSize.QuadPart) };
+    PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+
+    std::lock_guard lock(g_prefetchedFileMutex);
+    g_prefetchedFiles[g_prefetchedFileIndex] = std::move(prefetchedFile);
+    g_prefetchedFileIndex = (g_prefetchedFileIndex + 1) % PREFETCHED_FILE_COUNT;
+#else
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return;
+
+#if defined(__APPLE__)
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) == 0)
+    {
+        radvisory advisory{ 0, int(std::min<off_t>(fileStat.st_size, INT_MAX)) };
+        fcntl(fd, F_RDADVISE, &advisory);
+    }
+#else
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+#endif
+
+    close(fd);
+#endif
+}
+
+void FileSystem::Prefetch(const std::filesystem::path& path)
+{
+    StartFileReadThreads();
+
+    FileReadRequest request{};
+    request.prefetchPath = path;
+    g_fileReadQueue.enqueue(std::move(request));
+}
+
 std::filesystem::path FileSystem::ResolvePath(const std::string_view& path, bool checkForMods)
 {
     LOGF_IMPL(Utility, "Game", "Loading file: \"{}\"", path.data());
@@ -426,6 +816,11 @@ std::filesystem::path FileSystem::ResolvePath(const std::string_view& path, bool
 
     std::replace(builtPath.begin(), builtPath.end(), '\\', '/');
 
+    // Guest paths don't necessarily match the casing of the files on disk.
+    std::filesystem::path indexedPath = PathIndex::Find(builtPath);
+    if (!indexedPath.empty())
+        return indexedPath;
+
     return std::u8string_view((const char8_t*)builtPath.c_str());
 }
 
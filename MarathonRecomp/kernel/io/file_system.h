@@ -3,4 +3,7 @@
 struct FileSystem
 {
     static std::filesystem::path ResolvePath(const std::string_view& path, bool checkForMods);
+
+    // Has the file read threads ask the OS to start reading a file into the page cache.
+    static void Prefetch(const std::filesystem::path& path);
 };
@@ -2,8 +2,6 @@
 #include "xdm.h"
 #include "freelist.h"
 
-Mutex g_kernelLock;
-
 void DestroyKernelObject(KernelObject* obj)
 {
     obj->~KernelObject();
@@ -15,6 +15,7 @@
 #define STATUS_WAIT_0              0x00000000
 #define STATUS_USER_APC            0x000000C0
 #define STATUS_TIMEOUT             0x00000102
+#define STATUS_PENDING             0x00000103
 #define STATUS_NOT_IMPLEMENTED     0xC0000002
 #define STATUS_SEMAPHORE_LIMIT_EXCEEDED             0xC0000047
 #define STATUS_FAIL_CHECK          0xC0000229
@@ -43,6 +44,7 @@
 #define ERROR_FILE_EXISTS          0x50
 #define ERROR_CALL_NOT_IMPLEMENTED 0x78
 #define ERROR_BAD_ARGUMENTS        0xA0
+#define ERROR_IO_PENDING           0x3E5
 #define ERROR_TOO_MANY_POSTS       0x12A
 #define ERROR_DEVICE_NOT_CONNECTED 0x48F
 #define PAGE_READWRITE             0x04
@@ -130,30 +132,69 @@ inline T* GetInvalidKernelObject()
     return reinterpret_cast<T*>(g_memory.Translate(GUEST_INVALID_HANDLE_VALUE));
 }
 
-extern Mutex g_kernelLock;
+// Written to the guest list head by the thread that won the race to create the
+// host object, until the object handle is stored in Blink.
+#define OBJECT_INITIALIZING_SIGNATURE (uint32_t)'XBOI'
+
+inline std::atomic_ref<uint32_t> GetKernelObjectSignature(XDISPATCHER_HEADER& header)
+{
+    return std::atomic_ref<uint32_t>(*reinterpret_cast<uint32_t*>(&header.WaitListHead.Flink));
+}
 
 template<typename T>
 inline T* QueryKernelObject(XDISPATCHER_HEADER& header)
 {
-    std::lock_guard guard{ g_kernelLock };
-    if (header.WaitListHead.Flink != OBJECT_SIGNATURE)
+    auto signature = GetKernelObjectSignature(header);
+    auto flink = signature.load(std::memory_order_acquire);
+
+    if (flink == ByteSwap(OBJECT_SIGNATURE))
+        return static_cast<T*>(g_memory.Translate(header.WaitListHead.Blink.get()));
+
+    if (flink != ByteSwap(OBJECT_INITIALIZING_SIGNATURE))
     {
-        header.WaitListHead.Flink = OBJECT_SIGNATURE;
+        // Create the object up front so the window in which other threads have to wait is only a couple of stores.
         auto* obj = CreateKernelObject<T>(reinterpret_cast<typename T::guest_type*>(&header));
-        header.WaitListHead.Blink = g_memory.MapVirtual(obj);
 
-        return obj;
+        if (signature.compare_exchange_strong(flink, ByteSwap(OBJECT_INITIALIZING_SIGNATURE), std::memory_order_acquire))
+        {
+            header.WaitListHead.Blink = g_memory.MapVirtual(obj);
+            signature.store(ByteSwap(OBJECT_SIGNATURE), std::memory_order_release);
+
+            return obj;
+        }
+
+        // Another thread got there first, so use its object instead.
+        DestroyKernelObject(obj);
     }
 
+    while ((flink = signature.load(std::memory_order_acquire)) != ByteSwap(OBJECT_SIGNATURE))
+        std::this_thread::yield();
+
     return static_cast<T*>(g_memory.Translate(header.WaitListHead.Blink.get()));
 }
 
+// Signal and reset events by their guest handle, for completing requests outside of the imports.
+void SetKernelEvent(uint32_t handle);
+void ResetKernelEvent(uint32_t handle);
+
 // Get object without initialisation
 template<typename T>
 inline T* TryQueryKernelObject(XDISPATCHER_HEADER& header)
 {
-    if (header.WaitListHead.Flink != OBJECT_SIGNATURE)
+    if (GetKernelObjectSignature(header).load(std::memory_order_acquire) != ByteSwap(OBJECT_SIGNATURE))
         return nullptr;
 
     return static_cast<T*>(g_memory.Translate(header.WaitListHead.Blink.get()));
-}
\ No newline at end of file
+}
+
+struct CriticalSectionStats
+{
+    uint32_t address;
+    uint32_t contentions;
+    uint32_t spinAcquisitions;
+    uint32_t parks;
+    uint32_t averageSpins;
+};
+
+// Only critical sections that have been contended at least once are reported, sorted by contention.
+std::vector<CriticalSectionStats> GetCriticalSectionStats();
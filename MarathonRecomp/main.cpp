@@ -17,6 +17,7 @@
 #include <hid/hid.h>
 #include <user/config.h>
 #include <user/paths.h>
+#include <user/path_index.h>
 #include <user/registry.h>
 #include <kernel/xdbf.h>
 #include <install/installer.h>
@@ -28,6 +29,7 @@
 #include <ui/installer_wizard.h>
 #include <mod/mod_loader.h>
 #include <preload_executable.h>
+#include <utils/trace.h>
 #include <iostream>
 
 #ifdef _WIN32
@@ -74,7 +76,7 @@ void KiSystemStartup()
     const auto gameContent = XamMakeContent(XCONTENTTYPE_RESERVED, "Game");
     const std::string gamePath = (const char*)(GetGamePath() / "game").u8string().c_str();
 
-    BuildPathCache(gamePath);
+    PathIndex::Build({ GetGamePath() / "game", GetGamePath() / "dlc" });
 
     XamRegisterContent(gameContent, gamePath);
 
@@ -191,6 +193,9 @@ int main(int argc, char *argv[])
         forceInstallationCheck = forceInstallationCheck || (strcmp(argv[i], "--install-check") == 0);
         graphicsApiRetry = graphicsApiRetry || (strcmp(argv[i], "--graphics-api-retry") == 0);
 
+        if (strcmp(argv[i], "--trace") == 0)
+            Trace::StartRecording();
+
         if (strcmp(argv[i], "--sdl-video-driver") == 0)
         {
             if ((i + 1) < argc)
@@ -6,8 +6,10 @@
 #include <kernel/heap.h>
 #include <user/config.h>
 #include <user/paths.h>
+#include <os/file_watcher.h>
 #include <os/logger.h>
 #include <os/process.h>
+#include <utils/trace.h>
 #include <xxHashMap.h>
 
 enum class ModType
@@ -26,6 +28,87 @@ struct Mod
 
 static std::vector<Mod> g_mods;
 
+// Every file and directory of every mod keyed by its lower case path relative to the include
+// directory. Entries of mods with a higher priority are added first and take precedence.
+struct ModOverlay
+{
+    xxHashMap<std::filesystem::path> files;
+};
+
+static Mutex g_overlayMutex;
+static std::shared_ptr<const ModOverlay> g_overlay;
+static std::atomic<uint32_t> g_overlayGeneration;
+
+static XXH64_hash_t HashOverlayPath(std::string_view path)
+{
+    thread_local std::string folded;
+    folded.resize(path.size());
+
+    for (size_t i = 0; i < path.size(); i++)
+        folded[i] = path[i] == '\\' ? '/' : char(std::tolower(static_cast<unsigned char>(path[i])));
+
+    return XXH3_64bits(folded.data(), folded.size());
+}
+
+static bool CanBeMerged(std::string_view path)
+{
+    return path.ends_with(".arl") ||
+        (path.size() >= 6 && path.substr(path.size() - 6, 4) == ".ar.") ||
+        path.ends_with(".ar");
+}
+
+static std::shared_ptr<const ModOverlay> BuildOverlay()
+{
+    auto overlay = std::make_shared<ModOverlay>();
+
+    for (auto& mod : g_mods)
+    {
+        for (auto& includeDir : mod.includeDirs)
+        {
+            std::error_code ec;
+            std::filesystem::recursive_directory_iterator iterator(includeDir, ec);
+
+            for (; !ec && iterator != std::filesystem::recursive_directory_iterator(); iterator.increment(ec))
+            {
+                auto& entry = *iterator;
+
+                std::u8string relativePathU8 = entry.path().lexically_relative(includeDir).generic_u8string();
+                std::string_view relativePath((const char*)relativePathU8.c_str(), relativePathU8.size());
+
+                // Directories are indexed too, so folders that only exist in mods can be found by the game.
+                // Merged archives are handled by the mod itself, unless they're marked as read-only.
+                if (!entry.is_directory(ec) && mod.type == ModType::UMM && mod.merge && CanBeMerged(relativePath) && !mod.readOnly.contains(std::filesystem::path(relativePathU8)))
+                    continue;
+
+                overlay->files.emplace(HashOverlayPath(relativePath), entry.path());
+            }
+        }
+    }
+
+    return overlay;
+}
+
+static void ModWatcherThread(os::file_watcher::Watcher* watcher)
+{
+    Trace::SetThreadName("Mod Watcher Thread");
+
+    while (os::file_watcher::Wait(watcher))
+    {
+        auto overlay = BuildOverlay();
+        size_t fileCount = overlay->files.size();
+        {
+            std::lock_guard lock(g_overlayMutex);
+            g_overlay = std::move(overlay);
+        }
+
+        g_overlayGeneration.fetch_add(1, std::memory_order_release);
+
+        LOGF_IMPL(Utility, "Mod Loader", "Mod files changed, reindexed {} files and directories.", fileCount);
+    }
+
+    LOG_IMPL(Warning, "Mod Loader", "Stopped watching mod files for changes.");
+}
+
 std::filesystem::path ModLoader::ResolvePath(std::string_view path)
 {
     std::string_view root;
@@ -53,36 +136,23 @@ std::filesystem::path ModLoader::ResolvePath(std::string_view path)
     if (g_mods.empty())
         return {};
 
-    thread_local xxHashMap<std::filesystem::path> s_cache;
-
-    XXH64_hash_t hash = XXH3_64bits(path.data(), path.size());
-    auto findResult = s_cache.find(hash);
-    if (findResult != s_cache.end())
-        return findResult->second;
+    // Only take the lock when the watcher has swapped the overlay since this thread last looked.
+    thread_local std::shared_ptr<const ModOverlay> s_overlay;
+    thread_local uint32_t s_overlayGeneration;
 
-    std::string pathStr(path);
-    std::replace(pathStr.begin(), pathStr.end(), '\\', '/');
-    std::filesystem::path fsPath(std::move(pathStr));
-
-    bool canBeMerged = 
-        path.find(".arl") == (path.size() - 4) ||
-        path.find(".ar.") == (path.size() - 6) ||
-        path.find(".ar") == (path.size() - 3);
-
-    for (auto& mod : g_mods)
+    uint32_t generation = g_overlayGeneration.load(std::memory_order_acquire);
+    if (s_overlay == nullptr || s_overlayGeneration != generation)
     {
-        if (mod.type == ModType::UMM && mod.merge && canBeMerged && !mod.readOnly.contains(fsPath))
-            continue;
-
-        for (auto& includeDir : mod.includeDirs)
-        {
-            std::filesystem::path modPath = includeDir / fsPath;
-            if (std::filesystem::exists(modPath))
-                return s_cache.emplace(hash, modPath).first->second;
-        }
+        std::lock_guard lock(g_overlayMutex);
+        s_overlay = g_overlay;
+        s_overlayGeneration = generation;
     }
 
-    return s_cache.emplace(hash, std::filesystem::path{}).first->second;
+    auto findResult = s_overlay->files.find(HashOverlayPath(path));
+    if (findResult != s_overlay->files.end())
+        return findResult->second;
+
+    return {};
 }
 
 std::vector<std::filesystem::path>* ModLoader::GetIncludeDirectories(size_t modIndex)
@@ -216,6 +286,23 @@ void ModLoader::Init()
             g_mods.emplace_back(std::move(mod));
     }
 
+    if (!g_mods.empty())
+    {
+        std::vector<std::filesystem::path> includeDirs;
+
+        for (auto& mod : g_mods)
+            includeDirs.insert(includeDirs.end(), mod.includeDirs.begin(), mod.includeDirs.end());
+
+        // Start watching first, so changes made while the overlay is built aren't missed.
+        auto watcher = os::file_watcher::Create(includeDirs);
+        g_overlay = BuildOverlay();
+
+        if (watcher != nullptr)
+            std::thread(ModWatcherThread, watcher).detach();
+        else
+            LOG_IMPL(Warning, "Mod Loader", "Failed to watch mod files for changes, the game needs to be restarted to pick them up.");
+    }
+
     auto codeCount = modsDbIni.get<size_t>("Codes", "CodeCount", 0);
 
     if (codeCount)
@@ -18,6 +18,11 @@ struct Mutex : CRITICAL_SECTION
         EnterCriticalSection(this);
     }
 
+    bool try_lock()
+    {
+        return TryEnterCriticalSection(this);
+    }
+
     void unlock()
     {
         LeaveCriticalSection(this);
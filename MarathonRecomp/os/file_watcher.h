@@ -0,0 +1,14 @@
+#pragma once
+
+namespace os::file_watcher
+{
+    struct Watcher;
+
+    // Watches the directories and everything below them for files and directories
+    // getting created, deleted or renamed. Watchers stay alive for the rest of the process.
+    // Returns nullptr if none of the directories could be watched.
+    Watcher* Create(const std::vector<std::filesystem::path>& directories);
+
+    // Blocks until there were changes since the last call. Returns false if watching stopped working.
+    bool Wait(Watcher* watcher);
+}
@@ -0,0 +1,91 @@
+#include <os/file_watcher.h>
+
+#include <sys/inotify.h>
+
+static constexpr uint32_t WATCH_MASK = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+struct os::file_watcher::Watcher
+{
+    int fd = -1;
+    ankerl::unordered_dense::map<int, std::filesystem::path> directories;
+};
+
+// inotify isn't recursive, so every directory below the watched ones needs a watch of its own.
+static void AddWatches(os::file_watcher::Watcher* watcher, const std::filesystem::path& directory)
+{
+    auto addWatch = [&](const std::filesystem::path& path)
+        {
+            int wd = inotify_add_watch(watcher->fd, path.c_str(), WATCH_MASK);
+            if (wd != -1)
+                watcher->directories[wd] = path;
+        };
+
+    addWatch(directory);
+
+    std::error_code ec;
+    std::filesystem::recursive_directory_iterator iterator(directory, ec);
+
+    for (; !ec && iterator != std::filesystem::recursive_directory_iterator(); iterator.increment(ec))
+    {
+        if (iterator->is_directory(ec))
+            addWatch(iterator->path());
+    }
+}
+
+os::file_watcher::Watcher* os::file_watcher::Create(const std::vector<std::filesystem::path>& directories)
+{
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd == -1)
+        return nullptr;
+
+    auto watcher = std::make_unique<Watcher>();
+    watcher->fd = fd;
+
+    for (auto& directory : directories)
+        AddWatches(watcher.get(), directory);
+
+    if (watcher->directories.empty())
+    {
+        close(fd);
+        return nullptr;
+    }
+
+    return watcher.release();
+}
+
+bool os::file_watcher::Wait(Watcher* watcher)
+{
+    alignas(inotify_event) char buffer[0x1000];
+    ssize_t size;
+
+    do
+    {
+        size = read(watcher->fd, buffer, sizeof(buffer));
+    }
+    while (size < 0 && errno == EINTR);
+
+    if (size <= 0)
+        return false;
+
+    for (char* ptr = buffer; ptr < buffer + size; )
+    {
+        auto event = reinterpret_cast<inotify_event*>(ptr);
+        ptr += sizeof(inotify_event) + event->len;
+
+        if ((event->mask & IN_IGNORED) != 0)
+        {
+            watcher->directories.erase(event->wd);
+            continue;
+        }
+
+        // New directories need watching before files get added to them.
+        if ((event->mask & IN_ISDIR) != 0 && (event->mask & (IN_CREATE | IN_MOVED_TO)) != 0 && event->len > 0)
+        {
+            auto findResult = watcher->directories.find(event->wd);
+            if (findResult != watcher->directories.end())
+                AddWatches(watcher, findResult->second / event->name);
+        }
+    }
+
+    return true;
+}
@@ -0,0 +1,92 @@
+#include <os/file_watcher.h>
+
+#include <CoreServices/CoreServices.h>
+#include <condition_variable>
+
+// How long FSEvents collects changes before reporting them, so a mod manager copying files doesn't trigger a reindex per file.
+static constexpr CFTimeInterval WATCH_LATENCY = 0.5;
+
+static constexpr FSEventStreamEventFlags WATCH_FLAGS = kFSEventStreamEventFlagItemCreated | kFSEventStreamEventFlagItemRemoved |
+    kFSEventStreamEventFlagItemRenamed | kFSEventStreamEventFlagMustScanSubDirs | kFSEventStreamEventFlagRootChanged;
+
+struct os::file_watcher::Watcher
+{
+    FSEventStreamRef stream = nullptr;
+    std::mutex mutex;
+    std::condition_variable condition;
+    bool isChanged = false;
+};
+
+static void StreamCallback(ConstFSEventStreamRef stream, void* info, size_t eventCount, void* eventPaths,
+    const FSEventStreamEventFlags* eventFlags, const FSEventStreamEventId* eventIds)
+{
+    auto watcher = reinterpret_cast<os::file_watcher::Watcher*>(info);
+    bool isChanged = false;
+
+    // File events also report content changes, which don't matter for the mod file index.
+    for (size_t i = 0; i < eventCount; i++)
+        isChanged |= (eventFlags[i] & WATCH_FLAGS) != 0;
+
+    if (!isChanged)
+        return;
+
+    {
+        std::lock_guard lock(watcher->mutex);
+        watcher->isChanged = true;
+    }
+
+    watcher->condition.notify_one();
+}
+
+os::file_watcher::Watcher* os::file_watcher::Create(const std::vector<std::filesystem::path>& directories)
+{
+    CFMutableArrayRef paths = CFArrayCreateMutable(nullptr, 0, &kCFTypeArrayCallBacks);
+
+    for (auto& directory : directories)
+    {
+        CFStringRef path = CFStringCreateWithFileSystemRepresentation(nullptr, directory.c_str());
+        if (path == nullptr)
+            continue;
+
+        CFArrayAppendValue(paths, path);
+        CFRelease(path);
+    }
+
+    auto watcher = new Watcher();
+    FSEventStreamContext context{ 0, watcher, nullptr, nullptr, nullptr };
+
+    if (CFArrayGetCount(paths) > 0)
+    {
+        watcher->stream = FSEventStreamCreate(nullptr, StreamCallback, &context, paths, kFSEventStreamEventIdSinceNow,
+            WATCH_LATENCY, kFSEventStreamCreateFlagFileEvents);
+    }
+
+    CFRelease(paths);
+
+    if (watcher->stream == nullptr)
+    {
+        delete watcher;
+        return nullptr;
+    }
+
+    FSEventStreamSetDispatchQueue(watcher->stream, dispatch_queue_create("Mod Watcher", DISPATCH_QUEUE_SERIAL));
+
+    if (!FSEventStreamStart(watcher->stream))
+    {
+        FSEventStreamInvalidate(watcher->stream);
+        FSEventStreamRelease(watcher->stream);
+        delete watcher;
+        return nullptr;
+    }
+
+    return watcher;
+}
+
+bool os::file_watcher::Wait(Watcher* watcher)
+{
+    std::unique_lock lock(watcher->mutex);
+    watcher->condition.wait(lock, [&]() { return watcher->isChanged; });
+    watcher->isChanged = false;
+
+    return true;
+}
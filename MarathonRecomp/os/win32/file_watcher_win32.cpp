@@ -0,0 +1,79 @@
+#include <os/file_watcher.h>
+
+struct WatchedDirectory
+{
+    HANDLE handle = INVALID_HANDLE_VALUE;
+    OVERLAPPED overlapped{};
+
+    // Only needed for the call, changes cause a full reindex so the names are never read.
+    alignas(DWORD) uint8_t buffer[0x1000];
+};
+
+struct os::file_watcher::Watcher
+{
+    HANDLE port = nullptr;
+    std::vector<std::unique_ptr<WatchedDirectory>> directories;
+};
+
+static bool ReadChanges(WatchedDirectory& directory)
+{
+    return ReadDirectoryChangesW(directory.handle, directory.buffer, sizeof(directory.buffer), TRUE,
+        FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME, nullptr, &directory.overlapped, nullptr);
+}
+
+os::file_watcher::Watcher* os::file_watcher::Create(const std::vector<std::filesystem::path>& directories)
+{
+    // Reads on every directory complete to a single port, so any amount of them can be waited on at once.
+    HANDLE port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, 1);
+    if (port == nullptr)
+        return nullptr;
+
+    auto watcher = std::make_unique<Watcher>();
+    watcher->port = port;
+
+    for (auto& directory : directories)
+    {
+        HANDLE handle = CreateFileW(directory.c_str(), FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+            nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, nullptr);
+
+        if (handle == INVALID_HANDLE_VALUE)
+            continue;
+
+        auto watchedDirectory = std::make_unique<WatchedDirectory>();
+        watchedDirectory->handle = handle;
+
+        if (CreateIoCompletionPort(handle, port, ULONG_PTR(watchedDirectory.get()), 0) == nullptr || !ReadChanges(*watchedDirectory))
+        {
+            CloseHandle(handle);
+            continue;
+        }
+
+        watcher->directories.emplace_back(std::move(watchedDirectory));
+    }
+
+    if (watcher->directories.empty())
+    {
+        CloseHandle(port);
+        return nullptr;
+    }
+
+    return watcher.release();
+}
+
+bool os::file_watcher::Wait(Watcher* watcher)
+{
+    DWORD bytesTransferred = 0;
+    ULONG_PTR key = 0;
+    OVERLAPPED* overlapped = nullptr;
+
+    BOOL result = GetQueuedCompletionStatus(watcher->port, &bytesTransferred, &key, &overlapped, INFINITE);
+    if (overlapped == nullptr)
+        return false;
+
+    // A failed read means the directory itself went away, which is a change too, but it can't be watched anymore.
+    // Zero bytes means more changes happened than fit in the buffer.
+    if (result)
+        ReadChanges(*reinterpret_cast<WatchedDirectory*>(key));
+
+    return true;
+}
@@ -8,6 +8,8 @@ CONFIG_DEFINE_LOCALISED("System", bool, Hints, true);
 CONFIG_DEFINE_LOCALISED("System", bool, ControlTutorial, true);
 CONFIG_DEFINE_LOCALISED("System", bool, AchievementNotifications, true);
 CONFIG_DEFINE("System", bool, ShowConsole, false);
+CONFIG_DEFINE("System", bool, MemoryMappedGameFiles, false);
+CONFIG_DEFINE("System", bool, PersistentPathIndex, true);
 
 CONFIG_DEFINE_ENUM_LOCALISED("Input", ECameraRotationMode, HorizontalCamera, ECameraRotationMode::Reverse);
 CONFIG_DEFINE_ENUM_LOCALISED("Input", ECameraRotationMode, VerticalCamera, ECameraRotationMode::Normal);
@@ -43,6 +45,12 @@ CONFIG_DEFINE_LOCALISED("Audio", float, MusicVolume, 1.0f);
 CONFIG_DEFINE_LOCALISED("Audio", float, EffectsVolume, 1.0f);
 CONFIG_DEFINE_ENUM_LOCALISED("Audio", EChannelConfiguration, ChannelConfiguration, EChannelConfiguration::Stereo);
 CONFIG_DEFINE_LOCALISED("Audio", bool, MusicAttenuation, false);
+CONFIG_DEFINE("Audio", uint32_t, AudioLatency, 20);
+CONFIG_DEFINE("Audio", float, DownmixCenterLevel, 0.75f);
+CONFIG_DEFINE("Audio", float, DownmixLFELevel, 0.0f);
+CONFIG_DEFINE("Audio", float, DownmixSurroundLevel, 1.0f);
+CONFIG_DEFINE("Audio", uint32_t, XmaCacheSize, 64);
+CONFIG_DEFINE("Audio", bool, PersistentXmaCache, false);
 
 CONFIG_DEFINE("Video", std::string, GraphicsDevice, "");
 CONFIG_DEFINE_ENUM("Video", EGraphicsAPI, GraphicsAPI, EGraphicsAPI::Auto);
@@ -0,0 +1,362 @@
+#include "path_index.h"
+#include <os/logger.h>
+#include <user/config.h>
+#include <user/paths.h>
+
+namespace PathIndex
+{
+    static constexpr uint32_t CACHE_SIGNATURE = 0x58444950; // PIDX
+    static constexpr uint32_t CACHE_VERSION = 1;
+    static constexpr uint32_t INVALID_NODE = ~0u;
+
+    // Root nodes have no parent and use the full root path as their name.
+    struct Node
+    {
+        uint32_t parent;
+        uint32_t nameOffset;
+        uint32_t nameLength;
+        uint32_t isDirectory;
+    };
+
+    struct Directory
+    {
+        uint32_t node;
+        int64_t lastWriteTime;
+    };
+
+    struct Root
+    {
+        std::string path;
+        uint32_t node;
+    };
+
+    // Only written to by Build, which runs before any guest thread is started.
+    static std::vector<Root> g_roots;
+    static std::vector<Node> g_nodes;
+    static std::vector<Directory> g_directories;
+    static std::string g_names;
+
+    // Keyed by the hash of the lower case name seeded with the parent node index,
+    // so a lookup needs neither per directory tables nor string allocations.
+    static ankerl::unordered_dense::map<uint64_t, uint32_t> g_children;
+
+    static std::string NormalizePath(std::string_view path)
+    {
+        std::string normalized(path);
+        std::replace(normalized.begin(), normalized.end(), '\\', '/');
+
+        while (normalized.size() > 1 && normalized.back() == '/')
+            normalized.pop_back();
+
+        return normalized;
+    }
+
+    static uint64_t HashName(std::string_view name, uint32_t parent)
+    {
+        thread_local std::string folded;
+        folded.resize(name.size());
+
+        for (size_t i = 0; i < name.size(); i++)
+            folded[i] = char(std::tolower(static_cast<unsigned char>(name[i])));
+
+        return XXH3_64bits_withSeed(folded.data(), folded.size(), parent);
+    }
+
+    static bool EqualsIgnoreCase(std::string_view left, std::string_view right)
+    {
+        return std::equal(left.begin(), left.end(), right.begin(), right.end(), [](char x, char y)
+            {
+                return std::tolower(static_cast<unsigned char>(x)) == std::tolower(static_cast<unsigned char>(y));
+            });
+    }
+
+    static std::string_view GetName(const Node& node)
+    {
+        return std::string_view(g_names).substr(node.nameOffset, node.nameLength);
+    }
+
+    static std::string GetNodePath(uint32_t index)
+    {
+        std::vector<std::string_view> names;
+
+        for (; index != INVALID_NODE; index = g_nodes[index].parent)
+            names.push_back(GetName(g_nodes[index]));
+
+        std::string path;
+
+        for (auto it = names.rbegin(); it != names.rend(); ++it)
+        {
+            if (!path.empty())
+                path += '/';
+
+            path += *it;
+        }
+
+        return path;
+    }
+
+    static int64_t GetLastWriteTime(std::string_view path)
+    {
+        std::error_code ec;
+        auto lastWriteTime = std::filesystem::last_write_time(std::u8string_view((const char8_t*)path.data(), path.size()), ec);
+        return ec ? -1 : int64_t(lastWriteTime.time_since_epoch().count());
+    }
+
+    static uint32_t AddNode(uint32_t parent, std::string_view name, bool isDirectory)
+    {
+        uint32_t index = uint32_t(g_nodes.size());
+
+        if (parent != INVALID_NODE)
+        {
+            // Names that only differ in casing can't be told apart by the guest anyway, first one wins.
+            if (!g_children.emplace(HashName(name, parent), index).second)
+                return INVALID_NODE;
+        }
+
+        g_nodes.push_back({ parent, uint32_t(g_names.size()), uint32_t(name.size()), isDirectory });
+        g_names += name;
+
+        return index;
+    }
+
+    static void AddDirectory(uint32_t rootIndex, const std::filesystem::path& rootPath)
+    {
+        std::vector<std::pair<std::filesystem::path, uint32_t>> pending;
+        pending.emplace_back(rootPath, rootIndex);
+
+        while (!pending.empty())
+        {
+            auto [directoryPath, directoryIndex] = std::move(pending.back());
+            pending.pop_back();
+
+            // Adding or removing an entry updates the modification time of the
+            // directory, which is all that's needed to tell if the index is stale.
+            g_directories.push_back({ directoryIndex, GetLastWriteTime(GetNodePath(directoryIndex)) });
+
+            std::error_code ec;
+            for (auto& entry : std::filesystem::directory_iterator(directoryPath, ec))
+            {
+                std::u8string nameU8 = entry.path().filename().u8string();
+                bool isDirectory = entry.is_directory(ec);
+
+                uint32_t index = AddNode(directoryIndex, std::string_view((const char*)nameU8.c_str(), nameU8.size()), isDirectory);
+                if (index != INVALID_NODE && isDirectory)
+                    pending.emplace_back(entry.path(), index);
+            }
+        }
+    }
+
+    static void Clear()
+    {
+        g_roots.clear();
+        g_nodes.clear();
+        g_directories.clear();
+        g_names.clear();
+        g_children.clear();
+    }
+
+    static bool Load(const std::vector<std::string>& rootPaths)
+    {
+        std::error_code ec;
+        uint64_t fileSize = std::filesystem::file_size(GetCachePath(), ec);
+        if (ec)
+            return false;
+
+        std::ifstream stream(GetCachePath(), std::ios::binary);
+        if (!stream.is_open())
+            return false;
+
+        auto read = [&](void* dest, size_t size)
+            {
+                stream.read(reinterpret_cast<char*>(dest), size);
+                return !stream.fail();
+            };
+
+        uint32_t header[6];
+        if (!read(header, sizeof(header)) || header[0] != CACHE_SIGNATURE || header[1] != CACHE_VERSION || header[2] != rootPaths.size())
+            return false;
+
+        uint32_t nodeCount = header[3];
+        uint32_t directoryCount = header[4];
+        uint32_t namesSize = header[5];
+
+        // Don't trust the counts of a truncated or corrupted file with an allocation.
+        if (uint64_t(nodeCount) * sizeof(Node) + uint64_t(directoryCount) * sizeof(Directory) + namesSize > fileSize)
+            return false;
+
+        Clear();
+
+        for (auto& rootPath : rootPaths)
+        {
+            uint32_t pathLength = 0;
+            uint32_t node = 0;
+            std::string path;
+
+            if (!read(&pathLength, sizeof(pathLength)) || pathLength != rootPath.size())
+                return false;
+
+            path.resize(pathLength);
+
+            if (!read(path.data(), path.size()) || !read(&node, sizeof(node)) || path != rootPath || node >= nodeCount)
+                return false;
+
+            g_roots.push_back({ std::move(path), node });
+        }
+
+        g_nodes.resize(nodeCount);
+        g_directories.resize(directoryCount);
+        g_names.resize(namesSize);
+
+        if (!read(g_nodes.data(), g_nodes.size() * sizeof(Node)) ||
+            !read(g_directories.data(), g_directories.size() * sizeof(Directory)) ||
+            !read(g_names.data(), g_names.size()))
+        {
+            return false;
+        }
+
+        for (uint32_t i = 0; i < nodeCount; i++)
+        {
+            auto& node = g_nodes[i];
+
+            // Parents are always added before their children.
+            if ((node.parent != INVALID_NODE && node.parent >= i) || node.nameOffset > namesSize || node.nameLength > namesSize - node.nameOffset)
+                return false;
+
+            if (node.parent != INVALID_NODE)
+                g_children.emplace(HashName(GetName(node), node.parent), i);
+        }
+
+        for (auto& directory : g_directories)
+        {
+            if (directory.node >= nodeCount || directory.lastWriteTime != GetLastWriteTime(GetNodePath(directory.node)))
+                return false;
+        }
+
+        return true;
+    }
+
+    static void Save()
+    {
+        std::filesystem::path path = GetCachePath();
+
+        std::error_code ec;
+        std::filesystem::create_directories(path.parent_path(), ec);
+
+        std::ofstream stream(path, std::ios::binary);
+        if (!stream.is_open())
+        {
+            LOGFN_ERROR("Failed to write path index to \"{}\".", path.string());
+            return;
+        }
+
+        uint32_t header[] = { CACHE_SIGNATURE, CACHE_VERSION, uint32_t(g_roots.size()), uint32_t(g_nodes.size()), uint32_t(g_directories.size()), uint32_t(g_names.size()) };
+        stream.write(reinterpret_cast<const char*>(header), sizeof(header));
+
+        for (auto& root : g_roots)
+        {
+            uint32_t pathLength = uint32_t(root.path.size());
+            stream.write(reinterpret_cast<const char*>(&pathLength), sizeof(pathLength));
+            stream.write(root.path.data(), root.path.size());
+            stream.write(reinterpret_cast<const char*>(&root.node), sizeof(root.node));
+        }
+
+        stream.write(reinterpret_cast<const char*>(g_nodes.data()), g_nodes.size() * sizeof(Node));
+        stream.write(reinterpret_cast<const char*>(g_directories.data()), g_directories.size() * sizeof(Directory));
+        stream.write(g_names.data(), g_names.size());
+
+        if (stream.bad())
+            LOGFN_ERROR("Failed to write path index to \"{}\".", path.string());
+    }
+
+    void Build(const std::vector<std::filesystem::path>& roots)
+    {
+        auto begin = std::chrono::steady_clock::now();
+
+        std::vector<std::string> rootPaths;
+
+        for (auto& root : roots)
+        {
+            std::u8string rootU8 = root.u8string();
+            rootPaths.push_back(NormalizePath(std::string_view((const char*)rootU8.c_str(), rootU8.size())));
+        }
+
+        if (Config::PersistentPathIndex && Load(rootPaths))
+        {
+            LOGFN("Loaded path index with {} entries in {} ms.", g_nodes.size(),
+                std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - begin).count());
+
+            return;
+        }
+
+        Clear();
+
+        for (size_t i = 0; i < roots.size(); i++)
+        {
+            uint32_t rootIndex = AddNode(INVALID_NODE, rootPaths[i], true);
+            g_roots.push_back({ rootPaths[i], rootIndex });
+
+            AddDirectory(rootIndex, roots[i]);
+        }
+
+        LOGFN("Built path index with {} entries in {} ms.", g_nodes.size(),
+            std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - begin).count());
+
+        if (Config::PersistentPathIndex)
+            Save();
+    }
+
+    std::filesystem::path Find(std::string_view path)
+    {
+        thread_local std::string normalized;
+        normalized = path;
+        std::replace(normalized.begin(), normalized.end(), '\\', '/');
+
+        const Root* root = nullptr;
+
+        for (auto& candidate : g_roots)
+        {
+            if (normalized.starts_with(candidate.path) && (normalized.size() == candidate.path.size() || normalized[candidate.path.size()] == '/') &&
+                (root == nullptr || candidate.path.size() > root->path.size()))
+            {
+                root = &candidate;
+            }
+        }
+
+        if (root == nullptr)
+            return {};
+
+        uint32_t index = root->node;
+        std::string_view remaining = std::string_view(normalized).substr(root->path.size());
+
+        while (!remaining.empty())
+        {
+            size_t separatorIndex = remaining.find('/');
+            std::string_view name = remaining.substr(0, separatorIndex);
+            remaining = separatorIndex == std::string_view::npos ? std::string_view() : remaining.substr(separatorIndex + 1);
+
+            if (name.empty() || name == ".")
+                continue;
+
+            if (name == ".." || !g_nodes[index].isDirectory)
+                return {};
+
+            auto findResult = g_children.find(HashName(name, index));
+            if (findResult == g_children.end())
+                return {};
+
+            auto& child = g_nodes[findResult->second];
+            if (child.parent != index || !EqualsIgnoreCase(GetName(child), name))
+                return {};
+
+            index = findResult->second;
+        }
+
+        std::string nodePath = GetNodePath(index);
+        return std::u8string_view((const char8_t*)nodePath.c_str(), nodePath.size());
+    }
+
+    std::filesystem::path GetCachePath()
+    {
+        return GetUserPath() / "path_index.bin";
+    }
+}
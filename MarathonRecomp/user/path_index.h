@@ -0,0 +1,18 @@
+#pragma once
+
+// Case-insensitive index of every file and directory under the game and DLC
+// roots. Guest paths are upper case more often than not while the files on disk
+// are not, so lookups go through here first to find the real casing instead of
+// letting the open fail. Mod files are indexed separately by the mod loader.
+// The index is persisted to the user directory and reused for as long as none
+// of the indexed directories have been modified.
+namespace PathIndex
+{
+    void Build(const std::vector<std::filesystem::path>& roots);
+
+    // Returns the path as it is on disk, or an empty path if
+    // it's outside of the indexed roots or does not exist.
+    std::filesystem::path Find(std::string_view path);
+
+    std::filesystem::path GetCachePath();
+}
@@ -0,0 +1,166 @@
+#include "byte_swap.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define BYTE_SWAP_X86
+#include <immintrin.h>
+#ifdef _WIN32
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define BYTE_SWAP_NEON
+#include <arm_neon.h>
+#endif
+
+template<typename T>
+static void ByteSwapCopyScalar(uint8_t* dest, const uint8_t* src, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        T value;
+        memcpy(&value, src + i * sizeof(T), sizeof(T));
+        value = ByteSwap(value);
+        memcpy(dest + i * sizeof(T), &value, sizeof(T));
+    }
+}
+
+#ifdef BYTE_SWAP_X86
+
+__attribute__((target("xsave")))
+static bool CheckAVX2()
+{
+    int info[4];
+
+#ifdef _WIN32
+    auto cpuid = [&](int leaf) { __cpuidex(info, leaf, 0); };
+#else
+    auto cpuid = [&](int leaf) { __cpuid_count(leaf, 0, info[0], info[1], info[2], info[3]); };
+#endif
+
+    cpuid(0);
+    if (info[0] < 7)
+        return false;
+
+    // The OS needs to preserve the YMM registers as well.
+    cpuid(1);
+    if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0)
+        return false;
+
+    if ((_xgetbv(0) & 0x6) != 0x6)
+        return false;
+
+    cpuid(7);
+    return (info[1] & (1 << 5)) != 0;
+}
+
+static const bool g_hasAVX2 = CheckAVX2();
+
+// Returns the amount of elements that were processed.
+template<typename T>
+__attribute__((target("ssse3")))
+static size_t ByteSwapCopySSSE3(uint8_t* dest, const uint8_t* src, size_t count, __m128i mask)
+{
+    constexpr size_t ELEMENTS_PER_VECTOR = sizeof(__m128i) / sizeof(T);
+
+    size_t i = 0;
+    for (; i + ELEMENTS_PER_VECTOR <= count; i += ELEMENTS_PER_VECTOR)
+    {
+        auto value = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * sizeof(T)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i * sizeof(T)), _mm_shuffle_epi8(value, mask));
+    }
+
+    return i;
+}
+
+template<typename T>
+__attribute__((target("avx2")))
+static size_t ByteSwapCopyAVX2(uint8_t* dest, const uint8_t* src, size_t count, __m128i mask)
+{
+    constexpr size_t ELEMENTS_PER_VECTOR = sizeof(__m256i) / sizeof(T);
+
+    auto wideMask = _mm256_broadcastsi128_si256(mask);
+
+    size_t i = 0;
+    for (; i + ELEMENTS_PER_VECTOR * 2 <= count; i += ELEMENTS_PER_VECTOR * 2)
+    {
+        auto first = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i * sizeof(T)));
+        auto second = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + (i + ELEMENTS_PER_VECTOR) * sizeof(T)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + i * sizeof(T)), _mm256_shuffle_epi8(first, wideMask));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + (i + ELEMENTS_PER_VECTOR) * sizeof(T)), _mm256_shuffle_epi8(second, wideMask));
+    }
+
+    for (; i + ELEMENTS_PER_VECTOR <= count; i += ELEMENTS_PER_VECTOR)
+    {
+        auto value = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i * sizeof(T)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + i * sizeof(T)), _mm256_shuffle_epi8(value, wideMask));
+    }
+
+    return i;
+}
+
+template<typename T>
+static void ByteSwapCopyVector(void* dest, const void* src, size_t count, __m128i mask)
+{
+    auto destBytes = reinterpret_cast<uint8_t*>(dest);
+    auto srcBytes = reinterpret_cast<const uint8_t*>(src);
+
+    size_t i = 0;
+
+    if (g_hasAVX2)
+        i = ByteSwapCopyAVX2<T>(destBytes, srcBytes, count, mask);
+
+    i += ByteSwapCopySSSE3<T>(destBytes + i * sizeof(T), srcBytes + i * sizeof(T), count - i, mask);
+
+    ByteSwapCopyScalar<T>(destBytes + i * sizeof(T), srcBytes + i * sizeof(T), count - i);
+}
+
+void ByteSwapCopy16(void* dest, const void* src, size_t count)
+{
+    ByteSwapCopyVector<uint16_t>(dest, src, count, _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14));
+}
+
+void ByteSwapCopy32(void* dest, const void* src, size_t count)
+{
+    ByteSwapCopyVector<uint32_t>(dest, src, count, _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12));
+}
+
+#elif defined(BYTE_SWAP_NEON)
+
+void ByteSwapCopy16(void* dest, const void* src, size_t count)
+{
+    auto destBytes = reinterpret_cast<uint8_t*>(dest);
+    auto srcBytes = reinterpret_cast<const uint8_t*>(src);
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+        vst1q_u8(destBytes + i * 2, vrev16q_u8(vld1q_u8(srcBytes + i * 2)));
+
+    ByteSwapCopyScalar<uint16_t>(destBytes + i * 2, srcBytes + i * 2, count - i);
+}
+
+void ByteSwapCopy32(void* dest, const void* src, size_t count)
+{
+    auto destBytes = reinterpret_cast<uint8_t*>(dest);
+    auto srcBytes = reinterpret_cast<const uint8_t*>(src);
+
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+        vst1q_u8(destBytes + i * 4, vrev32q_u8(vld1q_u8(srcBytes + i * 4)));
+
+    ByteSwapCopyScalar<uint32_t>(destBytes + i * 4, srcBytes + i * 4, count - i);
+}
+
+#else
+
+void ByteSwapCopy16(void* dest, const void* src, size_t count)
+{
+    ByteSwapCopyScalar<uint16_t>(reinterpret_cast<uint8_t*>(dest), reinterpret_cast<const uint8_t*>(src), count);
+}
+
+void ByteSwapCopy32(void* dest, const void* src, size_t count)
+{
+    ByteSwapCopyScalar<uint32_t>(reinterpret_cast<uint8_t*>(dest), reinterpret_cast<const uint8_t*>(src), count);
+}
+
+#endif
@@ -0,0 +1,24 @@
+#pragma once
+
+// Vectorized big endian to little endian copies for guest buffers. The count
+// is in elements, not bytes. Source and destination are not required to be aligned.
+void ByteSwapCopy16(void* dest, const void* src, size_t count);
+void ByteSwapCopy32(void* dest, const void* src, size_t count);
+
+template<typename T>
+inline void ByteSwapCopy(T* dest, const T* src, size_t count)
+{
+    if constexpr (sizeof(T) == 2)
+    {
+        ByteSwapCopy16(dest, src, count);
+    }
+    else if constexpr (sizeof(T) == 4)
+    {
+        ByteSwapCopy32(dest, src, count);
+    }
+    else
+    {
+        for (size_t i = 0; i < count; i++)
+            dest[i] = ByteSwap(src[i]);
+    }
+}
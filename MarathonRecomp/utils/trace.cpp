@@ -0,0 +1,304 @@
+#include "trace.h"
+#include <os/logger.h>
+#include <user/paths.h>
+
+namespace Trace
+{
+    enum class EventType : uint32_t
+    {
+        Scope,
+        Counter,
+        Instant
+    };
+
+    struct Event
+    {
+        const char* name;
+        EventType type;
+        uint32_t frame;
+        uint64_t timestamp;
+        int64_t value;
+    };
+
+    struct ThreadBuffer
+    {
+        // Roughly a few seconds of render thread commands.
+        static constexpr size_t EVENT_COUNT = 1 << 18;
+
+        Mutex mutex;
+        std::string name;
+        uint32_t id = 0;
+        std::unique_ptr<Event[]> events;
+        size_t writeIndex = 0;
+    };
+
+    static Mutex g_threadBufferMutex;
+    static std::vector<std::unique_ptr<ThreadBuffer>> g_threadBuffers;
+    static std::vector<ThreadBuffer*> g_freeThreadBuffers;
+    static uint32_t g_threadBufferId;
+
+    // Hands the buffer back when its thread exits, so short lived threads reuse
+    // the buffers of ones that are gone instead of allocating new ones every time.
+    // Events recorded by an exited thread are kept until its buffer gets reused.
+    struct ThreadBufferHolder
+    {
+        ThreadBuffer* threadBuffer = nullptr;
+
+        ~ThreadBufferHolder()
+        {
+            if (threadBuffer != nullptr)
+            {
+                std::lock_guard lock(g_threadBufferMutex);
+                g_freeThreadBuffers.push_back(threadBuffer);
+            }
+        }
+    };
+
+    static thread_local ThreadBufferHolder g_threadBuffer;
+
+    static ThreadBuffer* GetThreadBuffer()
+    {
+        if (g_threadBuffer.threadBuffer == nullptr)
+        {
+            std::lock_guard lock(g_threadBufferMutex);
+
+            ThreadBuffer* threadBuffer;
+
+            if (!g_freeThreadBuffers.empty())
+            {
+                threadBuffer = g_freeThreadBuffers.back();
+                g_freeThreadBuffers.pop_back();
+            }
+            else
+            {
+                threadBuffer = g_threadBuffers.emplace_back(std::make_unique<ThreadBuffer>()).get();
+            }
+
+            std::lock_guard threadLock(threadBuffer->mutex);
+            threadBuffer->id = ++g_threadBufferId;
+            threadBuffer->name = fmt::format("Thread {}", threadBuffer->id);
+            threadBuffer->writeIndex = 0;
+
+            g_threadBuffer.threadBuffer = threadBuffer;
+        }
+
+        return g_threadBuffer.threadBuffer;
+    }
+
+    static void AddEvent(const char* name, EventType type, uint64_t timestamp, int64_t value, uint32_t frame)
+    {
+        auto threadBuffer = GetThreadBuffer();
+        std::lock_guard lock(threadBuffer->mutex);
+
+        // Allocated lazily so threads that never record while capturing don't pay for it.
+        if (threadBuffer->events == nullptr)
+            threadBuffer->events = std::make_unique<Event[]>(ThreadBuffer::EVENT_COUNT);
+
+        auto& event = threadBuffer->events[threadBuffer->writeIndex % ThreadBuffer::EVENT_COUNT];
+        event.name = name;
+        event.type = type;
+        event.frame = frame;
+        event.timestamp = timestamp;
+        event.value = value;
+
+        ++threadBuffer->writeIndex;
+    }
+
+    uint64_t GetTimestamp()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void SetThreadName(const char* name)
+    {
+        auto threadBuffer = GetThreadBuffer();
+        std::lock_guard lock(threadBuffer->mutex);
+        threadBuffer->name = name;
+    }
+
+    void AddScope(const char* name, uint64_t begin, uint64_t end, uint32_t frame)
+    {
+        AddEvent(name, EventType::Scope, begin, int64_t(end - begin), frame);
+    }
+
+    void AddCounter(const char* name, int64_t value)
+    {
+        if (s_isRecording)
+            AddEvent(name, EventType::Counter, GetTimestamp(), value, s_frame);
+    }
+
+    void AddInstant(const char* name)
+    {
+        if (s_isRecording)
+            AddEvent(name, EventType::Instant, GetTimestamp(), 0, s_frame);
+    }
+
+    void StartRecording()
+    {
+        // Drop whatever is left from a previous capture, so it doesn't end up in this one's exports.
+        {
+            std::lock_guard lock(g_threadBufferMutex);
+
+            for (auto& threadBuffer : g_threadBuffers)
+            {
+                std::lock_guard threadLock(threadBuffer->mutex);
+                threadBuffer->writeIndex = 0;
+            }
+        }
+
+        s_isRecording = true;
+    }
+
+    void StopRecording()
+    {
+        s_isRecording = false;
+    }
+
+    static void AppendEscaped(std::string& out, std::string_view str)
+    {
+        for (char c : str)
+        {
+            if (c == '"' || c == '\\')
+                out += '\\';
+
+            if (static_cast<unsigned char>(c) >= 0x20)
+                out += c;
+        }
+    }
+
+    struct ThreadSnapshot
+    {
+        std::string name;
+        uint32_t id;
+        std::vector<Event> events;
+    };
+
+    static Mutex g_exportMutex;
+
+    static void WriteSnapshots(const std::vector<ThreadSnapshot>& snapshots, const std::filesystem::path& path)
+    {
+        std::string json = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+        bool isFirstEvent = true;
+
+        auto beginEvent = [&]()
+            {
+                if (!isFirstEvent)
+                    json += ",\n";
+
+                isFirstEvent = false;
+            };
+
+        uint64_t startTimestamp = UINT64_MAX;
+
+        for (auto& snapshot : snapshots)
+            startTimestamp = std::min(startTimestamp, snapshot.events.front().timestamp);
+
+        for (auto& snapshot : snapshots)
+        {
+            beginEvent();
+            json += fmt::format("{{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":{},\"args\":{{\"name\":\"", snapshot.id);
+            AppendEscaped(json, snapshot.name);
+            json += "\"}}";
+
+            for (auto& event : snapshot.events)
+            {
+                // Scopes are recorded on completion, so the oldest ones may start before the first event of another thread.
+                double timestamp = double(int64_t(event.timestamp - startTimestamp)) / 1000.0;
+
+                beginEvent();
+                json += "{\"name\":\"";
+                AppendEscaped(json, event.name);
+
+                switch (event.type)
+                {
+                case EventType::Scope:
+                    json += fmt::format("\",\"ph\":\"X\",\"pid\":1,\"tid\":{},\"ts\":{:.3f},\"dur\":{:.3f},\"args\":{{\"frame\":{}}}}}",
+                        snapshot.id, timestamp, double(event.value) / 1000.0, event.frame);
+                    break;
+
+                case EventType::Counter:
+                    json += fmt::format("\",\"ph\":\"C\",\"pid\":1,\"tid\":{},\"ts\":{:.3f},\"args\":{{\"value\":{}}}}}",
+                        snapshot.id, timestamp, event.value);
+                    break;
+
+                case EventType::Instant:
+                    json += fmt::format("\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":{},\"ts\":{:.3f},\"args\":{{\"frame\":{}}}}}",
+                        snapshot.id, timestamp, event.frame);
+                    break;
+                }
+            }
+        }
+
+        json += "]}\n";
+
+        std::error_code ec;
+        std::filesystem::create_directories(path.parent_path(), ec);
+
+        std::ofstream stream(path, std::ios::binary);
+        if (!stream.is_open())
+        {
+            LOGFN_ERROR("Failed to write trace to \"{}\".", path.string());
+            return;
+        }
+
+        stream.write(json.data(), json.size());
+
+        if (stream.bad())
+        {
+            LOGFN_ERROR("Failed to write trace to \"{}\".", path.string());
+            return;
+        }
+
+        LOGFN("Saved trace to \"{}\".", path.string());
+    }
+
+    void Export(const std::filesystem::path& path, bool wait)
+    {
+        // Only the copy happens on the calling thread. Formatting a full capture takes
+        // long enough that doing it here would show up as a hitch of its own.
+        std::vector<ThreadSnapshot> snapshots;
+
+        {
+            std::lock_guard lock(g_threadBufferMutex);
+
+            for (auto& threadBuffer : g_threadBuffers)
+            {
+                std::lock_guard threadLock(threadBuffer->mutex);
+
+                if (threadBuffer->writeIndex == 0)
+                    continue;
+
+                auto& snapshot = snapshots.emplace_back();
+                snapshot.name = threadBuffer->name;
+                snapshot.id = threadBuffer->id;
+
+                // Copy the ring in at most two runs, oldest event first.
+                size_t oldestIndex = threadBuffer->writeIndex > ThreadBuffer::EVENT_COUNT ? threadBuffer->writeIndex - ThreadBuffer::EVENT_COUNT : 0;
+                size_t begin = oldestIndex % ThreadBuffer::EVENT_COUNT;
+                size_t count = threadBuffer->writeIndex - oldestIndex;
+                size_t firstCount = std::min(count, ThreadBuffer::EVENT_COUNT - begin);
+
+                snapshot.events.reserve(count);
+                snapshot.events.insert(snapshot.events.end(), threadBuffer->events.get() + begin, threadBuffer->events.get() + begin + firstCount);
+                snapshot.events.insert(snapshot.events.end(), threadBuffer->events.get(), threadBuffer->events.get() + (count - firstCount));
+            }
+        }
+
+        std::thread thread([snapshots = std::move(snapshots), path]
+            {
+                // Exports started in quick succession may share a path, so write them one at a time.
+                std::lock_guard lock(g_exportMutex);
+                WriteSnapshots(snapshots, path);
+            });
+
+        if (wait)
+            thread.join();
+        else
+            thread.detach();
+    }
+
+    std::filesystem::path GetExportPath()
+    {
+        return GetUserPath() / "traces" / fmt::format("trace_{}.json", std::chrono::system_clock::now().time_since_epoch() / std::chrono::seconds(1));
+    }
+}
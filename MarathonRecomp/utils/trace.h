@@ -0,0 +1,50 @@
+#pragma once
+
+// Frame timeline for finding hitches. Every thread records into its own rolling
+// buffer while a capture is active, and the buffers can be exported at any time
+// as Chrome trace JSON, which can be opened in ui.perfetto.dev or chrome://tracing.
+// Event names are not copied and must point to static storage.
+namespace Trace
+{
+    inline std::atomic<bool> s_isRecording;
+    inline std::atomic<uint32_t> s_frame;
+
+    uint64_t GetTimestamp();
+
+    void SetThreadName(const char* name);
+
+    void AddScope(const char* name, uint64_t begin, uint64_t end, uint32_t frame);
+    void AddCounter(const char* name, int64_t value);
+    void AddInstant(const char* name);
+
+    void StartRecording();
+    void StopRecording();
+
+    // Formats and writes the buffers in the background, unless the caller
+    // has to wait for the file, like when the process is about to exit.
+    void Export(const std::filesystem::path& path, bool wait = false);
+
+    std::filesystem::path GetExportPath();
+
+    inline void BeginFrame()
+    {
+        ++s_frame;
+    }
+}
+
+struct TraceScope
+{
+    const char* name;
+    uint64_t begin;
+    uint32_t frame;
+
+    TraceScope(const char* name) : name(name), begin(Trace::s_isRecording ? Trace::GetTimestamp() : 0), frame(Trace::s_frame)
+    {
+    }
+
+    ~TraceScope()
+    {
+        if (begin != 0 && Trace::s_isRecording)
+            Trace::AddScope(name, begin, Trace::GetTimestamp(), frame);
+    }
+};
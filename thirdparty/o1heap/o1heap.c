@@ -449,6 +449,110 @@ void o1heapFree(O1HeapInstance* const handle, void* const pointer)
     }
 }
 
+bool o1heapReallocateInPlace(O1HeapInstance* const handle, void* const pointer, const size_t amount)
+{
+    O1HEAP_ASSERT(handle != NULL);
+    O1HEAP_ASSERT(handle->diagnostics.capacity <= FRAGMENT_SIZE_MAX);
+
+    if ((pointer == NULL) || (amount == 0U) || (amount > (handle->diagnostics.capacity - O1HEAP_ALIGNMENT)))
+    {
+        return false;
+    }
+
+    Fragment* const frag = (Fragment*)(void*)(((char*)pointer) - O1HEAP_ALIGNMENT);
+    O1HEAP_ASSERT(frag->header.used);
+    O1HEAP_ASSERT((frag->header.size % FRAGMENT_SIZE_MIN) == 0U);
+
+    const size_t fragment_size = roundUpToPowerOf2(amount + O1HEAP_ALIGNMENT);
+    const size_t old_size      = frag->header.size;
+    Fragment* const next       = frag->header.next;
+
+    if (fragment_size == old_size)
+    {
+        return true;
+    }
+
+    if (fragment_size < old_size)  // [ this ][ next ] => [ this ][ leftover (+ next if free) ]
+    {
+        Fragment* const new_frag = (Fragment*)(void*)(((char*)frag) + fragment_size);
+        new_frag->header.size    = old_size - fragment_size;
+        new_frag->header.used    = false;
+        if ((next != NULL) && (!next->header.used))
+        {
+            unbin(handle, next);
+            new_frag->header.size += next->header.size;
+            next->header.size = 0;
+            interlink(new_frag, next->header.next);
+        }
+        else
+        {
+            interlink(new_frag, next);
+        }
+        frag->header.size = fragment_size;
+        interlink(frag, new_frag);
+        rebin(handle, new_frag);
+
+        O1HEAP_ASSERT(handle->diagnostics.allocated >= (old_size - fragment_size));
+        handle->diagnostics.allocated -= old_size - fragment_size;
+        return true;
+    }
+
+    if ((next == NULL) || next->header.used || ((old_size + next->header.size) < fragment_size))
+    {
+        return false;
+    }
+
+    // [ this ][ next ] => [ --- this --- ][ leftover ]
+    // The header of the next fragment may be overwritten by the grown block, so read everything out of it first.
+    unbin(handle, next);
+    Fragment* const after    = next->header.next;
+    const size_t    leftover = (old_size + next->header.size) - fragment_size;
+    next->header.size        = 0;
+    O1HEAP_ASSERT((leftover % FRAGMENT_SIZE_MIN) == 0U);
+
+    frag->header.size = fragment_size;
+    if (leftover >= FRAGMENT_SIZE_MIN)
+    {
+        Fragment* const new_frag = (Fragment*)(void*)(((char*)frag) + fragment_size);
+        new_frag->header.size    = leftover;
+        new_frag->header.used    = false;
+        interlink(new_frag, after);
+        interlink(frag, new_frag);
+        rebin(handle, new_frag);
+    }
+    else
+    {
+        interlink(frag, after);
+    }
+
+    handle->diagnostics.allocated += fragment_size - old_size;
+    O1HEAP_ASSERT(handle->diagnostics.allocated <= handle->diagnostics.capacity);
+    if (handle->diagnostics.peak_allocated < handle->diagnostics.allocated)
+    {
+        handle->diagnostics.peak_allocated = handle->diagnostics.allocated;
+    }
+    if (handle->diagnostics.peak_request_size < amount)
+    {
+        handle->diagnostics.peak_request_size = amount;
+    }
+    return true;
+}
+
+void o1heapTraverse(const O1HeapInstance* const handle, const O1HeapFragmentVisitor visitor, void* const context)
+{
+    O1HEAP_ASSERT(handle != NULL);
+    O1HEAP_ASSERT(visitor != NULL);
+
+    // The root fragment never gets merged into a predecessor, so the first fragment always stays at the arena start.
+    const Fragment* frag = (const Fragment*)(const void*)(((const char*)handle) + INSTANCE_SIZE_PADDED);
+    while (frag != NULL)
+    {
+        O1HEAP_ASSERT(frag->header.size >= FRAGMENT_SIZE_MIN);
+        visitor(context, frag->header.size, frag->header.used);
+        frag = frag->header.next;
+    }
+}
+
 bool o1heapDoInvariantsHold(const O1HeapInstance* const handle)
 {
     O1HEAP_ASSERT(handle != NULL);
@@ -104,6 +104,25 @@ extern "C" {
     /// The function is executed in constant time.
     void o1heapFree(O1HeapInstance* const handle, void* const pointer);
 
+    /// Attempts to resize a previously allocated block without moving it. The block is shrunk by returning its tail
+    /// to the heap, or grown by taking over the free fragment that immediately follows it.
+    ///
+    /// If the block could be resized in place, the function returns truth and the pointer stays valid with the new
+    /// size. Otherwise, falsity is returned and the block is left untouched; the caller is then expected to allocate
+    /// a new block and copy the contents over. A zero amount or a NULL pointer always yields falsity.
+    ///
+    /// The function is executed in constant time.
+    bool o1heapReallocateInPlace(O1HeapInstance* const handle, void* const pointer, const size_t amount);
+
+    /// Invoked by o1heapTraverse() for every fragment of the heap in address order.
+    typedef void (*O1HeapFragmentVisitor)(void* const context, const size_t size, const bool used);
+
+    /// Walks all fragments of the heap, used and free, and reports their sizes (including the per-fragment overhead)
+    /// to the visitor. This is meant for diagnostics only.
+    ///
+    /// The function is executed in linear time with respect to the number of fragments.
+    void o1heapTraverse(const O1HeapInstance* const handle, const O1HeapFragmentVisitor visitor, void* const context);
+
     /// Performs a basic sanity check on the heap.
     /// This function can be used as a weak but fast method of heap corruption detection.
     /// If the handle pointer is NULL, the behavior is undefined.
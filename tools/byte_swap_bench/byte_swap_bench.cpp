@@ -0,0 +1,79 @@
+//
+// byte_swap_bench - Compares the vectorized guest byte swap copies against
+// a scalar loop over buffer sizes typical for vertex, index and audio data.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include <utils/byte_swap.h>
+
+template<typename T>
+static void ByteSwapCopyScalar(T* dest, const T* src, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        dest[i] = ByteSwap(src[i]);
+}
+
+template<typename TFunction>
+static double Measure(TFunction&& function, size_t bytes, size_t iterations)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    for (size_t i = 0; i < iterations; i++)
+        function();
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return double(bytes) * iterations / seconds / (1024.0 * 1024.0 * 1024.0);
+}
+
+template<typename T>
+static bool Run(size_t bytes, size_t iterations)
+{
+    size_t count = bytes / sizeof(T);
+
+    // Offset the source by one element to cover the unaligned paths.
+    std::vector<T> src(count + 1);
+    std::vector<T> scalar(count);
+    std::vector<T> vector(count);
+
+    std::mt19937 random(bytes);
+    for (auto& value : src)
+        value = T(random());
+
+    double scalarRate = Measure([&] { ByteSwapCopyScalar(scalar.data(), src.data() + 1, count); }, bytes, iterations);
+    double vectorRate = Measure([&] { ByteSwapCopy(vector.data(), src.data() + 1, count); }, bytes, iterations);
+
+    if (scalar != vector)
+    {
+        printf("%zu-bit copy of %zu bytes does not match the scalar result!\n", sizeof(T) * 8, bytes);
+        return false;
+    }
+
+    printf("%2zu-bit %10zu bytes: scalar %8.2f GiB/s, vector %8.2f GiB/s (%.2fx)\n",
+        sizeof(T) * 8, bytes, scalarRate, vectorRate, vectorRate / scalarRate);
+
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    // Roughly the same amount of data is swapped for every buffer size.
+    size_t totalBytes = (argc > 1 ? strtoull(argv[1], nullptr, 10) : 1024) * 1024 * 1024;
+    bool result = true;
+
+    for (size_t bytes : { 64, 1000, 4096, 65536, 1048576, 16777216 })
+    {
+        size_t iterations = std::max<size_t>(totalBytes / bytes, 1);
+
+        result &= Run<uint16_t>(bytes, iterations);
+        result &= Run<uint32_t>(bytes, iterations);
+    }
+
+    return result ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,194 @@
+//
+// kernel_object_bench - Hammers event set/wait from many threads through
+// QueryKernelObject, the path every guest event, semaphore and wait import
+// takes. The "locked" column wraps each lookup in one global mutex, the way
+// the lookups were serialized before they became lock free.
+//
+// Every round starts from fresh guest headers, so the threads also race to
+// create the host objects.
+//
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+
+#include <xbox.h>
+#include <o1heap.h>
+#include <ankerl/unordered_dense.h>
+
+// Small stand-in for the recompiled code's guest memory, the benchmark only needs the heap and objects in it.
+#define PPC_MEMORY_SIZE 0x4000000ull
+#define PPC_LOOKUP_FUNC(x, y) *(PPCFunc**)((x) + (y))
+
+struct PPCContext;
+using PPCFunc = void(PPCContext& ctx, uint8_t* base);
+
+#include <kernel/xdm.h>
+
+constexpr size_t EVENT_COUNT = 64;
+constexpr size_t ROUND_COUNT = 64;
+constexpr size_t OPERATIONS_PER_ROUND = 0x4000;
+
+Memory g_memory;
+Heap g_userHeap;
+
+static std::atomic<uint32_t> g_liveObjects;
+
+Memory::Memory()
+{
+    base = static_cast<uint8_t*>(operator new(PPC_MEMORY_SIZE, std::align_val_t(0x1000)));
+}
+
+void* Heap::AllocPhysical(size_t size, size_t alignment)
+{
+    std::lock_guard lock(physicalMutex);
+
+    void* ptr = o1heapAllocate(physicalHeap, size + alignment);
+    size_t aligned = ((size_t)ptr + alignment) & ~(alignment - 1);
+
+    *((void**)aligned - 1) = ptr;
+
+    return (void*)aligned;
+}
+
+void Heap::Free(void* ptr)
+{
+    std::lock_guard lock(physicalMutex);
+    o1heapFree(physicalHeap, *((void**)ptr - 1));
+}
+
+void DestroyKernelObject(KernelObject* obj)
+{
+    obj->~KernelObject();
+    g_userHeap.Free(obj);
+}
+
+// Same signaling as the auto reset kernel event, without the waiter list used by multiple object waits.
+struct BenchEvent final : KernelObject, HostObject<XKEVENT>
+{
+    std::atomic<bool> signaled;
+
+    BenchEvent(XKEVENT* header)
+        : signaled(!!header->SignalState)
+    {
+        ++g_liveObjects;
+    }
+
+    ~BenchEvent() override
+    {
+        --g_liveObjects;
+    }
+
+    bool Set()
+    {
+        signaled = true;
+        signaled.notify_one();
+        return true;
+    }
+
+    bool TryWait()
+    {
+        bool expected = true;
+        return signaled.compare_exchange_strong(expected, false);
+    }
+};
+
+template<bool Locked>
+static BenchEvent* Query(XKEVENT& event)
+{
+    if constexpr (Locked)
+    {
+        static Mutex s_kernelLock;
+        std::lock_guard lock(s_kernelLock);
+
+        return QueryKernelObject<BenchEvent>(event);
+    }
+    else
+    {
+        return QueryKernelObject<BenchEvent>(event);
+    }
+}
+
+template<bool Locked>
+static double Run(XKEVENT* events, size_t threadCount)
+{
+    double seconds = 0.0;
+
+    for (size_t round = 0; round < ROUND_COUNT; round++)
+    {
+        memset(events, 0, sizeof(XKEVENT) * EVENT_COUNT);
+
+        std::atomic<size_t> readyCount = 0;
+        std::atomic<bool> start = false;
+        std::vector<std::thread> threads;
+
+        for (size_t i = 0; i < threadCount; i++)
+        {
+            threads.emplace_back([&, i]
+            {
+                ++readyCount;
+                start.wait(false);
+
+                // Each thread signals an event and consumes the signal of its neighbour.
+                for (size_t j = 0; j < OPERATIONS_PER_ROUND; j++)
+                {
+                    size_t index = (i * 7 + j) % EVENT_COUNT;
+                    Query<Locked>(events[index])->Set();
+                    Query<Locked>(events[(index + 1) % EVENT_COUNT])->TryWait();
+                }
+            });
+        }
+
+        while (readyCount != threadCount)
+            std::this_thread::yield();
+
+        auto begin = std::chrono::steady_clock::now();
+        start = true;
+        start.notify_all();
+
+        for (auto& thread : threads)
+            thread.join();
+
+        seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+        // Threads that lost the creation race must have destroyed their objects.
+        if (g_liveObjects != EVENT_COUNT)
+        {
+            printf("%u host objects were created for %zu events!\n", g_liveObjects.load(), EVENT_COUNT);
+            exit(EXIT_FAILURE);
+        }
+
+        for (size_t i = 0; i < EVENT_COUNT; i++)
+            DestroyKernelObject(TryQueryKernelObject<BenchEvent>(events[i]));
+    }
+
+    return double(ROUND_COUNT * OPERATIONS_PER_ROUND * threadCount * 2) / seconds / 1000000.0;
+}
+
+int main(int argc, char* argv[])
+{
+    g_userHeap.physicalHeap = o1heapInit(g_memory.Translate(0x10000), PPC_MEMORY_SIZE - 0x10000);
+
+    auto* events = static_cast<XKEVENT*>(g_memory.Translate(0x1000));
+    size_t maxThreadCount = argc > 1 ? strtoull(argv[1], nullptr, 10) : std::max(std::thread::hardware_concurrency(), 2u);
+
+    for (size_t threadCount = 1; threadCount <= maxThreadCount; threadCount *= 2)
+    {
+        double lockedRate = Run<true>(events, threadCount);
+        double lockFreeRate = Run<false>(events, threadCount);
+
+        printf("%3zu threads: locked %8.2f Mops/s, lock free %8.2f Mops/s (%.2fx)\n",
+            threadCount, lockedRate, lockFreeRate, lockFreeRate / lockedRate);
+    }
+
+    return EXIT_SUCCESS;
+}
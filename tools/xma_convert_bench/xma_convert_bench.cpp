@@ -0,0 +1,98 @@
+//
+// xma_convert_bench - Measures the conversion of decoded XMA frames from
+// FFmpeg's planar float output to the interleaved big endian PCM the game
+// reads, against a scalar loop. Frames are converted whole and in the
+// partial slices the decoder produces after seeks.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include <apu/xma_convert.h>
+
+constexpr uint32_t SAMPLES_PER_FRAME = 512;
+constexpr uint32_t FRAME_COUNT = 1024;
+
+static void ConvertSamplesScalar(int16_t* out, const float* const* planes, uint32_t channelCount, uint32_t first, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        for (uint32_t j = 0; j < channelCount; j++)
+            out[i * channelCount + j] = ByteSwap(static_cast<int16_t>(std::clamp(planes[j][first + i], -1.0f, 1.0f) * ((1 << 15) - 1)));
+    }
+}
+
+template<typename TFunction>
+static double Measure(TFunction&& function, size_t samples, size_t iterations)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    for (size_t i = 0; i < iterations; i++)
+        function();
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return double(samples) * iterations / seconds / 1000000.0;
+}
+
+static bool Run(uint32_t channelCount, uint32_t first, size_t iterations)
+{
+    // Raw decoder output sometimes goes past [-1, 1], so cover the clamping too.
+    std::mt19937 random(channelCount);
+    std::uniform_real_distribution<float> distribution(-1.25f, 1.25f);
+    std::vector<std::vector<float>> planes(channelCount, std::vector<float>(SAMPLES_PER_FRAME * FRAME_COUNT));
+
+    for (auto& plane : planes)
+    {
+        for (auto& sample : plane)
+            sample = distribution(random);
+    }
+
+    std::vector<const float*> framePlanes(channelCount);
+    std::vector<int16_t> scalar(SAMPLES_PER_FRAME * FRAME_COUNT * channelCount);
+    std::vector<int16_t> vector(scalar.size());
+
+    auto convert = [&](auto&& function, std::vector<int16_t>& out)
+    {
+        for (uint32_t i = 0; i < FRAME_COUNT; i++)
+        {
+            for (uint32_t j = 0; j < channelCount; j++)
+                framePlanes[j] = planes[j].data() + i * SAMPLES_PER_FRAME;
+
+            function(out.data() + i * SAMPLES_PER_FRAME * channelCount, framePlanes.data(), channelCount, first, SAMPLES_PER_FRAME - first);
+        }
+    };
+
+    size_t samples = size_t(SAMPLES_PER_FRAME - first) * FRAME_COUNT;
+    double scalarRate = Measure([&] { convert(ConvertSamplesScalar, scalar); }, samples, iterations);
+    double vectorRate = Measure([&] { convert(XMAConvertSamples, vector); }, samples, iterations);
+
+    if (scalar != vector)
+    {
+        printf("Conversion of %u channel(s) from sample %u does not match the scalar result!\n", channelCount, first);
+        return false;
+    }
+
+    printf("%u channel(s), from sample %3u: scalar %8.2f Msamples/s, vector %8.2f Msamples/s (%.2fx)\n",
+        channelCount, first, scalarRate, vectorRate, vectorRate / scalarRate);
+
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    size_t iterations = argc > 1 ? strtoull(argv[1], nullptr, 10) : 64;
+    bool result = true;
+
+    for (uint32_t channelCount : { 1, 2, 6 })
+    {
+        for (uint32_t first : { 0, 3, 128 })
+            result &= Run(channelCount, first, iterations);
+    }
+
+    return result ? EXIT_SUCCESS : EXIT_FAILURE;
+}